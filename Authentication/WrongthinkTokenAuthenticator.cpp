@@ -30,7 +30,7 @@ Status WrongthinkAuthMetadataProcessor::Process(const grpc::AuthMetadataProcesso
   return Status::OK;
 }
 
-bool hasCredentials(ServerContext* context) {
+bool hasCredentials(grpc_impl::ServerContextBase* context) {
   auto cmeta = context->client_metadata();
   if (cmeta.count(AUTH_UNAME_KEY) == 0)
     return false;
@@ -39,7 +39,7 @@ bool hasCredentials(ServerContext* context) {
   return true;
 }
 
-std::pair<std::string, std::string> getCredentials(ServerContext* context) {
+std::pair<std::string, std::string> getCredentials(grpc_impl::ServerContextBase* context) {
   auto cmeta = context->client_metadata();
 
   auto uname = cmeta.find(AUTH_UNAME_KEY);
@@ -55,8 +55,8 @@ class WrongthinkAuthMetadataProcessor : public grpc::AuthMetadataProcessor {
   bool is_blocking_;
 };
 
-bool hasCredentials(ServerContext* context);
-std::pair<std::string, std::string> getCredentials(ServerContext* context);
+bool hasCredentials(grpc_impl::ServerContextBase* context);
+std::pair<std::string, std::string> getCredentials(grpc_impl::ServerContextBase* context);
 void addCredentials(grpc::ClientContext* context, WrongthinkUser* user);
 
 }
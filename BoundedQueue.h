@@ -0,0 +1,95 @@
+/*
+This file is part of Wrongthink.
+
+Wrongthink - Modern, open & performant chat protocol. Based on gRPC.
+Copyright (C) 2020 Ophiuchus2
+
+This program is free software: you can redistribute it and/or modify it under the
+terms of the GNU Affero General Public License as published by the Free Software Foundation,
+either version 3 of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License along with this program.
+If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef BOUNDED_QUEUE_H
+#define BOUNDED_QUEUE_H
+
+#include <deque>
+#include <mutex>
+#include <exception>
+#include <condition_variable>
+
+/*
+ * Blocking FIFO of at most capacity items between one producer & one
+ * consumer. Either side can close() it, which stops the other: push() fails
+ * once closed, pop() drains what is left & then fails. A producer that
+ * throws hands the error to the consumer through fail().
+ */
+template <typename T>
+class BoundedQueue {
+public:
+  explicit BoundedQueue(size_t capacity) : capacity_{capacity == 0 ? 1 : capacity} {}
+
+  /* blocks while full, false once closed */
+  bool push(T item) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    notFull_.wait(lock, [this]() { return closed_ || items_.size() < capacity_; });
+    if (closed_)
+      return false;
+    items_.push_back(std::move(item));
+    notEmpty_.notify_one();
+    return true;
+  }
+
+  /* blocks while empty, false once closed & drained. rethrows the error
+     passed to fail() */
+  bool pop(T& item) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    notEmpty_.wait(lock, [this]() { return closed_ || !items_.empty(); });
+    if (items_.empty()) {
+      if (error_)
+        std::rethrow_exception(error_);
+      return false;
+    }
+    item = std::move(items_.front());
+    items_.pop_front();
+    notFull_.notify_one();
+    return true;
+  }
+
+  /* true while nothing is ready, the consumer would block */
+  bool empty() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return items_.empty();
+  }
+
+  void close() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closed_ = true;
+    notFull_.notify_all();
+    notEmpty_.notify_all();
+  }
+
+  void fail(std::exception_ptr error) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    error_ = error;
+    closed_ = true;
+    notFull_.notify_all();
+    notEmpty_.notify_all();
+  }
+
+private:
+  size_t capacity_;
+  mutable std::mutex mutex_;
+  std::condition_variable notFull_;
+  std::condition_variable notEmpty_;
+  std::deque<T> items_;
+  bool closed_ = false;
+  std::exception_ptr error_;
+};
+
+#endif // BOUNDED_QUEUE_H
@@ -0,0 +1,280 @@
+/*
+This file is part of Wrongthink.
+
+Wrongthink - Modern, open & performant chat protocol. Based on gRPC.
+Copyright (C) 2020 Ophiuchus2
+
+This program is free software: you can redistribute it and/or modify it under the
+terms of the GNU Affero General Public License as published by the Free Software Foundation,
+either version 3 of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License along with this program.
+If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "ChannelListenReactor.h"
+#include <algorithm>
+
+namespace {
+
+/* frames payload as one element of WrongthinkMessageBatch.messages: the
+   field's tag & the length as a varint, followed by the payload's slices */
+void appendBatchElement(const grpc::ByteBuffer& payload, std::vector<grpc::Slice>& slices) {
+  uint8_t header[11];
+  size_t size = 0;
+  // field 1, length delimited
+  header[size++] = 0x0a;
+  uint64_t length = payload.Length();
+  do {
+    uint8_t byte = length & 0x7f;
+    length >>= 7;
+    header[size++] = length ? byte | 0x80 : byte;
+  } while (length);
+  slices.emplace_back(header, size);
+  std::vector<grpc::Slice> parts;
+  payload.Dump(&parts);
+  slices.insert(slices.end(), parts.begin(), parts.end());
+}
+
+}
+
+ChannelListenReactor::ChannelListenReactor(std::shared_ptr<SynchronizedChannel> channel,
+                                           std::shared_ptr<spdlog::logger> logger,
+                                           const ListenBatching& batching,
+                                           bool batched) :
+  ChannelListenReactor(logger, batching, batched)
+{
+  attach(channel);
+}
+
+ChannelListenReactor::ChannelListenReactor(std::shared_ptr<spdlog::logger> logger,
+                                           const ListenBatching& batching,
+                                           bool batched) :
+  channel_{},
+  logger_{logger},
+  batching_{batching},
+  batched_{batched},
+  cursor_{0},
+  pending_{},
+  pendingPos_{0},
+  gapSkipped_{0},
+  gapStoredId_{0},
+  gapMarker_{},
+  batch_{},
+  batchLeft_{0},
+  gatherDone_{false},
+  lastFlush_{},
+  gatherAlarm_{},
+  gathering_{false},
+  gatherTarget_{0},
+  // grpc's reference & the pending attach()
+  refs_{2},
+  writing_{false},
+  attachMutex_{},
+  done_{false},
+  finishMutex_{},
+  finished_{false}
+{
+  if (batching_.maxBatch == 0)
+    batching_.maxBatch = 1;
+}
+
+void ChannelListenReactor::attach(std::shared_ptr<SynchronizedChannel> channel) {
+  if (!channel) {
+    abandon(grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, ""));
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(attachMutex_);
+    // the stream was cancelled while the channel loaded
+    if (!done_) {
+      channel_ = channel;
+      // only deliver messages published after the listener attached
+      cursor_ = channel_->headSeq();
+      channel_->addListener(this);
+    }
+  }
+  unref();
+}
+
+void ChannelListenReactor::abandon(const grpc::Status& status) {
+  finish(status);
+  unref();
+}
+
+void ChannelListenReactor::onMessageAvailable() {
+  // whoever flips writing_ owns the cursor until it is released again
+  if (!writing_.exchange(true)) {
+    writeNext();
+    return;
+  }
+  // a gathered batch is full, flush it now instead of waiting for the alarm
+  if (gathering_.load() && channel_->headSeq() >= gatherTarget_.load())
+    gatherAlarm_.Cancel();
+}
+
+void ChannelListenReactor::OnWriteDone(bool ok) {
+  if (!ok) {
+    finish(grpc::Status(grpc::StatusCode::UNAVAILABLE, ""));
+    return;
+  }
+  writeNext();
+}
+
+void ChannelListenReactor::OnCancel() {
+  finish(grpc::Status::CANCELLED);
+}
+
+void ChannelListenReactor::OnDone() {
+  std::shared_ptr<SynchronizedChannel> channel;
+  {
+    std::lock_guard<std::mutex> lock(attachMutex_);
+    done_ = true;
+    channel = channel_;
+  }
+  // once removeListener() returns no publisher can call back into us
+  if (channel)
+    channel->removeListener(this);
+  if (gathering_.load())
+    gatherAlarm_.Cancel();
+  unref();
+}
+
+void ChannelListenReactor::unref() {
+  if (refs_.fetch_sub(1) == 1)
+    delete this;
+}
+
+void ChannelListenReactor::writeNext() {
+  while (true) {
+    if (batchLeft_ == 0) {
+      // starting a batch, pick up everything published since the last read
+      if (pendingPos_ == pending_.size()) {
+        pending_.clear();
+        pendingPos_ = 0;
+      }
+      size_t lost = channel_->readMessages(cursor_, pending_);
+      if (!enforceBudget(lost))
+        return;
+      if (gapSkipped_) {
+        WrongthinkMessage marker = makeGapMarker(channel_->getChannel().channelid(),
+                                                 gapSkipped_, gapStoredId_);
+        gapSkipped_ = 0;
+        gapStoredId_ = 0;
+        bool ownBuffer;
+        grpc::SerializationTraits<WrongthinkMessage>::Serialize(marker, &gapMarker_, &ownBuffer);
+        if (batched_) {
+          // a batch of its own, the backlog after it goes out next
+          std::vector<grpc::Slice> slices;
+          appendBatchElement(gapMarker_, slices);
+          gapMarker_ = grpc::ByteBuffer(slices.data(), slices.size());
+        }
+        lastFlush_ = std::chrono::steady_clock::now();
+        std::lock_guard<std::mutex> lock(finishMutex_);
+        if (finished_)
+          return;
+        StartWrite(&gapMarker_);
+        return;
+      }
+      size_t backlog = pending_.size() - pendingPos_;
+      if (backlog == 0) {
+        // idle, release ownership & make sure we didn't race with an append
+        uint64_t cursor = cursor_;
+        writing_.store(false);
+        if (channel_->headSeq() <= cursor || writing_.exchange(true))
+          return;
+        continue;
+      }
+      if (!gatherDone_ && backlog < batching_.maxBatch && isHot()) {
+        armGather(backlog);
+        return;
+      }
+      gatherDone_ = false;
+      if (batched_) {
+        writeBatch(std::min(backlog, batching_.maxBatch));
+        return;
+      }
+      batchLeft_ = std::min(backlog, batching_.maxBatch);
+    }
+
+    grpc::WriteOptions options;
+    if (--batchLeft_ > 0)
+      options.set_buffer_hint();
+    else
+      lastFlush_ = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(finishMutex_);
+    if (finished_)
+      return;
+    StartWrite(&pending_[pendingPos_++]->payload, options);
+    return;
+  }
+}
+
+void ChannelListenReactor::writeBatch(size_t count) {
+  std::vector<grpc::Slice> slices;
+  slices.reserve(count * 2);
+  for (size_t i = 0; i < count; i++)
+    appendBatchElement(pending_[pendingPos_++]->payload, slices);
+  batch_ = grpc::ByteBuffer(slices.data(), slices.size());
+  lastFlush_ = std::chrono::steady_clock::now();
+  std::lock_guard<std::mutex> lock(finishMutex_);
+  if (finished_)
+    return;
+  StartWrite(&batch_);
+}
+
+bool ChannelListenReactor::isHot() const {
+  return batching_.maxDelay.count() > 0 &&
+    std::chrono::steady_clock::now() - lastFlush_ < batching_.maxDelay;
+}
+
+void ChannelListenReactor::armGather(size_t backlog) {
+  gatherTarget_.store(cursor_ + batching_.maxBatch - backlog);
+  gathering_.store(true);
+  refs_.fetch_add(1);
+  // we keep owning writing_ while the alarm is armed
+  gatherAlarm_.experimental().Set(std::chrono::system_clock::now() + batching_.maxDelay,
+    [this](bool) {
+      gathering_.store(false);
+      gatherDone_ = true;
+      writeNext();
+      unref();
+    });
+}
+
+bool ChannelListenReactor::enforceBudget(size_t lost) {
+  if (pending_.empty() && !lost)
+    return true;
+  uint64_t discarded = 0;
+  int storedId = 0;
+  BudgetAction action = applyListenerBudget(channel_->listenerBudget(), pending_,
+                                            pendingPos_, lost, discarded, storedId);
+  int channelid = channel_->getChannel().channelid();
+  switch (action) {
+    case BudgetAction::DISCONNECT:
+      logger_->warn("disconnecting slow listener on channel {}", channelid);
+      finish(grpc::Status(grpc::StatusCode::RESOURCE_EXHAUSTED, "listener too slow"));
+      return false;
+    case BudgetAction::GAP:
+      gapSkipped_ += discarded;
+      gapStoredId_ = std::max(gapStoredId_, storedId);
+      logger_->debug("listener on channel {} skipped {} messages", channelid, gapSkipped_);
+      return true;
+    case BudgetAction::KEEP:
+      if (discarded)
+        logger_->debug("listener on channel {} dropped {} messages", channelid, discarded);
+      return true;
+  }
+  return true;
+}
+
+void ChannelListenReactor::finish(const grpc::Status& status) {
+  std::lock_guard<std::mutex> lock(finishMutex_);
+  if (finished_)
+    return;
+  finished_ = true;
+  Finish(status);
+}
@@ -0,0 +1,139 @@
+/*
+This file is part of Wrongthink.
+
+Wrongthink - Modern, open & performant chat protocol. Based on gRPC.
+Copyright (C) 2020 Ophiuchus2
+
+This program is free software: you can redistribute it and/or modify it under the
+terms of the GNU Affero General Public License as published by the Free Software Foundation,
+either version 3 of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License along with this program.
+If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef CHANNEL_LISTEN_REACTOR_H
+#define CHANNEL_LISTEN_REACTOR_H
+
+#include <grpcpp/grpcpp.h>
+#include <grpcpp/alarm.h>
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <chrono>
+#include "spdlog/spdlog.h"
+#include "wrongthink.grpc.pb.h"
+#include "SynchronizedChannel.h"
+
+/*
+ * Server side of a ListenWrongthinkMessages stream built on the gRPC callback
+ * API. The reactor holds no thread while idle: it registers itself with the
+ * channel, gets woken by appendMessage() & keeps at most one write in flight,
+ * draining the channel ring from its own cursor whenever a write completes.
+ * Cancelled streams are finished & unregistered by gRPC's OnCancel/OnDone.
+ * A reactor can be handed to gRPC before its channel is loaded, attach()
+ * starts it once the load completed off the callback thread.
+ *
+ * The stream is raw: it writes the payload each channel entry was serialized
+ * into at publish time, so fanout to N listeners costs one serialization.
+ *
+ * A listener's outbound queue is the window of the shared channel ring between
+ * its cursor & the head, so it costs no memory of its own. When that backlog
+ * exceeds the channel's ListenerBudget the channel's SlowConsumerPolicy decides
+ * whether to drop the oldest messages, replace the backlog by a gap marker or
+ * disconnect the listener. A slow listener never holds up the publisher or
+ * the other listeners.
+ *
+ * Writes are micro-batched: everything queued when a batch starts (up to
+ * ListenBatching::maxBatch messages) is written with the buffer hint set &
+ * only the last write of the batch flushes, so a burst goes out in a few
+ * HTTP/2 frames instead of one per message. An idle listener flushes every
+ * message immediately, a hot one (flushed less than maxDelay ago) waits up to
+ * maxDelay for the batch to fill up.
+ *
+ * A batched reactor serves ListenWrongthinkMessageBatches instead: each batch
+ * goes out as a single WrongthinkMessageBatch write, framed around the shared
+ * payloads without copying or serializing them again.
+ */
+struct ListenBatching {
+  size_t maxBatch = 64;
+  std::chrono::microseconds maxDelay{500};
+};
+
+class ChannelListenReactor : public grpc::experimental::ServerWriteReactor<grpc::ByteBuffer>,
+                             public ChannelListener {
+public:
+  /* a null channel finishes the stream immediately with INVALID_ARGUMENT */
+  ChannelListenReactor(std::shared_ptr<SynchronizedChannel> channel,
+                       std::shared_ptr<spdlog::logger> logger,
+                       const ListenBatching& batching = ListenBatching{},
+                       bool batched = false);
+  /* a stream whose channel is still loading, attach() or abandon() must
+     follow exactly once. batched streams write WrongthinkMessageBatch */
+  ChannelListenReactor(std::shared_ptr<spdlog::logger> logger,
+                       const ListenBatching& batching = ListenBatching{},
+                       bool batched = false);
+
+  /* starts listening to the loaded channel, a null channel finishes the
+     stream with INVALID_ARGUMENT. safe to call from any thread */
+  void attach(std::shared_ptr<SynchronizedChannel> channel);
+  /* finishes a stream that won't get a channel */
+  void abandon(const grpc::Status& status);
+
+  void onMessageAvailable() override;
+  void OnWriteDone(bool ok) override;
+  void OnCancel() override;
+  void OnDone() override;
+
+private:
+  void writeNext();
+  /* writes the next count pending messages as one WrongthinkMessageBatch */
+  void writeBatch(size_t count);
+  /* applies the slow consumer policy to freshly read pending_ entries,
+     returns false if the stream was finished */
+  bool enforceBudget(size_t lost);
+  bool isHot() const;
+  /* holds the batch back until it fills up or maxDelay expires */
+  void armGather(size_t backlog);
+  void finish(const grpc::Status& status);
+  /* the reactor is referenced by grpc, by a pending attach() & by an armed
+     gather alarm */
+  void unref();
+
+  std::shared_ptr<SynchronizedChannel> channel_;
+  std::shared_ptr<spdlog::logger> logger_;
+  ListenBatching batching_;
+  bool batched_;
+  // owned by whoever flipped writing_ to true
+  uint64_t cursor_;
+  std::vector<ChannelEntryPtr> pending_;
+  size_t pendingPos_;
+  // messages discarded since the last gap marker was queued & the id of the
+  // newest committed one among them
+  uint64_t gapSkipped_;
+  int gapStoredId_;
+  grpc::ByteBuffer gapMarker_;
+  // the batch in flight on a batched stream
+  grpc::ByteBuffer batch_;
+  // writes left in the current batch, the last one flushes
+  size_t batchLeft_;
+  bool gatherDone_;
+  std::chrono::steady_clock::time_point lastFlush_;
+  grpc::Alarm gatherAlarm_;
+  std::atomic<bool> gathering_;
+  // head sequence at which the gathered batch is full
+  std::atomic<uint64_t> gatherTarget_;
+  std::atomic<int> refs_;
+  std::atomic<bool> writing_;
+  // orders attach() against OnDone(), channel_ is set once under it
+  std::mutex attachMutex_;
+  bool done_;
+  // guards StartWrite against a concurrent Finish
+  std::mutex finishMutex_;
+  bool finished_;
+};
+
+#endif // CHANNEL_LISTEN_REACTOR_H
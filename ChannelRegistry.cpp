@@ -0,0 +1,210 @@
+/*
+This file is part of Wrongthink.
+
+Wrongthink - Modern, open & performant chat protocol. Based on gRPC.
+Copyright (C) 2020 Ophiuchus2
+
+This program is free software: you can redistribute it and/or modify it under the
+terms of the GNU Affero General Public License as published by the Free Software Foundation,
+either version 3 of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License along with this program.
+If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "ChannelRegistry.h"
+#include <algorithm>
+
+ChannelRegistry::ChannelRegistry(Loader loader, size_t shards) :
+  loader_{loader},
+  shards_{},
+  mask_{0},
+  maxBytes_{0},
+  listenerBudget_{std::make_shared<const ListenerBudget>()},
+  residentBytes_{std::make_shared<std::atomic<uint64_t>>(0)},
+  minIdle_{60},
+  interval_{10},
+  sweepMutex_{},
+  sweepCondition_{},
+  stopping_{false},
+  trimRequested_{false},
+  sweeper_{}
+{
+  size_t count = 1;
+  while (count < shards)
+    count <<= 1;
+  for (size_t i = 0; i < count; i++)
+    shards_.emplace_back(new Shard());
+  mask_ = count - 1;
+}
+
+ChannelRegistry::~ChannelRegistry() {
+  {
+    std::lock_guard<std::mutex> lock(sweepMutex_);
+    stopping_ = true;
+  }
+  sweepCondition_.notify_all();
+  if (sweeper_.joinable())
+    sweeper_.join();
+}
+
+void ChannelRegistry::setMemoryBudget(uint64_t maxBytes, std::chrono::seconds minIdle,
+                                      std::chrono::seconds interval) {
+  maxBytes_.store(maxBytes);
+  minIdle_.store(minIdle.count());
+  std::lock_guard<std::mutex> lock(sweepMutex_);
+  interval_ = interval;
+  if (maxBytes && !sweeper_.joinable())
+    sweeper_ = std::thread(&ChannelRegistry::sweep, this);
+}
+
+void ChannelRegistry::setListenerBudget(const ListenerBudget& budget) {
+  std::atomic_store(&listenerBudget_, std::make_shared<const ListenerBudget>(budget));
+  for (auto& shard : shards_) {
+    std::shared_lock<std::shared_mutex> lock(shard->mutex);
+    for (auto& entry : shard->channels)
+      entry.second->setListenerBudget(budget);
+  }
+}
+
+ChannelRegistry::ChannelPtr ChannelRegistry::get(int channelid) {
+  Shard& shard = shardFor(channelid);
+  {
+    std::shared_lock<std::shared_mutex> lock(shard.mutex);
+    auto it = shard.channels.find(channelid);
+    if (it != shard.channels.end())
+      return it->second;
+  }
+
+  std::promise<ChannelPtr> promise;
+  std::shared_future<ChannelPtr> pending;
+  {
+    std::unique_lock<std::shared_mutex> lock(shard.mutex);
+    auto it = shard.channels.find(channelid);
+    if (it != shard.channels.end())
+      return it->second;
+    auto loading = shard.loading.find(channelid);
+    if (loading != shard.loading.end()) {
+      pending = loading->second;
+    } else {
+      shard.loading.emplace(channelid, promise.get_future().share());
+    }
+  }
+  // somebody else is already loading this channel
+  if (pending.valid())
+    return pending.get();
+
+  ChannelPtr channel;
+  try {
+    WrongthinkChannel wtChannel;
+    if (loader_(channelid, wtChannel)) {
+      channel = std::make_shared<SynchronizedChannel>(wtChannel);
+      channel->trackResidentBytes(residentBytes_);
+      channel->setListenerBudget(*std::atomic_load(&listenerBudget_));
+    }
+  } catch (...) {
+    {
+      std::unique_lock<std::shared_mutex> lock(shard.mutex);
+      shard.loading.erase(channelid);
+    }
+    promise.set_exception(std::current_exception());
+    throw;
+  }
+  {
+    std::unique_lock<std::shared_mutex> lock(shard.mutex);
+    if (channel)
+      shard.channels.emplace(channelid, channel);
+    shard.loading.erase(channelid);
+  }
+  promise.set_value(channel);
+  uint64_t maxBytes = maxBytes_.load();
+  if (channel && maxBytes && residentBytes_->load() > maxBytes)
+    requestTrim();
+  return channel;
+}
+
+ChannelRegistry::ChannelPtr ChannelRegistry::find(int channelid) {
+  Shard& shard = shardFor(channelid);
+  std::shared_lock<std::shared_mutex> lock(shard.mutex);
+  auto it = shard.channels.find(channelid);
+  return it != shard.channels.end() ? it->second : nullptr;
+}
+
+size_t ChannelRegistry::size() {
+  size_t total = 0;
+  for (auto& shard : shards_) {
+    std::shared_lock<std::shared_mutex> lock(shard->mutex);
+    total += shard->channels.size();
+  }
+  return total;
+}
+
+size_t ChannelRegistry::trim() {
+  uint64_t maxBytes = maxBytes_.load();
+  if (!maxBytes || residentBytes_->load() <= maxBytes)
+    return 0;
+  struct Candidate {
+    int channelid;
+    std::chrono::steady_clock::duration idle;
+  };
+  std::chrono::seconds minIdle(minIdle_.load());
+  std::vector<Candidate> candidates;
+  for (auto& shard : shards_) {
+    std::shared_lock<std::shared_mutex> lock(shard->mutex);
+    for (auto& it : shard->channels) {
+      std::chrono::steady_clock::duration idle = it.second->idleFor();
+      if (idle >= minIdle && it.second->listenerCount() == 0)
+        candidates.push_back({it.first, idle});
+    }
+  }
+
+  // least recently used first
+  std::sort(candidates.begin(), candidates.end(),
+    [](const Candidate& a, const Candidate& b) { return a.idle > b.idle; });
+  size_t evicted = 0;
+  for (const Candidate& candidate : candidates) {
+    if (residentBytes_->load() <= maxBytes)
+      break;
+    Shard& shard = shardFor(candidate.channelid);
+    std::unique_lock<std::shared_mutex> lock(shard.mutex);
+    auto it = shard.channels.find(candidate.channelid);
+    // nobody else may hold the channel, under the unique lock nobody can
+    // pick it up either, so no listener or publisher can be left on it
+    if (it == shard.channels.end() || it->second.use_count() != 1)
+      continue;
+    *residentBytes_ -= it->second->residentBytes();
+    shard.channels.erase(it);
+    evicted++;
+  }
+  return evicted;
+}
+
+void ChannelRegistry::sweep() {
+  std::unique_lock<std::mutex> lock(sweepMutex_);
+  while (!stopping_) {
+    sweepCondition_.wait_for(lock, interval_, [this]() { return stopping_ || trimRequested_; });
+    if (stopping_)
+      break;
+    trimRequested_ = false;
+    lock.unlock();
+    trim();
+    lock.lock();
+  }
+}
+
+void ChannelRegistry::requestTrim() {
+  {
+    std::lock_guard<std::mutex> lock(sweepMutex_);
+    trimRequested_ = true;
+  }
+  sweepCondition_.notify_all();
+}
+
+ChannelRegistry::Shard& ChannelRegistry::shardFor(int channelid) {
+  // channel ids are sequential, spread neighbours across shards
+  uint32_t hash = static_cast<uint32_t>(channelid) * 2654435761u;
+  return *shards_[(hash >> 16) & mask_];
+}
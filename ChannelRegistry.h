@@ -0,0 +1,111 @@
+/*
+This file is part of Wrongthink.
+
+Wrongthink - Modern, open & performant chat protocol. Based on gRPC.
+Copyright (C) 2020 Ophiuchus2
+
+This program is free software: you can redistribute it and/or modify it under the
+terms of the GNU Affero General Public License as published by the Free Software Foundation,
+either version 3 of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License along with this program.
+If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef CHANNEL_REGISTRY_H
+#define CHANNEL_REGISTRY_H
+
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <memory>
+#include <future>
+#include <vector>
+#include <functional>
+#include <shared_mutex>
+#include <unordered_map>
+#include <condition_variable>
+
+#include "wrongthink.grpc.pb.h"
+#include "SynchronizedChannel.h"
+
+/*
+ * Concurrent map of channel id -> live SynchronizedChannel, shared by every
+ * rpc thread. The map is split into independently locked shards so lookups
+ * from different channels never contend, & hits only take a shared lock.
+ * A miss loads the channel description through the loader exactly once, even
+ * when many rpcs race on the same channel: the first caller loads while the
+ * others wait on its result.
+ *
+ * Optionally the registry enforces a global memory budget: when the channels'
+ * resident bytes exceed it, channels nobody references (no listeners, no rpc
+ * in flight) that have been idle for a while are evicted least recently used
+ * first. Evicted channels are simply reloaded on their next lookup.
+ */
+class ChannelRegistry {
+public:
+  using ChannelPtr = std::shared_ptr<SynchronizedChannel>;
+  /* fills in the channel description, returns false if it doesn't exist */
+  using Loader = std::function<bool(int channelid, WrongthinkChannel& channel)>;
+
+  static constexpr size_t DEFAULT_SHARDS = 64;
+
+  explicit ChannelRegistry(Loader loader = nullptr, size_t shards = DEFAULT_SHARDS);
+  ~ChannelRegistry();
+
+  /* enables eviction once resident bytes exceed maxBytes (0 disables it).
+     only channels idle for at least minIdle are evicted, a background sweep
+     runs every interval */
+  void setMemoryBudget(uint64_t maxBytes,
+                       std::chrono::seconds minIdle = std::chrono::seconds(60),
+                       std::chrono::seconds interval = std::chrono::seconds(10));
+  /* listener budget of every channel, applied to resident channels & to
+     the ones loaded later */
+  void setListenerBudget(const ListenerBudget& budget);
+  /* running total kept up to date by the channels, O(1) */
+  uint64_t residentBytes() const { return residentBytes_->load(); }
+  /* evicts idle channels until the budget is met, returns how many. only
+     walks the channels when over budget */
+  size_t trim();
+
+  /* returns the channel, loading it on a miss. returns null if the channel
+     doesn't exist, missing channels are not cached. loader exceptions are
+     rethrown to every caller waiting on that load */
+  ChannelPtr get(int channelid);
+  /* returns the channel only if it is already resident */
+  ChannelPtr find(int channelid);
+  size_t size();
+
+private:
+  struct Shard {
+    std::shared_mutex mutex;
+    std::unordered_map<int, ChannelPtr> channels;
+    std::unordered_map<int, std::shared_future<ChannelPtr>> loading;
+  };
+
+  Shard& shardFor(int channelid);
+  void sweep();
+  /* wakes the sweeper, loads never trim on the rpc thread */
+  void requestTrim();
+
+  Loader loader_;
+  std::vector<std::unique_ptr<Shard>> shards_;
+  size_t mask_;
+  std::atomic<uint64_t> maxBytes_;
+  std::shared_ptr<const ListenerBudget> listenerBudget_;
+  // shared with the channels, which keep it current
+  std::shared_ptr<std::atomic<uint64_t>> residentBytes_;
+  std::atomic<std::chrono::seconds::rep> minIdle_;
+  std::chrono::seconds interval_;
+  std::mutex sweepMutex_;
+  std::condition_variable sweepCondition_;
+  bool stopping_;
+  bool trimRequested_;
+  std::thread sweeper_;
+};
+
+#endif // CHANNEL_REGISTRY_H
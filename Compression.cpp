@@ -0,0 +1,113 @@
+/*
+This file is part of Wrongthink.
+
+Wrongthink - Modern, open & performant chat protocol. Based on gRPC.
+Copyright (C) 2020 Ophiuchus2
+
+This program is free software: you can redistribute it and/or modify it under the
+terms of the GNU Affero General Public License as published by the Free Software Foundation,
+either version 3 of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License along with this program.
+If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "Compression.h"
+
+#include <time.h>
+#include <vector>
+#include <stdexcept>
+#include <zlib.h>
+
+namespace {
+
+uint64_t threadCpuNs() {
+  timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return uint64_t(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
+}
+
+void CompressionPolicy::apply(grpc_impl::ServerContextBase* context) const {
+  if (context)
+    context->set_compression_level(level);
+}
+
+grpc_compression_level CompressionPolicy::parseLevel(const std::string& name) {
+  if (name == "none")
+    return GRPC_COMPRESS_LEVEL_NONE;
+  if (name == "low")
+    return GRPC_COMPRESS_LEVEL_LOW;
+  if (name == "medium")
+    return GRPC_COMPRESS_LEVEL_MED;
+  if (name == "high")
+    return GRPC_COMPRESS_LEVEL_HIGH;
+  throw std::runtime_error("unknown compression level '" + name + "'");
+}
+
+double CompressionStats::Snapshot::ratio() const {
+  return sampledBytes ? double(sampledOutput) / sampledBytes : 1.0;
+}
+
+uint64_t CompressionStats::Snapshot::estimatedWireBytes() const {
+  return bytes - compressedBytes + uint64_t(compressedBytes * ratio());
+}
+
+double CompressionStats::Snapshot::cpuMsPerMB() const {
+  if (!sampledBytes)
+    return 0;
+  return sampledCpu.count() / 1e6 * (1024.0 * 1024.0 / sampledBytes);
+}
+
+CompressionStats::CompressionStats(uint32_t sampleEvery) :
+  sampleEvery_{sampleEvery == 0 ? 1 : sampleEvery},
+  messages_{0},
+  compressed_{0},
+  bytes_{0},
+  compressedBytes_{0},
+  sampledBytes_{0},
+  sampledOutput_{0},
+  sampledCpuNs_{0}
+{
+}
+
+void CompressionStats::record(const google::protobuf::MessageLite& msg, size_t bytes,
+  bool compressed) {
+  messages_.fetch_add(1, std::memory_order_relaxed);
+  bytes_.fetch_add(bytes, std::memory_order_relaxed);
+  if (!compressed)
+    return;
+  compressedBytes_.fetch_add(bytes, std::memory_order_relaxed);
+  if (compressed_.fetch_add(1, std::memory_order_relaxed) % sampleEvery_ == 0)
+    sample(msg);
+}
+
+void CompressionStats::sample(const google::protobuf::MessageLite& msg) {
+  // same zlib level grpc compresses with
+  uint64_t start = threadCpuNs();
+  std::string raw = msg.SerializeAsString();
+  std::vector<Bytef> out(compressBound(raw.size()));
+  uLongf outLen = out.size();
+  if (compress2(out.data(), &outLen, reinterpret_cast<const Bytef*>(raw.data()), raw.size(),
+                Z_DEFAULT_COMPRESSION) != Z_OK)
+    return;
+  sampledCpuNs_.fetch_add(threadCpuNs() - start, std::memory_order_relaxed);
+  sampledBytes_.fetch_add(raw.size(), std::memory_order_relaxed);
+  sampledOutput_.fetch_add(outLen, std::memory_order_relaxed);
+}
+
+CompressionStats::Snapshot CompressionStats::snapshot() const {
+  Snapshot s;
+  s.messages = messages_.load(std::memory_order_relaxed);
+  s.compressed = compressed_.load(std::memory_order_relaxed);
+  s.bytes = bytes_.load(std::memory_order_relaxed);
+  s.compressedBytes = compressedBytes_.load(std::memory_order_relaxed);
+  s.sampledBytes = sampledBytes_.load(std::memory_order_relaxed);
+  s.sampledOutput = sampledOutput_.load(std::memory_order_relaxed);
+  s.sampledCpu = std::chrono::nanoseconds(sampledCpuNs_.load(std::memory_order_relaxed));
+  return s;
+}
@@ -0,0 +1,93 @@
+/*
+This file is part of Wrongthink.
+
+Wrongthink - Modern, open & performant chat protocol. Based on gRPC.
+Copyright (C) 2020 Ophiuchus2
+
+This program is free software: you can redistribute it and/or modify it under the
+terms of the GNU Affero General Public License as published by the Free Software Foundation,
+either version 3 of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License along with this program.
+If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+#include <grpcpp/grpcpp.h>
+#include <google/protobuf/message_lite.h>
+
+/*
+ * How one rpc compresses its messages. The level is resolved by grpc
+ * against the client's grpc-accept-encoding: low prefers gzip, medium &
+ * high prefer deflate, a client accepting neither gets plain messages.
+ * grpc compresses message by message, messages under minBytes are sent
+ * uncompressed since the framing would eat the gain.
+ */
+struct CompressionPolicy {
+  grpc_compression_level level = GRPC_COMPRESS_LEVEL_NONE;
+  size_t minBytes = 0;
+
+  bool compresses(size_t bytes) const {
+    return level != GRPC_COMPRESS_LEVEL_NONE && bytes >= minBytes;
+  }
+  /* call level half, before the first write */
+  void apply(grpc_impl::ServerContextBase* context) const;
+  /* "none", "low", "medium" or "high", throws otherwise */
+  static grpc_compression_level parseLevel(const std::string& name);
+};
+
+/*
+ * Messages written under one policy. grpc doesn't report compressed sizes,
+ * so every sampleEvery'th compressed message is deflated here as well to
+ * estimate the ratio & the cpu it costs.
+ */
+class CompressionStats {
+public:
+  struct Snapshot {
+    uint64_t messages = 0;
+    // messages big enough to compress & their serialized bytes
+    uint64_t compressed = 0;
+    uint64_t bytes = 0;
+    uint64_t compressedBytes = 0;
+    // deflated samples
+    uint64_t sampledBytes = 0;
+    uint64_t sampledOutput = 0;
+    std::chrono::nanoseconds sampledCpu{0};
+
+    double ratio() const;
+    /* bytes sent after compression, estimated from the samples */
+    uint64_t estimatedWireBytes() const;
+    /* cpu spent per MB compressed, estimated from the samples */
+    double cpuMsPerMB() const;
+  };
+
+  explicit CompressionStats(uint32_t sampleEvery = 64);
+
+  void record(const google::protobuf::MessageLite& msg, size_t bytes, bool compressed);
+  Snapshot snapshot() const;
+
+private:
+  void sample(const google::protobuf::MessageLite& msg);
+
+  uint32_t sampleEvery_;
+  std::atomic<uint64_t> messages_;
+  std::atomic<uint64_t> compressed_;
+  std::atomic<uint64_t> bytes_;
+  std::atomic<uint64_t> compressedBytes_;
+  std::atomic<uint64_t> sampledBytes_;
+  std::atomic<uint64_t> sampledOutput_;
+  std::atomic<uint64_t> sampledCpuNs_;
+};
+
+#endif
@@ -0,0 +1,115 @@
+/*
+This file is part of Wrongthink.
+
+Wrongthink - Modern, open & performant chat protocol. Based on gRPC.
+Copyright (C) 2020 Ophiuchus2
+
+This program is free software: you can redistribute it and/or modify it under the
+terms of the GNU Affero General Public License as published by the Free Software Foundation,
+either version 3 of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License along with this program.
+If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "DBConnectionPool.h"
+
+DBSession::DBSession(DBConnectionPool* pool, std::unique_ptr<DBConnection> connection) :
+  prepare{connection->session.prepare}, pool_{pool}, connection_{std::move(connection)}
+{
+}
+
+DBSession::DBSession(DBSession&& other) :
+  prepare{other.prepare}, pool_{other.pool_}, connection_{std::move(other.connection_)}
+{
+  other.pool_ = nullptr;
+}
+
+DBSession::~DBSession() {
+  if (pool_ && connection_)
+    pool_->release(std::move(connection_));
+}
+
+DBConnectionPool::DBConnectionPool(const soci::backend_factory& backend,
+                                   const std::string& conString,
+                                   const DBPoolOptions& options) :
+  backend_{backend}, conString_{conString}, options_{options}, open_{0}
+{
+  if (options_.size == 0)
+    options_.size = 1;
+}
+
+DBConnectionPool::~DBConnectionPool() {
+}
+
+DBSession DBConnectionPool::acquire() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  bool ready = available_.wait_for(lock, options_.checkoutTimeout, [this]() {
+    return !idle_.empty() || open_ < options_.size;
+  });
+  if (!ready)
+    throw soci::soci_error("timed out waiting for a database connection");
+
+  if (!idle_.empty()) {
+    Idle idle = std::move(idle_.back());
+    idle_.pop_back();
+    lock.unlock();
+    if (std::chrono::steady_clock::now() - idle.since > options_.healthCheckIdle) {
+      try {
+        healthCheck(*idle.connection);
+      } catch (...) {
+        // the connection is gone for good, give its slot back
+        lock.lock();
+        open_--;
+        lock.unlock();
+        available_.notify_one();
+        throw;
+      }
+    }
+    return DBSession(this, std::move(idle.connection));
+  }
+
+  // open a new connection outside the lock, handshakes are slow
+  open_++;
+  lock.unlock();
+  try {
+    return DBSession(this, connect());
+  } catch (...) {
+    lock.lock();
+    open_--;
+    lock.unlock();
+    available_.notify_one();
+    throw;
+  }
+}
+
+void DBConnectionPool::release(std::unique_ptr<DBConnection> connection) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    idle_.push_back({std::move(connection), std::chrono::steady_clock::now()});
+  }
+  available_.notify_one();
+}
+
+std::unique_ptr<DBConnection> DBConnectionPool::connect() {
+  std::unique_ptr<DBConnection> connection(new DBConnection(backend_, conString_));
+  if (options_.onConnect)
+    options_.onConnect(connection->session);
+  return connection;
+}
+
+void DBConnectionPool::healthCheck(DBConnection& connection) {
+  try {
+    int one = 0;
+    connection.session << "select 1", soci::into(one);
+  } catch (const std::exception&) {
+    // statements belong to the dead backend connection
+    connection.statements.clear();
+    connection.session.reconnect();
+    if (options_.onConnect)
+      options_.onConnect(connection.session);
+  }
+}
@@ -0,0 +1,151 @@
+/*
+This file is part of Wrongthink.
+
+Wrongthink - Modern, open & performant chat protocol. Based on gRPC.
+Copyright (C) 2020 Ophiuchus2
+
+This program is free software: you can redistribute it and/or modify it under the
+terms of the GNU Affero General Public License as published by the Free Software Foundation,
+either version 3 of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License along with this program.
+If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef DB_CONNECTION_POOL_H
+#define DB_CONNECTION_POOL_H
+
+#include <mutex>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include <utility>
+#include <unordered_map>
+#include <condition_variable>
+
+#include "soci.h"
+
+struct DBPoolOptions {
+  size_t size = 8;
+  // how long getSociSession() waits for a free connection before throwing
+  std::chrono::milliseconds checkoutTimeout{5000};
+  // connections idle for longer are pinged & reconnected before reuse
+  std::chrono::seconds healthCheckIdle{30};
+  // run on every new or reconnected session, e.g. to set per connection pragmas
+  std::function<void(soci::session&)> onConnect;
+};
+
+class DBConnectionPool;
+
+/*
+ * Statements prepared on one connection & reused by every checkout of it, so
+ * hot queries are parsed & planned once per connection instead of per call.
+ * An entry owns its soci::statement along with the variables bound to it.
+ * Entries are dropped when the connection reconnects or closes.
+ */
+class StatementCache {
+public:
+  struct Entry {
+    virtual ~Entry() {}
+  };
+
+  /* the entry stored under key, T(session, args...) prepares it on first use */
+  template <typename T, typename... Args>
+  T& get(const std::string& key, soci::session& session, Args&&... args) {
+    auto it = entries_.find(key);
+    if (it == entries_.end())
+      it = entries_.emplace(key, std::unique_ptr<Entry>(
+        new T(session, std::forward<Args>(args)...))).first;
+    return static_cast<T&>(*it->second);
+  }
+  /* drops a statement whose execution failed, it is prepared again next time */
+  void erase(const std::string& key) { entries_.erase(key); }
+  void clear() { entries_.clear(); }
+
+private:
+  std::unordered_map<std::string, std::unique_ptr<Entry>> entries_;
+};
+
+/* a pooled connection, its cached statements go before the session does */
+struct DBConnection {
+  DBConnection(const soci::backend_factory& backend, const std::string& conString) :
+    session{backend, conString}, statements{} {}
+
+  soci::session session;
+  StatementCache statements;
+};
+
+/*
+ * A connection borrowed from a DBConnectionPool, handed back when destroyed.
+ * Forwards the parts of soci::session the DB code uses (<<, prepare,
+ * got_data) & converts to soci::session& for everything else.
+ */
+class DBSession {
+public:
+  DBSession(DBSession&& other);
+  DBSession(const DBSession&) = delete;
+  DBSession& operator=(const DBSession&) = delete;
+  ~DBSession();
+
+  soci::session& get() { return connection_->session; }
+  operator soci::session&() { return connection_->session; }
+  /* statements prepared on this connection by earlier checkouts */
+  StatementCache& statements() { return connection_->statements; }
+
+  template <typename T>
+  soci::details::once_temp_type operator<<(const T& t) { return connection_->session << t; }
+  bool got_data() const { return connection_->session.got_data(); }
+
+  soci::details::prepare_type& prepare;
+
+private:
+  friend class DBConnectionPool;
+  DBSession(DBConnectionPool* pool, std::unique_ptr<DBConnection> connection);
+
+  DBConnectionPool* pool_;
+  std::unique_ptr<DBConnection> connection_;
+};
+
+/*
+ * Bounded pool of soci sessions. Connections are opened lazily up to the
+ * configured size & reused afterwards, so an rpc no longer pays for a full
+ * connection handshake. Idle connections are health checked on checkout &
+ * transparently reconnected when the server dropped them.
+ */
+class DBConnectionPool {
+public:
+  DBConnectionPool(const soci::backend_factory& backend, const std::string& conString,
+                   const DBPoolOptions& options);
+  ~DBConnectionPool();
+
+  /* throws soci::soci_error if no connection frees up within the checkout timeout */
+  DBSession acquire();
+  const DBPoolOptions& options() const { return options_; }
+
+private:
+  friend class DBSession;
+  struct Idle {
+    std::unique_ptr<DBConnection> connection;
+    std::chrono::steady_clock::time_point since;
+  };
+
+  void release(std::unique_ptr<DBConnection> connection);
+  std::unique_ptr<DBConnection> connect();
+  void healthCheck(DBConnection& connection);
+
+  const soci::backend_factory& backend_;
+  std::string conString_;
+  DBPoolOptions options_;
+  std::mutex mutex_;
+  std::condition_variable available_;
+  std::vector<Idle> idle_;
+  // connections currently open, idle or borrowed
+  size_t open_;
+};
+
+#endif // DB_CONNECTION_POOL_H
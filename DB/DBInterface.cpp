@@ -17,13 +17,102 @@ If not, see <https://www.gnu.org/licenses/>.
 */
 #include "DBInterface.h"
 
-DBInterface::DBInterface( const soci::backend_factory &backend, const std::string conString ) :
-  dbType_{backend}, dbConnectString_{conString}
+#include <iterator>
+
+DBInterface::DBInterface( const soci::backend_factory &backend, const std::string conString,
+                          const DBPoolOptions& poolOptions ) :
+  dbType_{backend}, dbConnectString_{conString},
+  pool_{new DBConnectionPool(backend, conString, poolOptions)}
 {
 };
 
-soci::session DBInterface::getSociSession() {
-  return soci::session(dbType_, dbConnectString_);
+DBSession DBInterface::getSociSession() {
+  return pool_->acquire();
+}
+
+void DBInterface::setReplicas(const std::vector<std::string>& conStrings,
+                              const DBReplicaOptions& options) {
+  replicaOptions_ = options;
+  replicas_.clear();
+  for (const std::string& conString : conStrings) {
+    auto replica = std::make_unique<Replica>();
+    replica->pool.reset(new DBConnectionPool(dbType_, conString, options.pool));
+    replicas_.push_back(std::move(replica));
+  }
+}
+
+void DBInterface::noteWrite(const std::string& key) {
+  if (!replicas_.empty())
+    recentWrites_.put(key, 1, replicaOptions_.readYourWrites, recentWrites_.version(key));
+}
+
+DBSession DBInterface::getReadSession(const std::string& affinity) {
+  if (replicas_.empty())
+    return getSociSession();
+  char written;
+  if (!affinity.empty() && recentWrites_.get(affinity, written))
+    return getSociSession();
+
+  using Clock = std::chrono::steady_clock;
+  size_t start = affinity.empty() ? nextReplica_++ : std::hash<std::string>{}(affinity);
+  for (size_t i = 0; i < replicas_.size(); i++) {
+    Replica& replica = *replicas_[(start + i) % replicas_.size()];
+    auto now = Clock::now().time_since_epoch().count();
+    bool due = now - replica.lastCheck.load() >
+      std::chrono::duration_cast<Clock::duration>(replicaOptions_.lagCheckInterval).count();
+    if (replica.lagging && !due)
+      continue;
+    try {
+      DBSession sql = replica.pool->acquire();
+      if (due) {
+        replica.lastCheck = now;
+        replica.lagging = replicationLag(sql) * 1000 > replicaOptions_.maxLag.count();
+        if (replica.lagging)
+          continue;
+      }
+      return sql;
+    } catch (const std::exception&) {
+      // replica unreachable, try the next one
+      replica.lastCheck = now;
+      replica.lagging = true;
+    }
+  }
+  return getSociSession();
+}
+
+void DBInterface::migrate(const std::vector<Migration>& migrations) {
+  DBSession sql = getWriterSession();
+  int version = 0;
+  soci::indicator ind = soci::i_ok;
+  try {
+    sql << "select max(version) from schema_version", into(version, ind);
+    if (ind == soci::i_null)
+      version = 0;
+  } catch (const soci::soci_error&) {
+    // first start against this database
+    sql << "create table if not exists schema_version (version int primary key)";
+    version = 0;
+  }
+
+  for (const Migration& migration : migrations) {
+    if (migration.version <= version)
+      continue;
+    soci::transaction tr(sql);
+    for (const std::string& statement : migration.statements)
+      sql << statement;
+    sql << "insert into schema_version (version) values(:version)", use(migration.version);
+    tr.commit();
+    version = migration.version;
+  }
+}
+
+void DBInterface::getChannelMessages(DBSession &sql, int channel_id, const MessagePage& page,
+                                     std::vector<WrongthinkMessage>& out) {
+  getChannelMessages(sql, channel_id, page, [&out](std::vector<WrongthinkMessage>& batch) {
+    out.insert(out.end(), std::make_move_iterator(batch.begin()),
+               std::make_move_iterator(batch.end()));
+    return true;
+  });
 }
 
 DBInterface::~DBInterface(){
@@ -19,6 +19,17 @@ If not, see <https://www.gnu.org/licenses/>.
 #define DB_INTERFACE_H
 
 #include "soci.h"
+#include "DBConnectionPool.h"
+#include "MessageStore.h"
+#include "TTLCache.h"
+#include "wrongthink.grpc.pb.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
 
 using soci::session;
 using soci::row;
@@ -27,13 +38,37 @@ using soci::statement;
 using soci::use;
 using soci::into;
 
+struct DBReplicaOptions {
+  // replicas further behind the primary than this are skipped
+  std::chrono::milliseconds maxLag{1000};
+  // reads of something written this recently go to the primary
+  std::chrono::milliseconds readYourWrites{5000};
+  // how often a replica's lag is measured again
+  std::chrono::milliseconds lagCheckInterval{1000};
+  DBPoolOptions pool;
+};
+
 class DBInterface {
 public:
+  /* receives one fetched batch of a typed read */
+  using MessageSink = std::function<bool(std::vector<WrongthinkMessage>& batch)>;
+
   virtual ~DBInterface();
 
   virtual void validate() = 0;
   virtual void clear() = 0;
-  soci::session getSociSession();
+  /* borrows a pooled connection, returned to the pool when the DBSession dies */
+  DBSession getSociSession();
+  /* routes read only queries to a replica, same affinity key same replica.
+     falls back to the primary without replicas, when all of them lag or
+     right after noteWrite() was called for the key */
+  DBSession getReadSession(const std::string& affinity = "");
+  /* keeps reads of key on the primary for DBReplicaOptions::readYourWrites */
+  void noteWrite(const std::string& key);
+  void setReplicas(const std::vector<std::string>& conStrings,
+                   const DBReplicaOptions& options = DBReplicaOptions{});
+  /* connection for every write, backends with a single writer override it */
+  virtual DBSession getWriterSession() { return getSociSession(); }
 
   virtual bool isUserValid(const std::string& uname, const std::string& token) = 0;
   virtual bool isUserAdmin(const std::string& uname) = 0;
@@ -44,17 +79,65 @@ public:
   virtual int createUser( std::string uname, std::string password, int& admin ) = 0;
   virtual int createChannel(std::string name, int community, int admin_id, int anonymous) = 0;
   virtual int createCommunity(std::string name, int admin, int pub) = 0;
-  virtual rowset<row> getCommunityRowset(soci::session &sql) = 0;
-  virtual rowset<row> getCommunityChannelsRowset(soci::session &sql, int community_id) = 0;
-  virtual rowset<row> getChannelMessages(soci::session &sql, int channel_id) = 0;
+  /* typed reads: an explicit column list is bound into vector buffers, fetched
+     fetchBatchSize() rows at a time & mapped straight onto the protobufs
+     appended to out */
+  virtual void getCommunities(soci::session &sql, std::vector<WrongthinkCommunity>& out) = 0;
+  virtual void getCommunityChannels(soci::session &sql, int community_id,
+                                    std::vector<WrongthinkChannel>& out) = 0;
+  /* streams the page to sink batch by batch, sink returns false to stop early */
+  virtual void getChannelMessages(DBSession &sql, int channel_id, const MessagePage& page,
+                                  const MessageSink& sink) = 0;
+  /* collects the whole page into out */
+  void getChannelMessages(DBSession &sql, int channel_id, const MessagePage& page,
+                          std::vector<WrongthinkMessage>& out);
+  /* the messages of a channel with these ids, oldest first */
+  virtual void getMessagesById(soci::session &sql, int channel_id, const std::vector<int>& ids,
+                               std::vector<WrongthinkMessage>& out) = 0;
   virtual std::unique_ptr<row> getChannelRow(soci::session &sql, int channel_id) = 0;
+  virtual std::string getUserName(int user_id) = 0;
+  /* bulk insert that sets each row's msg_id, runs inside the caller's transaction */
+  virtual void insertMessages(soci::session &sql, std::vector<MessageRow>& rows) = 0;
+
+  void setFetchBatchSize(size_t rows) { fetchBatch_ = std::max<size_t>(rows, 1); }
+  size_t fetchBatchSize() const { return fetchBatch_; }
+
+  /* message history lives in store instead of the message table once set */
+  void setMessageStore(std::shared_ptr<MessageStore> store) { messageStore_ = store; }
+  MessageStore* messageStore() const { return messageStore_.get(); }
 
 protected:
-  DBInterface( const soci::backend_factory &backend, std::string conString );
+  DBInterface( const soci::backend_factory &backend, std::string conString,
+               const DBPoolOptions& poolOptions = DBPoolOptions{} );
+
+  /* one schema step, applied in its own transaction */
+  struct Migration {
+    int version;
+    std::vector<std::string> statements;
+  };
+  /* applies the migrations newer than the version recorded in schema_version,
+     in order. a current schema costs a single query */
+  void migrate(const std::vector<Migration>& migrations);
+  /* seconds a replica is behind its primary */
+  virtual double replicationLag(soci::session& sql) { (void)sql; return 0; }
 
   const soci::backend_factory &dbType_;
   std::string dbConnectString_;
+  std::unique_ptr<DBConnectionPool> pool_;
+  std::shared_ptr<MessageStore> messageStore_;
+  // rows per bulk fetch of the typed reads
+  size_t fetchBatch_ = 256;
 
+private:
+  struct Replica {
+    std::unique_ptr<DBConnectionPool> pool;
+    std::atomic<bool> lagging{false};
+    std::atomic<std::chrono::steady_clock::rep> lastCheck{0};
+  };
+  std::vector<std::unique_ptr<Replica>> replicas_;
+  DBReplicaOptions replicaOptions_;
+  std::atomic<size_t> nextReplica_{0};
+  TTLCache<std::string, char> recentWrites_;
 };
 
 #endif // DB_INTERFACE_H
@@ -17,13 +17,81 @@ If not, see <https://www.gnu.org/licenses/>.
 */
 #include "DBPostgres.h"
 
-DBPostgres::DBPostgres(const std::string &user, const std::string &pass, const std::string &dbName) :
-  DBInterface(soci::postgresql, "host=localhost dbname=" + dbName + " user=" + user + " password=" + pass)
+#include <limits>
+#include <algorithm>
+
+// how long lookups are cached, misses expire sooner so new rows show up fast.
+// other servers sharing the db see bans & new users within these bounds
+static const std::chrono::seconds CACHE_TTL{60};
+static const std::chrono::seconds NEGATIVE_CACHE_TTL{5};
+static const std::chrono::minutes NAME_CACHE_TTL{10};
+static const std::chrono::seconds RETENTION_CACHE_TTL{60};
+
+namespace {
+
+/* runs a statement from the connection's cache. one that failed is dropped,
+   the next call prepares it again */
+bool executeCached(DBSession& sql, const std::string& key, soci::statement& st) {
+  try {
+    return st.execute(true);
+  } catch (...) {
+    sql.statements().erase(key);
+    throw;
+  }
+}
+
+}
+
+// the auth checks run on every rpc the ttl caches miss, each connection
+// prepares them once. the bound variables are declared before the statement
+struct DBPostgres::UserQuery : StatementCache::Entry {
+  std::string uname;
+  std::string token;
+  int admin = 0;
+  soci::indicator ind = soci::i_ok;
+  statement st;
+
+  explicit UserQuery(soci::session& sql) :
+    st((sql.prepare << "select token, cast(admin as int) from users where uname = :uname",
+        into(token), into(admin, ind), use(uname))) {}
+};
+
+struct DBPostgres::UserBanQuery : StatementCache::Entry {
+  std::string uname;
+  std::tm expire{};
+  statement st;
+
+  explicit UserBanQuery(soci::session& sql) :
+    st((sql.prepare << "select expire from banned_users inner join users on "
+                    << "users.user_id = banned_users.user_id where uname = :uname",
+        into(expire), use(uname))) {}
+};
+
+struct DBPostgres::IPBanQuery : StatementCache::Entry {
+  std::string ip;
+  std::tm expire{};
+  statement st;
+
+  explicit IPBanQuery(soci::session& sql) :
+    st((sql.prepare << "select expire from banned_ips where ip = :ip",
+        into(expire), use(ip))) {}
+};
+
+DBPostgres::DBPostgres(const std::string &user, const std::string &pass, const std::string &dbName,
+                       const DBPoolOptions& poolOptions) :
+  DBInterface(soci::postgresql, "host=localhost dbname=" + dbName + " user=" + user + " password=" + pass,
+              poolOptions)
+{
+}
+
+DBPostgres::DBPostgres(const std::string &conString, const DBPoolOptions& poolOptions) :
+  DBInterface(soci::postgresql, conString, poolOptions)
 {
 }
 
-DBPostgres::DBPostgres(const soci::backend_factory &backend, const std::string conString) :
-  DBInterface(backend, conString)
+DBPostgres::DBPostgres(const soci::backend_factory &backend, const std::string conString,
+                       const DBPoolOptions& poolOptions) :
+  DBInterface(backend, conString, poolOptions)
 {
 }
 
@@ -31,7 +99,9 @@ DBPostgres::~DBPostgres() {
 }
 
 void DBPostgres::clear() {
-  soci::session sql = getSociSession();
+  // maintenance must not race the drops below
+  partitions_.reset();
+  DBSession sql = getWriterSession();
   sql << "drop table if exists message";
   sql << "drop table if exists control_message";
   sql << "drop table if exists channels";
@@ -39,46 +109,50 @@ void DBPostgres::clear() {
   sql << "drop table if exists banned_users";
   sql << "drop table if exists banned_ips";
   sql << "drop table if exists users";
+  sql << "drop table if exists schema_version";
+  users_.clear();
+  userBans_.clear();
+  ipBans_.clear();
+  names_.clear();
+  retention_.clear();
 }
 
 void DBPostgres::validate() {
   // assume that the wrongthink database & user have already been created (manually)
-  soci::session sql = getSociSession();
-  // create tables if they don't already exist
-  // create users table
-  sql << "create table if not exists users ("
+  // append new steps to the end, never edit one that has shipped
+  migrate({
+    // base tables, "if not exists" adopts databases created before versioning
+    { 1, {
+      "create table if not exists users ("
           "user_id           serial    primary key,"
           "uname             varchar(50) unique not null,"
           "token             varchar(50) not null,"
-          "admin             boolean default false)";
+          "admin             boolean default false)",
 
-  sql << "create table if not exists banned_users ("
+      "create table if not exists banned_users ("
          "entry_id          serial primary key,"
          "user_id           int references users,"
-         "expire            int not null)";
+         "expire            int not null)",
 
-  sql << "create table if not exists banned_ips ("
+      "create table if not exists banned_ips ("
          "entry_id          serial primary key,"
          "ip                varchar(50) unique not null,"
-         "expire            int not null)";
+         "expire            int not null)",
 
-  // create community table
-  sql << "create table if not exists communities ("
+      "create table if not exists communities ("
           "community_id       serial   primary key,"
           "name               varchar(100) unique not null,"
           "admin              int references users,"
-          "public             boolean default true)";
+          "public             boolean default true)",
 
-  // create channel table
-  sql <<  "create table if not exists channels ("
+      "create table if not exists channels ("
           "channel_id      serial  primary key,"
           "name            varchar(100) unique not null,"
           "community       int references communities,"
           "admin              int references users,"
-          "allow_anon       boolean default true)";
+          "allow_anon       boolean default true)",
 
-  // create message table
-  sql <<  "create table if not exists message ("
+      "create table if not exists message ("
           "msg_id         serial primary key,"
           "user_id          int references users,"
           "channel        int references channels,"
@@ -86,70 +160,173 @@ void DBPostgres::validate() {
           "thread_child   boolean not null default false,"
           "edited         boolean default false,"
           "mtext          text not null,"
-          "mdate          int not null default cast(extract(epoch from clock_timestamp()) as int))";
+          "mdate          int not null default cast(extract(epoch from clock_timestamp()) as int))",
 
-  // create control message table
-  sql <<  "create table if not exists control_message ("
+      "create table if not exists control_message ("
           "msg_id         serial primary key,"
           "user_id          int references users,"
           "channel        int references channels,"
           "type           varchar(50),"
           "mtext          text not null,"
-          "mdate          int not null default cast(extract(epoch from clock_timestamp()) as int))";
+          "mdate          int not null default cast(extract(epoch from clock_timestamp()) as int))"
+    } },
+    // indexes behind the per-rpc queries
+    { 2, hotPathIndexes() },
+    { 3, retentionColumns() }
+  });
+
+  if (partitionOptions_.enabled && !partitions_) {
+    partitions_.reset(new MessagePartitions(*this, partitionOptions_));
+    partitions_->convert();
+    partitions_->maintain();
+    partitions_->start();
+  }
+}
+
+void DBPostgres::setPartitioning(const DBPartitionOptions& options) {
+  partitionOptions_ = options;
+}
+
+std::vector<std::string> DBPostgres::retentionColumns() {
+  return {
+    // null keeps the global retention
+    "alter table communities add column retention_days int"
+  };
+}
+
+void DBPostgres::setCommunityRetention(const int community_id, const int days) {
+  DBSession sql = getWriterSession();
+  sql << "update communities set retention_days = :days where community_id = :id",
+      use(days), use(community_id);
+  retention_.clear();
+}
+
+int DBPostgres::retentionCutoff(soci::session &sql, const int channel_id) {
+  int days = 0;
+  if (!retention_.get(channel_id, days)) {
+    uint64_t version = retention_.version(channel_id);
+    soci::indicator ind = soci::i_ok;
+    sql << "select co.retention_days from channels ch "
+        << "inner join communities co on ch.community = co.community_id "
+        << "where ch.channel_id = :id", use(channel_id), into(days, ind);
+    if (!sql.got_data() || ind == soci::i_null)
+      days = partitionOptions_.retentionDays;
+    retention_.put(channel_id, days, RETENTION_CACHE_TTL, version);
+  }
+  if (days <= 0)
+    return 0;
+  return static_cast<int>(std::time(nullptr)) - days * 86400;
+}
+
+std::vector<std::string> DBPostgres::hotPathIndexes() {
+  // uname & ip are already covered by their unique constraints
+  return {
+    // isUserValid, answered from the index alone
+    "create index if not exists users_uname_token_idx on users (uname, token)",
+    // isUserBanned & banUser
+    "create index if not exists banned_users_user_idx on banned_users (user_id)",
+    // GetWrongthinkChannels
+    "create index if not exists channels_community_idx on channels (community)",
+    // GetWrongthinkMessages keyset pages
+    "create index if not exists message_channel_id_idx on message (channel, msg_id)",
+    "create index if not exists message_channel_date_idx on message (channel, mdate, msg_id)",
+    "create index if not exists control_message_channel_idx on control_message (channel, msg_id)"
+  };
+}
+
+bool DBPostgres::lookupUser(const std::string& uname, CachedUser& user) {
+  if (users_.get(uname, user))
+    return user.exists;
+  uint64_t version = users_.version(uname);
+  DBSession sql = getSociSession();
+  UserQuery& q = sql.statements().get<UserQuery>("user", sql.get());
+  q.uname = uname;
+  q.token.clear();
+  q.admin = 0;
+  user.exists = executeCached(sql, "user", q.st);
+  user.token = q.token;
+  user.admin = user.exists && q.ind == soci::i_ok && q.admin != 0;
+  users_.put(uname, user, user.exists ? CACHE_TTL : NEGATIVE_CACHE_TTL, version);
+  return user.exists;
+}
+
+void DBPostgres::invalidateUser(const std::string& uname) {
+  users_.erase(uname);
+  userBans_.erase(uname);
 }
 
 bool DBPostgres::isUserValid(const std::string& uname, const std::string& token) {
-  soci::session sql = getSociSession();
-  sql << "select * from users where uname = :uname and token = :token", use(uname), use(token);
-  return sql.got_data();
+  CachedUser user;
+  return lookupUser(uname, user) && user.token == token;
 }
 
 bool DBPostgres::isUserAdmin(const std::string& uname) {
-  soci::session sql = getSociSession();
-  sql << "select * from users where uname = :uname and admin = true", use(uname);
-  return sql.got_data();
+  CachedUser user;
+  return lookupUser(uname, user) && user.admin;
 }
 
 bool DBPostgres::isUserModerator(const std::string& uname, int channel_id) {
-  soci::session sql = getSociSession();
+  DBSession sql = getSociSession();
   sql << "select * from channels inner join users on channels.admin_id = users.user_id"
       << "where channels.channel_id = :channel_id and users.uname = :uname", use(channel_id), use(uname);
   return sql.got_data();
 }
 
 bool DBPostgres::isUserBanned(const std::string& uname, const std::string& ip) {
-  soci::session sql = getSociSession();
-  std::tm date;
-  sql << "select expire from banned_users inner join users on "
-      << "users.user_id = banned_users.user_id where uname = :uname", use(uname), into(date);
-  if(!sql.got_data()) return false;
+  CachedBan ban;
+  if (!userBans_.get(uname, ban)) {
+    uint64_t version = userBans_.version(uname);
+    DBSession sql = getSociSession();
+    UserBanQuery& q = sql.statements().get<UserBanQuery>("user_ban", sql.get());
+    q.uname = uname;
+    ban.banned = executeCached(sql, "user_ban", q.st);
+    ban.expire = q.expire;
+    userBans_.put(uname, ban, ban.banned ? CACHE_TTL : NEGATIVE_CACHE_TTL, version);
+  }
+  if (!ban.banned) return false;
+  std::tm date = ban.expire;
   std::time_t te = std::mktime(&date);
   std::time_t tc = std::time(nullptr);
   if(tc > te) {
+    DBSession sql = getWriterSession();
     sql << "delete from banned_users where uname = :uname", use(uname);
+    userBans_.erase(uname);
     return false;
   }
-  if (!this->isIPBanned(ip))
-    sql << "insert into banned_ips (ip,expire) values (:ip,:date)", use(ip), use(date);
+  if (!isIPBanned(ip)) {
+    DBSession sql = getWriterSession();
+    sql << "insert into banned_ips (ip,expire) values (:ip,:date)", use(ip), use(ban.expire);
+    ipBans_.erase(ip);
+  }
   return true;
 }
 
 bool DBPostgres::isIPBanned(const std::string& ip) {
-  soci::session sql = getSociSession();
-  std::tm date;
-  sql << "select expire from banned_ips where ip = :ip", use(ip), into(date);
-  if(!sql.got_data()) return false;
+  CachedBan ban;
+  if (!ipBans_.get(ip, ban)) {
+    uint64_t version = ipBans_.version(ip);
+    DBSession sql = getSociSession();
+    IPBanQuery& q = sql.statements().get<IPBanQuery>("ip_ban", sql.get());
+    q.ip = ip;
+    ban.banned = executeCached(sql, "ip_ban", q.st);
+    ban.expire = q.expire;
+    ipBans_.put(ip, ban, ban.banned ? CACHE_TTL : NEGATIVE_CACHE_TTL, version);
+  }
+  if (!ban.banned) return false;
+  std::tm date = ban.expire;
   std::time_t te = std::mktime(&date);
   std::time_t tc = std::time(nullptr);
   if(tc > te) {
+    DBSession sql = getWriterSession();
     sql << "delete from banned_ips where ip = :ip", use(ip);
+    ipBans_.erase(ip);
     return false;
   }
   return true;
 }
 
 void DBPostgres::banUser(const std::string& uname, int days) {
-  soci::session sql = getSociSession();
+  DBSession sql = getWriterSession();
   //convert days to ms
   days = days * 24 * 60 * 60 * 1000;
   int uid;
@@ -166,23 +343,26 @@ void DBPostgres::banUser(const std::string& uname, int days) {
   } else {
     throw soci::soci_error("user not found");
   }
+  invalidateUser(uname);
 }
 
 int DBPostgres::createUser(const std::string uname, const std::string token, int& admin) {
-  soci::session sql = getSociSession();
+  DBSession sql = getWriterSession();
   int uid = 0, adminct = 0;
   sql << "select count(*) from users where admin = true",into(adminct);
   if(adminct == 0) admin = true;
   sql << "insert into users (uname,token,admin) values(:uname,:token,:admin)",
         use(uname), use(token), use(admin);
   sql << "select user_id from users where uname = :uname", use(uname), into(uid);
+  // a miss for this name may be cached
+  invalidateUser(uname);
 
   return uid;
 }
 
 
 int DBPostgres::createChannel(const std::string name, const int community, const int admin_id, const int anonymous) {
-  soci::session sql = getSociSession();
+  DBSession sql = getWriterSession();
   int channel_id = 0;
 
   sql << "insert into channels(name, "
@@ -191,38 +371,159 @@ int DBPostgres::createChannel(const std::string name, const int community, const
        use(name), use(community), use(admin_id), use(anonymous);
   sql << "select channel_id from channels where name = :name",
     use(name), into(channel_id);
+  noteWrite("community:" + std::to_string(community));
 
   return channel_id;
 }
 
 int DBPostgres::createCommunity(const std::string name, const int admin, const int pub) {
-  soci::session sql = getSociSession();
+  DBSession sql = getWriterSession();
   int community_id;
 
   sql << "insert into communities (name, admin, public) "
       << "values(:name,:admin,:public)", use(name), use(admin), use(pub);
   sql << "select community_id from communities where name = :name",
     use(name), into(community_id);
+  noteWrite("communities");
 
   return community_id;
 }
 
-rowset<row> DBPostgres::getCommunityRowset(soci::session &sql) {
-  rowset<row> rs = (sql.prepare << "select * from communities "
-                                << "inner join users on "
-                                << "communities.admin=users.user_id");
+// the vectors are handed to soci as bulk into() buffers, a fetch fills up to
+// their size & shrinks them to the rows it got, so they are regrown each batch
+struct DBPostgres::CommunityColumns {
+  std::vector<int> ids;
+  std::vector<std::string> names;
+  std::vector<std::string> admins;
+
+  void resize(size_t rows) {
+    ids.resize(rows);
+    names.resize(rows);
+    admins.resize(rows);
+  }
+};
+
+struct DBPostgres::ChannelColumns {
+  std::vector<int> ids;
+  std::vector<std::string> names;
+  std::vector<int> anonymous;
+  std::vector<std::string> admins;
+
+  void resize(size_t rows) {
+    ids.resize(rows);
+    names.resize(rows);
+    anonymous.resize(rows);
+    admins.resize(rows);
+  }
+};
+
+// the projection MessageColumns binds, nullable & boolean columns are
+// normalized so they bind into plain ints
+static const std::string MESSAGE_COLUMNS =
+  "select m.msg_id, m.user_id, coalesce(m.thread_id, 0) as thread_id, "
+  "cast(m.thread_child as int) as thread_child, coalesce(cast(m.edited as int), 0) as edited, "
+  "m.mtext, m.mdate, u.uname from message m inner join users u on m.user_id = u.user_id ";
+
+struct DBPostgres::MessageColumns {
+  std::vector<int> ids;
+  std::vector<int> userIds;
+  std::vector<int> threadIds;
+  std::vector<int> threadChild;
+  std::vector<int> edited;
+  std::vector<std::string> texts;
+  std::vector<int> dates;
+  std::vector<std::string> unames;
+
+  void resize(size_t rows) {
+    ids.resize(rows);
+    userIds.resize(rows);
+    threadIds.resize(rows);
+    threadChild.resize(rows);
+    edited.resize(rows);
+    texts.resize(rows);
+    dates.resize(rows);
+    unames.resize(rows);
+  }
 
-  return rs;
+  /* maps the fetched batch onto out */
+  void moveTo(int channel, std::vector<WrongthinkMessage>& out) {
+    out.reserve(out.size() + ids.size());
+    for (size_t i = 0; i < ids.size(); i++) {
+      WrongthinkMessage msg;
+      msg.set_uname(std::move(unames[i]));
+      msg.set_channelid(channel);
+      msg.set_userid(userIds[i]);
+      msg.set_threadid(threadIds[i]);
+      msg.set_threadchild(threadChild[i]);
+      msg.set_edited(edited[i]);
+      msg.set_text(std::move(texts[i]));
+      msg.set_date(dates[i]);
+      msg.set_messageid(ids[i]);
+      out.push_back(std::move(msg));
+    }
+  }
+};
+
+// a history page variant prepared once per connection, its buffers & bound
+// parameters live next to the statement
+struct DBPostgres::MessagePageQuery : StatementCache::Entry {
+  MessageColumns c;
+  int channel = 0;
+  int key = 0;
+  int cutoff = 0;
+  int limit = 0;
+  statement st;
+
+  MessagePageQuery(soci::session& sql, const std::string& query) :
+    st((sql.prepare << query,
+        into(c.ids), into(c.userIds), into(c.threadIds), into(c.threadChild),
+        into(c.edited), into(c.texts), into(c.dates), into(c.unames),
+        use(channel), use(key), use(cutoff), use(limit))) {}
+};
+
+void DBPostgres::getCommunities(soci::session &sql, std::vector<WrongthinkCommunity>& out) {
+  CommunityColumns c;
+  c.resize(fetchBatch_);
+  statement st = (sql.prepare << "select c.community_id, c.name, u.uname from communities c "
+                              << "inner join users u on c.admin = u.user_id "
+                              << "order by c.community_id",
+                  into(c.ids), into(c.names), into(c.admins));
+  st.execute();
+  while (st.fetch()) {
+    for (size_t i = 0; i < c.ids.size(); i++) {
+      WrongthinkCommunity community;
+      community.set_communityid(c.ids[i]);
+      community.set_name(std::move(c.names[i]));
+      community.set_unameadmin(std::move(c.admins[i]));
+      out.push_back(std::move(community));
+    }
+    c.resize(fetchBatch_);
+  }
 }
 
-
-rowset<row> DBPostgres::getCommunityChannelsRowset(soci::session &sql, const int community_id) {
-  rowset<row> rs = (sql.prepare << "select * from channels "
-                                << "inner join users on channels.admin=users.user_id "
-                                << "where community=:community order by channels.channel_id",
-                                use(community_id));
-
-  return rs;
+void DBPostgres::getCommunityChannels(soci::session &sql, const int community_id,
+                                      std::vector<WrongthinkChannel>& out) {
+  ChannelColumns c;
+  c.resize(fetchBatch_);
+  statement st = (sql.prepare << "select ch.channel_id, ch.name, "
+                              << "coalesce(cast(ch.allow_anon as int), 0), u.uname from channels ch "
+                              << "inner join users u on ch.admin = u.user_id "
+                              << "where ch.community = :community order by ch.channel_id",
+                  into(c.ids), into(c.names), into(c.anonymous), into(c.admins),
+                  use(community_id));
+  st.execute();
+  while (st.fetch()) {
+    for (size_t i = 0; i < c.ids.size(); i++) {
+      WrongthinkChannel channel;
+      channel.set_channelid(c.ids[i]);
+      channel.set_name(std::move(c.names[i]));
+      channel.set_anonymous(c.anonymous[i]);
+      channel.set_communityid(community_id);
+      channel.set_unameadmin(std::move(c.admins[i]));
+      out.push_back(std::move(channel));
+    }
+    c.resize(fetchBatch_);
+  }
 }
 
 /*
@@ -237,14 +538,90 @@ sql <<  "create table if not exists message ("
           "mdate          timestamp with time zone not null default clock_timestamp())";
 */
 
-rowset<row> DBPostgres::getChannelMessages(soci::session &sql, const int channel_id) {
-  rowset<row> rs = (sql.prepare << "select * from message inner join users on "
-              << "message.user_id = users.user_id where "
-              << "message.channel = :channelid order by message.msg_id", use(channel_id));
+void DBPostgres::getChannelMessages(DBSession &sql, const int channel_id,
+                                    const MessagePage& page, const MessageSink& sink) {
+  // every variant is a range scan on (channel, msg_id) or (channel, mdate)
+  // that stops after limit rows, pages cost the same wherever they sit in history.
+  // the mdate bound hides expired history & prunes partitions that hold none
+  int limit = page.limit;
+  int key = page.key;
+  int cutoff = retentionCutoff(sql, channel_id);
+
+  std::string query;
+  std::string name;
+  switch (page.anchor) {
+    case MessagePage::Anchor::AFTER_ID:
+      name = "page_after_id";
+      query = MESSAGE_COLUMNS + "where m.channel = :channelid and m.msg_id > :key and m.mdate >= :cutoff "
+                        "order by m.msg_id limit :limit";
+      break;
+    case MessagePage::Anchor::AFTER_DATE:
+      name = "page_after_date";
+      query = MESSAGE_COLUMNS + "where m.channel = :channelid and m.mdate > :key and m.mdate >= :cutoff "
+                        "order by m.mdate, m.msg_id limit :limit";
+      break;
+    case MessagePage::Anchor::NEWEST:
+    default:
+      // the newest page is the page before any id
+      key = std::numeric_limits<int>::max();
+      [[fallthrough]];
+    case MessagePage::Anchor::BEFORE_ID:
+      // walk the index backwards, then flip the page back to oldest first
+      name = "page_before_id";
+      query = "select * from (" + MESSAGE_COLUMNS +
+              "where m.channel = :channelid and m.msg_id < :key and m.mdate >= :cutoff "
+              "order by m.msg_id desc limit :limit) page order by msg_id";
+      break;
+  }
 
-  return rs;
+  MessagePageQuery& q = sql.statements().get<MessagePageQuery>(name, sql.get(), query);
+  q.channel = channel_id;
+  q.key = key;
+  q.cutoff = cutoff;
+  q.limit = limit;
+  size_t batch = std::min<size_t>(fetchBatch_, std::max(limit, 1));
+  q.c.resize(batch);
+  std::vector<WrongthinkMessage> out;
+  try {
+    q.st.execute();
+    while (q.st.fetch()) {
+      out.clear();
+      q.c.moveTo(channel_id, out);
+      if (!sink(out))
+        return;
+      q.c.resize(batch);
+    }
+  } catch (...) {
+    sql.statements().erase(name);
+    throw;
+  }
 }
 
+void DBPostgres::getMessagesById(soci::session &sql, const int channel_id,
+                                 const std::vector<int>& ids, std::vector<WrongthinkMessage>& out) {
+  if (ids.empty())
+    return;
+  // ids are ints, inlining them is safe & works the same on every backend
+  std::string list;
+  for (int id : ids)
+    list += (list.empty() ? "" : ",") + std::to_string(id);
+  int cutoff = retentionCutoff(sql, channel_id);
+
+  MessageColumns c;
+  c.resize(std::min(fetchBatch_, ids.size()));
+  size_t batch = c.ids.size();
+  statement st = (sql.prepare << MESSAGE_COLUMNS
+                  << "where m.channel = :channelid and m.msg_id in (" << list << ") "
+                  << "and m.mdate >= :cutoff order by m.msg_id",
+                  into(c.ids), into(c.userIds), into(c.threadIds), into(c.threadChild),
+                  into(c.edited), into(c.texts), into(c.dates), into(c.unames),
+                  use(channel_id), use(cutoff));
+  st.execute();
+  while (st.fetch()) {
+    c.moveTo(channel_id, out);
+    c.resize(batch);
+  }
+}
 
 std::unique_ptr<row> DBPostgres::getChannelRow(soci::session &sql, const int channel_id) {
   std::unique_ptr<row> r(new row());
@@ -254,3 +631,117 @@ std::unique_ptr<row> DBPostgres::getChannelRow(soci::session &sql, const int cha
 
   return r;
 }
+
+double DBPostgres::replicationLag(soci::session& sql) {
+  // replay timestamps only move when the primary writes, a replica that has
+  // replayed everything it received isn't behind however old they are
+  double lag = 0;
+  soci::indicator ind = soci::i_ok;
+  sql << "select case when pg_last_wal_receive_lsn() = pg_last_wal_replay_lsn() then 0 "
+      << "else extract(epoch from now() - pg_last_xact_replay_timestamp()) end",
+      into(lag, ind);
+  // null on a primary
+  return ind == soci::i_ok ? lag : 0;
+}
+
+std::string DBPostgres::getUserName(int user_id) {
+  std::string uname;
+  if (names_.get(user_id, uname))
+    return uname;
+  uint64_t version = names_.version(user_id);
+  DBSession sql = getSociSession();
+  sql << "select uname from users where user_id = :id", use(user_id), into(uname);
+  names_.put(user_id, uname, sql.got_data() ? NAME_CACHE_TTL : NEGATIVE_CACHE_TTL, version);
+  return uname;
+}
+
+namespace {
+
+// COPY text format, escape the characters that delimit fields & rows
+void appendCopyText(std::string& out, const std::string& text) {
+  for (char c : text) {
+    switch (c) {
+      case '\\': out += "\\\\"; break;
+      case '\t': out += "\\t"; break;
+      case '\n': out += "\\n"; break;
+      case '\r': out += "\\r"; break;
+      default: out += c;
+    }
+  }
+}
+
+void putCopyData(PGconn* conn, std::string& buffer) {
+  if (PQputCopyData(conn, buffer.data(), static_cast<int>(buffer.size())) != 1)
+    throw soci::soci_error(std::string("COPY failed: ") + PQerrorMessage(conn));
+  buffer.clear();
+}
+
+}
+
+void DBPostgres::insertMessages(soci::session &sql, std::vector<MessageRow>& rows) {
+  // bytes buffered before handing a chunk to libpq
+  constexpr size_t COPY_CHUNK = 64 * 1024;
+  if (rows.empty())
+    return;
+
+  // COPY can't return generated keys, reserve the ids up front instead
+  int count = static_cast<int>(rows.size());
+  std::vector<int> ids(rows.size());
+  sql << "select nextval(pg_get_serial_sequence('message', 'msg_id')) "
+      << "from generate_series(1, :count)", use(count), into(ids);
+  if (ids.size() != rows.size())
+    throw soci::soci_error("failed to reserve message ids");
+  for (size_t i = 0; i < rows.size(); i++)
+    rows[i].id = ids[i];
+
+  auto backend = static_cast<soci::postgresql_session_backend*>(sql.get_backend());
+  PGconn* conn = backend->conn_;
+
+  PGresult* res = PQexec(conn, "copy message (msg_id,user_id,channel,thread_id,thread_child,mtext,mdate) from stdin");
+  bool started = PQresultStatus(res) == PGRES_COPY_IN;
+  PQclear(res);
+  if (!started)
+    throw soci::soci_error(std::string("COPY failed: ") + PQerrorMessage(conn));
+
+  std::string buffer;
+  buffer.reserve(COPY_CHUNK + 1024);
+  try {
+    for (const MessageRow& r : rows) {
+      buffer += std::to_string(r.id);
+      buffer += '\t';
+      buffer += std::to_string(r.userId);
+      buffer += '\t';
+      buffer += std::to_string(r.channel);
+      buffer += '\t';
+      buffer += std::to_string(r.threadId);
+      buffer += '\t';
+      buffer += r.threadChild ? 't' : 'f';
+      buffer += '\t';
+      appendCopyText(buffer, r.text);
+      buffer += '\t';
+      buffer += std::to_string(r.date);
+      buffer += '\n';
+      if (buffer.size() >= COPY_CHUNK)
+        putCopyData(conn, buffer);
+    }
+    if (!buffer.empty())
+      putCopyData(conn, buffer);
+  } catch (const soci::soci_error&) {
+    PQputCopyEnd(conn, "aborted");
+    while ((res = PQgetResult(conn)) != nullptr)
+      PQclear(res);
+    throw;
+  }
+
+  if (PQputCopyEnd(conn, nullptr) != 1)
+    throw soci::soci_error(std::string("COPY failed: ") + PQerrorMessage(conn));
+  // the copy only counts once the server has acknowledged it
+  std::string error;
+  while ((res = PQgetResult(conn)) != nullptr) {
+    if (PQresultStatus(res) != PGRES_COMMAND_OK && error.empty())
+      error = PQresultErrorMessage(res);
+    PQclear(res);
+  }
+  if (!error.empty())
+    throw soci::soci_error("COPY failed: " + error);
+}
@@ -19,17 +19,37 @@ If not, see <https://www.gnu.org/licenses/>.
 #define DB_POSTGRES_H
 
 #include "DBInterface.h"
+#include "TTLCache.h"
+#include "MessagePartitions.h"
 #include "soci-postgresql.h"
 #include <ctime>
 
 class DBPostgres : public DBInterface {
 protected:
-  DBPostgres(const soci::backend_factory &backend, const std::string conString);
+  DBPostgres(const soci::backend_factory &backend, const std::string conString,
+             const DBPoolOptions& poolOptions);
+  virtual double replicationLag(soci::session& sql) override;
+  /* drops cached credentials & ban state, call after changing either */
+  void invalidateUser(const std::string& uname);
+  /* indexes shared by every backend, see validate() */
+  static std::vector<std::string> hotPathIndexes();
+  /* schema steps after the indexes, shared by every backend */
+  static std::vector<std::string> retentionColumns();
+  /* oldest mdate still visible in a channel, 0 when its community keeps everything */
+  int retentionCutoff(soci::session& sql, int channel_id);
 public:
-  DBPostgres(const std::string &user, const std::string &pass, const std::string &dbName);
+  DBPostgres(const std::string &user, const std::string &pass, const std::string &dbName,
+             const DBPoolOptions& poolOptions = DBPoolOptions{});
+  /* any libpq connection string, e.g. "host=db1 dbname=wrongthink user=..." */
+  DBPostgres(const std::string &conString, const DBPoolOptions& poolOptions);
   ~DBPostgres();
   virtual void validate() override;
   virtual void clear() override;
+  /* call before validate(), partitions are created & maintained from there.
+     sqlite only honours retentionDays */
+  void setPartitioning(const DBPartitionOptions& options);
+  /* history older than days is hidden, 0 falls back to the global retention */
+  void setCommunityRetention(int community_id, int days);
 
   virtual bool isUserValid(const std::string& uname, const std::string& token) override;
   virtual bool isUserAdmin(const std::string& uname) override;
@@ -40,10 +60,51 @@ public:
   virtual int createUser(std::string uname, std::string password, int& admin) override;
   virtual int createChannel(std::string name, int community, int admin_id, int anonymous) override;
   virtual int createCommunity(std::string name, int admin, int pub) override;
-  virtual rowset<row> getCommunityRowset(soci::session &sql) override;
-  virtual rowset<row> getCommunityChannelsRowset(soci::session &sql, int community_id) override;
-  virtual rowset<row> getChannelMessages(soci::session &sql, int channel_id) override;
+  virtual void getCommunities(soci::session &sql, std::vector<WrongthinkCommunity>& out) override;
+  virtual void getCommunityChannels(soci::session &sql, int community_id,
+                                    std::vector<WrongthinkChannel>& out) override;
+  using DBInterface::getChannelMessages;
+  virtual void getChannelMessages(DBSession &sql, int channel_id, const MessagePage& page,
+                                  const MessageSink& sink) override;
+  virtual void getMessagesById(soci::session &sql, int channel_id, const std::vector<int>& ids,
+                               std::vector<WrongthinkMessage>& out) override;
   virtual std::unique_ptr<row> getChannelRow(soci::session &sql, int channel_id) override;
+  virtual std::string getUserName(int user_id) override;
+  /* streams rows through COPY ... FROM STDIN */
+  virtual void insertMessages(soci::session &sql, std::vector<MessageRow>& rows) override;
+
+private:
+  // bulk into() buffers of the typed reads
+  struct CommunityColumns;
+  struct ChannelColumns;
+  struct MessageColumns;
+  // statements cached per connection for the auth checks & history pages
+  struct UserQuery;
+  struct UserBanQuery;
+  struct IPBanQuery;
+  struct MessagePageQuery;
+
+  struct CachedUser {
+    bool exists;
+    std::string token;
+    bool admin;
+  };
+  struct CachedBan {
+    bool banned;
+    std::tm expire;
+  };
+  bool lookupUser(const std::string& uname, CachedUser& user);
+
+  // auth & ban checks run on every rpc & streamed message, these absorb them
+  TTLCache<std::string, CachedUser> users_;
+  TTLCache<std::string, CachedBan> userBans_;
+  TTLCache<std::string, CachedBan> ipBans_;
+  // user_id -> uname for history read from a MessageStore, names never change
+  TTLCache<int, std::string> names_;
+  // channel_id -> retention days, consulted by every history page
+  TTLCache<int, int> retention_;
+  DBPartitionOptions partitionOptions_;
+  std::unique_ptr<MessagePartitions> partitions_;
 };
 
 #endif // DB_POSTGRES_H
@@ -17,14 +17,54 @@ If not, see <https://www.gnu.org/licenses/>.
 */
 #include "DBSQLite.h"
 
-SQLiteDB::SQLiteDB(const std::string &filename) :
-  DBPostgres(soci::sqlite3, filename)
+namespace {
+
+void applyPragmas(soci::session& sql) {
+  // readers keep going while the writer commits
+  sql << "pragma journal_mode = wal";
+  // wal stays consistent on power loss at normal, only the last commits can go
+  sql << "pragma synchronous = normal";
+  sql << "pragma mmap_size = 268435456";
+  // writes from outside the writer connection wait for it instead of failing
+  sql << "pragma busy_timeout = 5000";
+}
+
+}
+
+SQLiteDB::SQLiteDB(const std::string &filename, const DBPoolOptions& poolOptions) :
+  DBPostgres(soci::sqlite3, filename, tune(poolOptions, nullptr)),
+  writerPool_{},
+  insertMutex_{},
+  insertSession_{nullptr},
+  insertStatement_{}
 {
+  DBPoolOptions writerOptions = tune(poolOptions, [this](soci::session&) {
+    // a new or reconnected writer invalidates the prepared insert
+    std::lock_guard<std::mutex> lock(insertMutex_);
+    insertStatement_.reset();
+  });
+  writerOptions.size = 1;
+  writerPool_.reset(new DBConnectionPool(soci::sqlite3, filename, writerOptions));
+}
 
+DBPoolOptions SQLiteDB::tune(DBPoolOptions options, std::function<void(soci::session&)> onConnect) {
+  auto userHook = options.onConnect;
+  options.onConnect = [userHook, onConnect](soci::session& sql) {
+    applyPragmas(sql);
+    if (onConnect)
+      onConnect(sql);
+    if (userHook)
+      userHook(sql);
+  };
+  return options;
+}
+
+DBSession SQLiteDB::getWriterSession() {
+  return writerPool_->acquire();
 }
 
 void SQLiteDB::banUser(const std::string& uname, int days) {
-  soci::session sql = getSociSession();
+  DBSession sql = getWriterSession();
   //convert days to ms
   days = days * 24 * 60 * 60 * 1000;
   int uid;
@@ -41,46 +81,45 @@ void SQLiteDB::banUser(const std::string& uname, int days) {
   } else {
     throw soci::soci_error("user not found");
   }
+  invalidateUser(uname);
 }
 
 void SQLiteDB::validate() {
   // assume that the wrongthink database & user have already been created (manually)
-  soci::session sql = getSociSession();
-  // create tables if they don't already exist
-  // create users table
-  sql << "create table if not exists users ("
+  // append new steps to the end, never edit one that has shipped
+  migrate({
+    // base tables, "if not exists" adopts databases created before versioning
+    { 1, {
+      "create table if not exists users ("
           "user_id           integer    primary key,"
           "uname             varchar(50) unique not null,"
           "token          varchar(50) not null,"
-          "admin             boolean default false)";
+          "admin             boolean default false)",
 
-  sql << "create table if not exists banned_users ("
+      "create table if not exists banned_users ("
          "entry_id          integer primary key,"
          "user_id           int references users,"
-         "expire            date not null default (cast(strftime('%s', 'now', '+3 days') as int)))";
+         "expire            date not null default (cast(strftime('%s', 'now', '+3 days') as int)))",
 
-  sql << "create table if not exists banned_ips ("
+      "create table if not exists banned_ips ("
          "entry_id          integer primary key,"
          "ip                varchar(50) unique not null,"
-         "expire            date not null)";
+         "expire            date not null)",
 
-  // create community table
-  sql << "create table if not exists communities ("
+      "create table if not exists communities ("
           "community_id       integer   primary key,"
           "name               varchar(100) unique not null,"
           "admin              int references users,"
-          "public             boolean default true)";
+          "public             boolean default true)",
 
-  // create channel table
-  sql <<  "create table if not exists channels ("
+      "create table if not exists channels ("
           "channel_id      integer  primary key,"
           "name            varchar(100) unique not null,"
           "community       int references communities,"
           "admin              int references users,"
-          "allow_anon       boolean default true)";
+          "allow_anon       boolean default true)",
 
-  // create message table
-  sql <<  "create table if not exists message ("
+      "create table if not exists message ("
           "msg_id         integer primary key,"
           "user_id          int references users,"
           "channel        int references channels,"
@@ -88,14 +127,59 @@ void SQLiteDB::validate() {
           "thread_child   boolean not null default false,"
           "edited         boolean default false,"
           "mtext          text not null,"
-          "mdate          int not null default (cast(strftime('%s', 'now') as int)))";
+          "mdate          int not null default (cast(strftime('%s', 'now') as int)))",
 
-  // create control message table
-  sql <<  "create table if not exists control_message ("
+      "create table if not exists control_message ("
           "msg_id         integer primary key,"
           "user_id          int references users,"
           "channel        int references channels,"
           "type           varchar(50),"
           "mtext          text not null,"
-          "mdate          int not null default (cast(strftime('%s', 'now') as int)))";
-}
\ No newline at end of file
+          "mdate          int not null default (cast(strftime('%s', 'now') as int)))"
+    } },
+    // indexes behind the per-rpc queries
+    { 2, hotPathIndexes() },
+    { 3, retentionColumns() }
+  });
+}
+
+void SQLiteDB::insertMessages(soci::session &sql, std::vector<MessageRow>& rows) {
+  if (rows.empty())
+    return;
+  std::lock_guard<std::mutex> lock(insertMutex_);
+  // messages are only inserted from the writer connection & sqlite serializes
+  // writers, so ids can be handed out from the current max
+  int lastId = 0;
+  soci::indicator ind = soci::i_ok;
+  sql << "select max(msg_id) from message", into(lastId, ind);
+  if (ind == soci::i_null)
+    lastId = 0;
+  insertIds_.clear();
+  insertUserIds_.clear();
+  insertChannels_.clear();
+  insertThreadIds_.clear();
+  insertThreadChildren_.clear();
+  insertTexts_.clear();
+  insertDates_.clear();
+  for (MessageRow& r : rows) {
+    r.id = ++lastId;
+    insertIds_.push_back(r.id);
+    insertUserIds_.push_back(r.userId);
+    insertChannels_.push_back(r.channel);
+    insertThreadIds_.push_back(r.threadId);
+    insertThreadChildren_.push_back(r.threadChild);
+    insertTexts_.push_back(r.text);
+    insertDates_.push_back(r.date);
+  }
+  // prepared once per writer connection
+  if (!insertStatement_ || insertSession_ != &sql) {
+    insertSession_ = &sql;
+    insertStatement_.reset(new soci::statement((sql.prepare <<
+      "insert into message(msg_id,user_id,channel,thread_id,thread_child,mtext,mdate)"
+      " values(:msg_id,:user_id,:channel,:thread_id,:thread_child,:text,:mdate)",
+      use(insertIds_), use(insertUserIds_), use(insertChannels_), use(insertThreadIds_),
+      use(insertThreadChildren_), use(insertTexts_), use(insertDates_))));
+  }
+  // stepped once per row, the caller's transaction makes it a single commit
+  insertStatement_->execute(true);
+}
@@ -21,13 +21,44 @@ If not, see <https://www.gnu.org/licenses/>.
 #include "DBInterface.h"
 #include "DBPostgres.h"
 #include "soci-sqlite3.h"
+#include <mutex>
 
+/*
+ * Postgres-free backend for small nodes. Connections run in WAL mode with
+ * the file memory mapped, so the read pool never blocks on the writer.
+ * Every write, message batches included, goes through one dedicated writer
+ * connection, message batches reuse a prepared insert across batches.
+ */
 class SQLiteDB : public DBPostgres {
 public:
-  SQLiteDB(const std::string &filename);
+  SQLiteDB(const std::string &filename, const DBPoolOptions& poolOptions = DBPoolOptions{});
   virtual ~SQLiteDB() {}
+  virtual DBSession getWriterSession() override;
   virtual void validate() override;
   virtual void banUser(const std::string& uname, int days) override;
+  /* sqlite has no COPY, bulk binds one prepared insert instead */
+  virtual void insertMessages(soci::session &sql, std::vector<MessageRow>& rows) override;
+
+protected:
+  /* file replicas are copied, not streamed, there is nothing to measure */
+  virtual double replicationLag(soci::session& sql) override { (void)sql; return 0; }
+
+private:
+  static DBPoolOptions tune(DBPoolOptions options, std::function<void(soci::session&)> onConnect);
+
+  std::unique_ptr<DBConnectionPool> writerPool_;
+  // insert statement prepared on the writer connection & the vectors bound to
+  // it, declared after the pool so it is destroyed before the connection
+  std::mutex insertMutex_;
+  soci::session* insertSession_;
+  std::unique_ptr<soci::statement> insertStatement_;
+  std::vector<int> insertIds_;
+  std::vector<int> insertUserIds_;
+  std::vector<int> insertChannels_;
+  std::vector<int> insertThreadIds_;
+  std::vector<int> insertThreadChildren_;
+  std::vector<std::string> insertTexts_;
+  std::vector<int> insertDates_;
 };
 
 #endif // DB_SQLITE_H
@@ -0,0 +1,646 @@
+/*
+This file is part of Wrongthink.
+
+Wrongthink - Modern, open & performant chat protocol. Based on gRPC.
+Copyright (C) 2020 Ophiuchus2
+
+This program is free software: you can redistribute it and/or modify it under the
+terms of the GNU Affero General Public License as published by the Free Software Foundation,
+either version 3 of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License along with this program.
+If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "MessageIndex.h"
+
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <algorithm>
+#include <iterator>
+#include <filesystem>
+#include <stdexcept>
+#include <system_error>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+/*
+ * segment layout, little endian:
+ *   header: "WTIX", u32 format version, u32 term count, i32 newest date,
+ *           u64 dictionary offset
+ *   posting lists, newest first: varint date (the first, then the distance
+ *           to the previous one), varint channel, varint id
+ *   dictionary, sorted by term: u16 term length, term, u32 postings,
+ *           u64 offset, u32 bytes
+ *   u32 crc32 of everything before it
+ */
+constexpr char MAGIC[4] = {'W', 'T', 'I', 'X'};
+constexpr uint32_t FORMAT_VERSION = 1;
+constexpr size_t HEADER_SIZE = 24;
+// longer words are cut, they are rarely searched for verbatim
+constexpr size_t MAX_TERM = 64;
+
+uint32_t crc32(const char* data, size_t size) {
+  static const auto table = []() {
+    std::vector<uint32_t> t(256);
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; k++)
+        c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+      t[i] = c;
+    }
+    return t;
+  }();
+  uint32_t crc = 0xFFFFFFFFu;
+  for (size_t i = 0; i < size; i++)
+    crc = table[(crc ^ static_cast<uint8_t>(data[i])) & 0xFF] ^ (crc >> 8);
+  return crc ^ 0xFFFFFFFFu;
+}
+
+template <typename T>
+void put(std::string& out, T value) {
+  out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template <typename T>
+T get(const char* in) {
+  T value;
+  std::memcpy(&value, in, sizeof(T));
+  return value;
+}
+
+void putVarint(std::string& out, uint32_t value) {
+  while (value >= 0x80) {
+    out.push_back(static_cast<char>((value & 0x7F) | 0x80));
+    value >>= 7;
+  }
+  out.push_back(static_cast<char>(value));
+}
+
+uint32_t getVarint(const char*& in, const char* end) {
+  uint32_t value = 0;
+  for (int shift = 0; shift < 35 && in < end; shift += 7) {
+    uint8_t byte = static_cast<uint8_t>(*in++);
+    value |= static_cast<uint32_t>(byte & 0x7F) << shift;
+    if (!(byte & 0x80))
+      return value;
+  }
+  throw std::runtime_error("corrupt search index posting list");
+}
+
+/* hits must be sorted newest first */
+void encodePostings(std::string& out, const std::vector<SearchHit>& hits) {
+  int previous = 0;
+  for (size_t i = 0; i < hits.size(); i++) {
+    putVarint(out, static_cast<uint32_t>(i == 0 ? hits[i].date : previous - hits[i].date));
+    putVarint(out, static_cast<uint32_t>(hits[i].channel));
+    putVarint(out, static_cast<uint32_t>(hits[i].id));
+    previous = hits[i].date;
+  }
+}
+
+void sortHits(std::vector<SearchHit>& hits) {
+  std::sort(hits.begin(), hits.end());
+  hits.erase(std::unique(hits.begin(), hits.end()), hits.end());
+}
+
+std::system_error ioError(const std::string& what, const std::string& path) {
+  return std::system_error(errno, std::generic_category(), what + " " + path);
+}
+
+/* a term's posting list in a segment, decoded one hit at a time */
+struct PostingWalk {
+  const char* in = nullptr;
+  const char* end = nullptr;
+  uint32_t left = 0;
+  bool started = false;
+  SearchHit hit;
+
+  bool next() {
+    if (left == 0)
+      return false;
+    uint32_t date = getVarint(in, end);
+    hit.date = started ? hit.date - static_cast<int>(date) : static_cast<int>(date);
+    hit.channel = static_cast<int>(getVarint(in, end));
+    hit.id = static_cast<int>(getVarint(in, end));
+    started = true;
+    --left;
+    return true;
+  }
+};
+
+/*
+ * One term's hits newest first, merged from the in memory postings & the
+ * segment posting lists & filtered by the query. Segment postings are only
+ * decoded as far as the search reads them.
+ */
+class TermCursor {
+public:
+  explicit TermCursor(const SearchQuery& query) : query_(&query), pos_{0} {}
+
+  /* hits that didn't pass keep() are dropped */
+  void addMemory(const std::vector<SearchHit>& hits) {
+    std::copy_if(hits.begin(), hits.end(), std::back_inserter(memory_),
+      [this](const SearchHit& hit) { return keep(hit); });
+  }
+  void addSegment(const PostingWalk& walk) { walks_.push_back(walk); }
+
+  /* positions on the newest hit, false if there is none */
+  bool start() {
+    sortHits(memory_);
+    live_.clear();
+    for (size_t i = 0; i < walks_.size(); i++) {
+      if (advanceWalk(walks_[i]))
+        live_.push_back(i);
+    }
+    return advance();
+  }
+  const SearchHit& current() const { return current_; }
+  /* moves to the next older hit, false once every source ran out */
+  bool advance() {
+    bool found = false;
+    SearchHit next;
+    if (pos_ < memory_.size()) {
+      next = memory_[pos_];
+      found = true;
+    }
+    for (size_t i : live_) {
+      if (!found || walks_[i].hit < next) {
+        next = walks_[i].hit;
+        found = true;
+      }
+    }
+    if (!found)
+      return false;
+    // the same posting may sit in several sources, step past all of them
+    if (pos_ < memory_.size() && memory_[pos_] == next)
+      ++pos_;
+    for (size_t j = 0; j < live_.size();) {
+      PostingWalk& walk = walks_[live_[j]];
+      if (walk.hit == next && !advanceWalk(walk)) {
+        live_[j] = live_.back();
+        live_.pop_back();
+      } else {
+        ++j;
+      }
+    }
+    current_ = next;
+    return true;
+  }
+
+private:
+  bool keep(const SearchHit& hit) const {
+    if (query_->after.date != 0 && !(query_->after < hit))
+      return false;
+    return query_->channels.empty() ||
+      std::binary_search(query_->channels.begin(), query_->channels.end(), hit.channel);
+  }
+  bool advanceWalk(PostingWalk& walk) const {
+    while (walk.next()) {
+      if (keep(walk.hit))
+        return true;
+    }
+    return false;
+  }
+
+  const SearchQuery* query_;
+  std::vector<SearchHit> memory_;
+  size_t pos_;
+  std::vector<PostingWalk> walks_;
+  // walks that still have a hit
+  std::vector<size_t> live_;
+  SearchHit current_;
+};
+
+}
+
+struct MessageIndex::Segment {
+  struct Term {
+    std::string text;
+    uint32_t count;
+    uint64_t offset;
+    uint32_t bytes;
+  };
+
+  std::string path;
+  // the file mapped read only, the page cache holds what searches touch
+  const char* data = nullptr;
+  size_t size = 0;
+  std::vector<Term> terms;
+  int newest = 0;
+
+  Segment() = default;
+  Segment(const Segment&) = delete;
+  Segment& operator=(const Segment&) = delete;
+  ~Segment() {
+    if (data)
+      munmap(const_cast<char*>(data), size);
+  }
+
+  const Term* find(const std::string& term) const {
+    auto it = std::lower_bound(terms.begin(), terms.end(), term,
+      [](const Term& t, const std::string& key) { return t.text < key; });
+    return it != terms.end() && it->text == term ? &*it : nullptr;
+  }
+
+  /* the postings of t, valid while the segment is */
+  PostingWalk walk(const Term& t) const {
+    PostingWalk w;
+    w.in = data + t.offset;
+    w.end = w.in + t.bytes;
+    w.left = t.count;
+    return w;
+  }
+
+  static std::shared_ptr<const Segment> load(const std::string& path) {
+    auto segment = std::make_shared<Segment>();
+    segment->path = path;
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      throw ioError("failed to open", path);
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+      close(fd);
+      throw ioError("failed to stat", path);
+    }
+    if (static_cast<size_t>(st.st_size) < HEADER_SIZE + 4) {
+      close(fd);
+      throw std::runtime_error("corrupt search index segment " + path);
+    }
+    void* mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED)
+      throw ioError("failed to map", path);
+    segment->data = static_cast<const char*>(mapped);
+    segment->size = st.st_size;
+    const char* data = segment->data;
+    size_t size = segment->size;
+    if (std::memcmp(data, MAGIC, 4) != 0 ||
+        get<uint32_t>(data + 4) != FORMAT_VERSION ||
+        crc32(data, size - 4) != get<uint32_t>(data + size - 4))
+      throw std::runtime_error("corrupt search index segment " + path);
+
+    uint32_t count = get<uint32_t>(data + 8);
+    segment->newest = get<int32_t>(data + 12);
+    const char* in_ = data + get<uint64_t>(data + 16);
+    const char* end = data + size - 4;
+    segment->terms.reserve(count);
+    for (uint32_t i = 0; i < count; i++) {
+      if (in_ + 2 > end)
+        throw std::runtime_error("corrupt search index segment " + path);
+      uint16_t length = get<uint16_t>(in_);
+      if (in_ + 2 + length + 16 > end)
+        throw std::runtime_error("corrupt search index segment " + path);
+      Term t;
+      t.text.assign(in_ + 2, length);
+      in_ += 2 + length;
+      t.count = get<uint32_t>(in_);
+      t.offset = get<uint64_t>(in_ + 4);
+      t.bytes = get<uint32_t>(in_ + 12);
+      in_ += 16;
+      segment->terms.push_back(std::move(t));
+    }
+    return segment;
+  }
+
+  /* writes postings to path through a temp file, replacing nothing on failure */
+  static std::shared_ptr<const Segment> write(const std::string& path, const Postings& postings) {
+    std::vector<const std::string*> keys;
+    keys.reserve(postings.size());
+    for (const auto& p : postings)
+      keys.push_back(&p.first);
+    std::sort(keys.begin(), keys.end(),
+      [](const std::string* a, const std::string* b) { return *a < *b; });
+
+    std::string data(HEADER_SIZE, '\0');
+    std::string dictionary;
+    int newest = 0;
+    std::vector<SearchHit> hits;
+    for (const std::string* key : keys) {
+      hits = postings.at(*key);
+      sortHits(hits);
+      if (hits.empty())
+        continue;
+      newest = std::max(newest, hits.front().date);
+      uint64_t offset = data.size();
+      encodePostings(data, hits);
+      put<uint16_t>(dictionary, static_cast<uint16_t>(key->size()));
+      dictionary.append(*key);
+      put<uint32_t>(dictionary, static_cast<uint32_t>(hits.size()));
+      put<uint64_t>(dictionary, offset);
+      put<uint32_t>(dictionary, static_cast<uint32_t>(data.size() - offset));
+    }
+    uint64_t dictionaryOffset = data.size();
+    data.append(dictionary);
+    std::memcpy(&data[0], MAGIC, 4);
+    uint32_t version = FORMAT_VERSION;
+    uint32_t count = static_cast<uint32_t>(keys.size());
+    int32_t date = newest;
+    std::memcpy(&data[4], &version, 4);
+    std::memcpy(&data[8], &count, 4);
+    std::memcpy(&data[12], &date, 4);
+    std::memcpy(&data[16], &dictionaryOffset, 8);
+    put<uint32_t>(data, crc32(data.data(), data.size()));
+
+    std::string tmp = path + ".tmp";
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+      throw ioError("failed to create", tmp);
+    size_t written = 0;
+    while (written < data.size()) {
+      ssize_t n = ::write(fd, data.data() + written, data.size() - written);
+      if (n < 0) {
+        close(fd);
+        throw ioError("failed to write", tmp);
+      }
+      written += n;
+    }
+    if (fdatasync(fd) != 0) {
+      close(fd);
+      throw ioError("failed to sync", tmp);
+    }
+    close(fd);
+    fs::rename(tmp, path);
+    return load(path);
+  }
+};
+
+MessageIndex::MessageIndex(const std::string& directory, const MessageIndexOptions& options) :
+  directory_{directory},
+  options_{options},
+  mutex_{},
+  live_{},
+  livePostings_{0},
+  frozen_{},
+  segments_{},
+  nextSegment_{1},
+  flushMutex_{},
+  flushCondition_{},
+  stopping_{false},
+  thread_{}
+{
+  if (options_.maxSegments < 2)
+    options_.maxSegments = 2;
+  fs::create_directories(directory_);
+  std::vector<std::string> paths;
+  for (const auto& entry : fs::directory_iterator(directory_)) {
+    if (entry.path().extension() == ".tmp") {
+      // a flush or merge that never finished
+      fs::remove(entry.path());
+    } else if (entry.path().extension() == ".seg") {
+      paths.push_back(entry.path().string());
+      nextSegment_ = std::max<uint64_t>(nextSegment_, std::stoull(entry.path().stem().string()) + 1);
+    }
+  }
+  std::sort(paths.begin(), paths.end());
+  for (const std::string& path : paths)
+    segments_.push_back(Segment::load(path));
+  thread_ = std::thread([this]() { run(); });
+}
+
+MessageIndex::~MessageIndex() {
+  {
+    std::lock_guard<std::mutex> lock(flushMutex_);
+    stopping_ = true;
+  }
+  flushCondition_.notify_one();
+  thread_.join();
+  try {
+    flush();
+  } catch (const std::exception& e) {
+    std::cout << "search index flush failed: " << e.what() << std::endl;
+  }
+}
+
+void MessageIndex::tokenize(const std::string& text, std::vector<std::string>& terms) {
+  // ascii letters & digits are lower cased, any other ascii splits words,
+  // utf-8 sequences are kept as part of the word
+  std::string term;
+  auto finish = [&]() {
+    if (term.size() >= 2)
+      terms.push_back(term.substr(0, MAX_TERM));
+    term.clear();
+  };
+  for (char c : text) {
+    unsigned char u = static_cast<unsigned char>(c);
+    if (u >= 0x80 || std::isalnum(u))
+      term.push_back(static_cast<char>(std::tolower(u)));
+    else
+      finish();
+  }
+  finish();
+}
+
+void MessageIndex::add(const std::vector<MessageRow>& rows) {
+  std::vector<std::string> terms;
+  bool full;
+  {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    for (const MessageRow& row : rows) {
+      if (row.id == 0)
+        continue;
+      terms.clear();
+      tokenize(row.text, terms);
+      std::sort(terms.begin(), terms.end());
+      terms.erase(std::unique(terms.begin(), terms.end()), terms.end());
+      for (const std::string& term : terms)
+        live_[term].push_back(SearchHit{row.date, row.channel, row.id});
+      livePostings_ += terms.size();
+    }
+    full = livePostings_ >= options_.flushPostings;
+  }
+  if (full)
+    flushCondition_.notify_one();
+}
+
+void MessageIndex::search(const SearchQuery& query, std::vector<SearchHit>& out) const {
+  std::vector<std::string> terms;
+  tokenize(query.text, terms);
+  std::sort(terms.begin(), terms.end());
+  terms.erase(std::unique(terms.begin(), terms.end()), terms.end());
+  if (terms.empty() || query.limit <= 0)
+    return;
+  SearchQuery scoped = query;
+  std::sort(scoped.channels.begin(), scoped.channels.end());
+
+  // the in memory postings are copied under the lock, segments are kept
+  // alive by their pointers & walked unlocked
+  std::vector<TermCursor> cursors(terms.size(), TermCursor(scoped));
+  std::vector<std::shared_ptr<const Segment>> segments;
+  {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    segments = segments_;
+    for (size_t i = 0; i < terms.size(); i++) {
+      auto it = live_.find(terms[i]);
+      if (it != live_.end())
+        cursors[i].addMemory(it->second);
+      if (frozen_) {
+        it = frozen_->find(terms[i]);
+        if (it != frozen_->end())
+          cursors[i].addMemory(it->second);
+      }
+    }
+  }
+  for (size_t i = 0; i < terms.size(); i++) {
+    for (const auto& segment : segments) {
+      if (const Segment::Term* t = segment->find(terms[i]))
+        cursors[i].addSegment(segment->walk(*t));
+    }
+    // one term without hits empties the whole result
+    if (!cursors[i].start())
+      return;
+  }
+
+  // every cursor walks newest first, the oldest of their hits is the newest
+  // one all terms can still share. stops as soon as the page is full
+  size_t found = 0;
+  while (found < static_cast<size_t>(query.limit)) {
+    SearchHit target = cursors[0].current();
+    for (const TermCursor& cursor : cursors) {
+      if (target < cursor.current())
+        target = cursor.current();
+    }
+    bool match = true;
+    for (TermCursor& cursor : cursors) {
+      while (cursor.current() < target) {
+        if (!cursor.advance())
+          return;
+      }
+      if (!(cursor.current() == target))
+        match = false;
+    }
+    if (!match)
+      continue;
+    out.push_back(target);
+    ++found;
+    for (TermCursor& cursor : cursors) {
+      if (!cursor.advance())
+        return;
+    }
+  }
+}
+
+void MessageIndex::flush() {
+  std::lock_guard<std::mutex> lock(flushMutex_);
+  flushLocked();
+  merge();
+}
+
+int MessageIndex::persistedThrough() const {
+  std::shared_lock<std::shared_mutex> lock(mutex_);
+  int newest = 0;
+  for (const auto& segment : segments_)
+    newest = std::max(newest, segment->newest);
+  return newest;
+}
+
+void MessageIndex::run() {
+  std::unique_lock<std::mutex> lock(flushMutex_);
+  while (!stopping_) {
+    // add() notifies without this lock, the timeout covers a missed wakeup
+    flushCondition_.wait_for(lock, std::chrono::seconds(1));
+    if (stopping_)
+      break;
+    bool full;
+    {
+      std::shared_lock<std::shared_mutex> read(mutex_);
+      full = livePostings_ >= options_.flushPostings;
+    }
+    if (!full)
+      continue;
+    try {
+      flushLocked();
+      merge();
+    } catch (const std::exception& e) {
+      std::cout << "search index flush failed: " << e.what() << std::endl;
+    }
+  }
+}
+
+void MessageIndex::flushLocked() {
+  std::shared_ptr<const Postings> frozen;
+  {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    if (live_.empty())
+      return;
+    frozen_ = std::make_shared<const Postings>(std::move(live_));
+    live_.clear();
+    livePostings_ = 0;
+    frozen = frozen_;
+  }
+  // searches keep seeing frozen_ while the segment is written
+  std::shared_ptr<const Segment> segment;
+  try {
+    segment = Segment::write(nextPath(), *frozen);
+  } catch (...) {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    for (const auto& p : *frozen) {
+      std::vector<SearchHit>& hits = live_[p.first];
+      hits.insert(hits.end(), p.second.begin(), p.second.end());
+      livePostings_ += p.second.size();
+    }
+    frozen_.reset();
+    throw;
+  }
+  std::unique_lock<std::shared_mutex> lock(mutex_);
+  segments_.push_back(segment);
+  frozen_.reset();
+}
+
+void MessageIndex::merge() {
+  std::vector<std::shared_ptr<const Segment>> segments;
+  {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    segments = segments_;
+  }
+  if (segments.size() <= options_.maxSegments)
+    return;
+  // merge the smallest ones, big segments are rewritten rarely
+  std::sort(segments.begin(), segments.end(),
+    [](const std::shared_ptr<const Segment>& a, const std::shared_ptr<const Segment>& b) {
+      return a->size < b->size;
+    });
+  segments.resize(options_.maxSegments / 2 + 1);
+
+  Postings merged;
+  for (const auto& segment : segments) {
+    for (const Segment::Term& t : segment->terms) {
+      std::vector<SearchHit>& hits = merged[t.text];
+      PostingWalk walk = segment->walk(t);
+      while (walk.next())
+        hits.push_back(walk.hit);
+    }
+  }
+  std::shared_ptr<const Segment> replacement = Segment::write(nextPath(), merged);
+
+  {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    segments_.erase(std::remove_if(segments_.begin(), segments_.end(),
+      [&segments](const std::shared_ptr<const Segment>& s) {
+        return std::find(segments.begin(), segments.end(), s) != segments.end();
+      }), segments_.end());
+    segments_.push_back(replacement);
+  }
+  // searches still walking them keep the mappings, unlinking is safe
+  for (const auto& segment : segments)
+    fs::remove(segment->path);
+}
+
+std::string MessageIndex::nextPath() {
+  char name[32];
+  std::snprintf(name, sizeof(name), "%012llu.seg", static_cast<unsigned long long>(nextSegment_++));
+  return directory_ + "/" + name;
+}
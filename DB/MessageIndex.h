@@ -0,0 +1,127 @@
+/*
+This file is part of Wrongthink.
+
+Wrongthink - Modern, open & performant chat protocol. Based on gRPC.
+Copyright (C) 2020 Ophiuchus2
+
+This program is free software: you can redistribute it and/or modify it under the
+terms of the GNU Affero General Public License as published by the Free Software Foundation,
+either version 3 of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License along with this program.
+If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef DB_MESSAGE_INDEX_H
+#define DB_MESSAGE_INDEX_H
+
+#include <mutex>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <shared_mutex>
+#include <unordered_map>
+#include <condition_variable>
+
+#include "MessageStore.h"
+
+struct MessageIndexOptions {
+  // live postings are written out as a segment past this many
+  size_t flushPostings = 65536;
+  // segments are merged into one once there are more than this
+  size_t maxSegments = 8;
+};
+
+/* a message matching a search, ordered by recency */
+struct SearchHit {
+  int date = 0;
+  int channel = 0;
+  int id = 0;
+
+  bool operator==(const SearchHit& o) const {
+    return date == o.date && channel == o.channel && id == o.id;
+  }
+  /* newer first */
+  bool operator<(const SearchHit& o) const {
+    if (date != o.date)
+      return date > o.date;
+    if (channel != o.channel)
+      return channel > o.channel;
+    return id > o.id;
+  }
+};
+
+struct SearchQuery {
+  // every term has to match
+  std::string text;
+  // channels to search, empty searches all of them
+  std::vector<int> channels;
+  int limit = 50;
+  // only hits older than this, the last hit of the previous page. a zero
+  // date starts at the newest message
+  SearchHit after;
+};
+
+/*
+ * Inverted index over message text. Committed messages are added to an in
+ * memory map of posting lists, a background thread writes it out as an
+ * immutable segment once it holds flushPostings & merges segments when
+ * there are too many. Segment files hold a sorted term dictionary followed
+ * by varint, delta encoded posting lists, newest first. They are mapped
+ * into memory & searches decode them lazily, stopping once the page is full.
+ *
+ * Postings added since the last flush are lost on a crash, they can be
+ * added again from history newer than persistedThrough(). Duplicates are
+ * dropped at search & merge time.
+ */
+class MessageIndex {
+public:
+  explicit MessageIndex(const std::string& directory,
+                        const MessageIndexOptions& options = MessageIndexOptions{});
+  /* flushes the live postings */
+  ~MessageIndex();
+
+  /* indexes committed rows, rows without an id are skipped */
+  void add(const std::vector<MessageRow>& rows);
+  /* appends up to query.limit hits to out, newest first */
+  void search(const SearchQuery& query, std::vector<SearchHit>& out) const;
+  /* writes the live postings out as a segment */
+  void flush();
+  /* newest date written to a segment */
+  int persistedThrough() const;
+
+  /* lower cased words, the same for indexing & queries */
+  static void tokenize(const std::string& text, std::vector<std::string>& terms);
+
+private:
+  struct Segment;
+  using Postings = std::unordered_map<std::string, std::vector<SearchHit>>;
+
+  void run();
+  void flushLocked();
+  void merge();
+  std::string nextPath();
+
+  std::string directory_;
+  MessageIndexOptions options_;
+  // guards live_, frozen_ & segments_, searches share it
+  mutable std::shared_mutex mutex_;
+  Postings live_;
+  size_t livePostings_;
+  // postings being written out, still searched until their segment is in
+  std::shared_ptr<const Postings> frozen_;
+  std::vector<std::shared_ptr<const Segment>> segments_;
+  uint64_t nextSegment_;
+  // serializes flushes & merges, wakes the background thread
+  std::mutex flushMutex_;
+  std::condition_variable flushCondition_;
+  bool stopping_;
+  std::thread thread_;
+};
+
+#endif // DB_MESSAGE_INDEX_H
@@ -0,0 +1,193 @@
+/*
+This file is part of Wrongthink.
+
+Wrongthink - Modern, open & performant chat protocol. Based on gRPC.
+Copyright (C) 2020 Ophiuchus2
+
+This program is free software: you can redistribute it and/or modify it under the
+terms of the GNU Affero General Public License as published by the Free Software Foundation,
+either version 3 of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License along with this program.
+If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "MessagePartitions.h"
+
+#include <ctime>
+#include <cstdio>
+#include <iostream>
+#include <limits>
+
+namespace {
+
+// first second of the month holding t, months months later, utc
+std::time_t monthStart(std::time_t t, int months = 0) {
+  std::tm tm;
+  gmtime_r(&t, &tm);
+  int month = tm.tm_mon + months;
+  std::tm start{};
+  start.tm_year = tm.tm_year + month / 12 - (month % 12 < 0 ? 1 : 0);
+  start.tm_mon = ((month % 12) + 12) % 12;
+  start.tm_mday = 1;
+  return timegm(&start);
+}
+
+std::string partitionName(std::time_t start) {
+  std::tm tm;
+  gmtime_r(&start, &tm);
+  char name[32];
+  std::snprintf(name, sizeof(name), "message_p%04d%02d", tm.tm_year + 1900, tm.tm_mon + 1);
+  return name;
+}
+
+/* upper bound of a partition, parsed from "FOR VALUES FROM (..) TO (x)" */
+long long upperBound(const std::string& bound) {
+  size_t to = bound.rfind("TO (");
+  if (to == std::string::npos)
+    return std::numeric_limits<long long>::max();
+  std::string value = bound.substr(to + 4);
+  if (value.compare(0, 8, "MAXVALUE") == 0)
+    return std::numeric_limits<long long>::max();
+  return std::stoll(value);
+}
+
+}
+
+MessagePartitions::MessagePartitions(DBInterface& db, const DBPartitionOptions& options) :
+  db_{db},
+  options_{options},
+  mutex_{},
+  stopCondition_{},
+  stopping_{false},
+  thread_{}
+{
+}
+
+MessagePartitions::~MessagePartitions() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  stopCondition_.notify_one();
+  if (thread_.joinable())
+    thread_.join();
+}
+
+void MessagePartitions::convert() {
+  DBSession sql = db_.getWriterSession();
+  std::string kind;
+  sql << "select relkind from pg_class where relname = 'message' and relkind in ('r', 'p')",
+      into(kind);
+  if (!sql.got_data() || kind == "p")
+    return;
+
+  soci::transaction tr(sql);
+  std::string sequence;
+  sql << "select pg_get_serial_sequence('message', 'msg_id')", into(sequence);
+  sql << "alter table message rename to message_legacy";
+  sql << "alter table message_legacy rename constraint message_pkey to message_legacy_pkey";
+  sql << "alter index if exists message_channel_id_idx rename to message_legacy_channel_id_idx";
+  sql << "alter index if exists message_channel_date_idx rename to message_legacy_channel_date_idx";
+
+  // the partition key has to be part of the primary key
+  sql << "create table message ("
+         "msg_id         int not null default nextval('" << sequence << "'),"
+         "user_id          int references users,"
+         "channel        int references channels,"
+         "thread_id      int,"
+         "thread_child   boolean not null default false,"
+         "edited         boolean default false,"
+         "mtext          text not null,"
+         "mdate          int not null default cast(extract(epoch from clock_timestamp()) as int),"
+         "primary key (msg_id, mdate)) partition by range (mdate)";
+  sql << "alter sequence " << sequence << " owned by message.msg_id";
+  sql << "create index message_channel_id_idx on message (channel, msg_id)";
+  sql << "create index message_channel_date_idx on message (channel, mdate, msg_id)";
+  // catches dates no monthly partition covers, e.g. a skewed clock
+  sql << "create table message_default partition of message default";
+
+  int count = 0, newest = 0;
+  sql << "select count(*), coalesce(max(mdate), 0) from message_legacy", into(count), into(newest);
+  if (count == 0) {
+    sql << "drop table message_legacy";
+  } else {
+    // existing rows stay where they are, monthly partitions start after them
+    long long upper = monthStart(newest, 1);
+    sql << "alter table message attach partition message_legacy for values from (minvalue) to ("
+        << upper << ")";
+  }
+  tr.commit();
+}
+
+void MessagePartitions::maintain() {
+  DBSession sql = db_.getWriterSession();
+  createUpcoming(sql);
+  dropExpired(sql);
+}
+
+void MessagePartitions::start() {
+  thread_ = std::thread([this]() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stopCondition_.wait_for(lock, options_.maintenanceInterval, [this]() { return stopping_; })) {
+      lock.unlock();
+      try {
+        maintain();
+      } catch (const std::exception& e) {
+        std::cout << "message partition maintenance failed: " << e.what() << std::endl;
+      }
+      lock.lock();
+    }
+  });
+}
+
+void MessagePartitions::createUpcoming(soci::session& sql) {
+  // months already covered by the legacy partition must not get another one
+  long long covered = std::numeric_limits<long long>::min();
+  std::string bound;
+  sql << "select pg_get_expr(c.relpartbound, c.oid) from pg_class c "
+      << "where c.relname = 'message_legacy'", into(bound);
+  if (sql.got_data())
+    covered = upperBound(bound);
+
+  std::time_t now = std::time(nullptr);
+  for (int month = 0; month <= options_.monthsAhead; month++) {
+    std::time_t start = monthStart(now, month);
+    std::time_t end = monthStart(now, month + 1);
+    if (end <= covered)
+      continue;
+    long long from = std::max<long long>(start, covered);
+    sql << "create table if not exists " << partitionName(start)
+        << " partition of message for values from (" << from << ") to (" << end << ")";
+  }
+}
+
+void MessagePartitions::dropExpired(soci::session& sql) {
+  // a partition can only go once the community keeping history longest is done with it
+  int keepForever = 0, longest = 0;
+  sql << "select count(*) from communities where coalesce(retention_days, :global) <= 0",
+      use(options_.retentionDays), into(keepForever);
+  if (keepForever > 0)
+    return;
+  sql << "select coalesce(max(coalesce(retention_days, :global)), 0) from communities",
+      use(options_.retentionDays), into(longest);
+  if (longest <= 0)
+    return;
+  long long cutoff = static_cast<long long>(std::time(nullptr)) - longest * 86400ll;
+
+  rowset<row> partitions = (sql.prepare <<
+    "select c.relname, pg_get_expr(c.relpartbound, c.oid) from pg_inherits i "
+    "inner join pg_class c on c.oid = i.inhrelid "
+    "inner join pg_class p on p.oid = i.inhparent "
+    "where p.relname = 'message' and c.relname <> 'message_default'");
+  std::vector<std::string> expired;
+  for (rowset<row>::const_iterator it = partitions.begin(); it != partitions.end(); ++it) {
+    if (upperBound(it->get<std::string>(1)) <= cutoff)
+      expired.push_back(it->get<std::string>(0));
+  }
+  for (const std::string& name : expired)
+    sql << "drop table if exists " << name;
+}
@@ -0,0 +1,71 @@
+/*
+This file is part of Wrongthink.
+
+Wrongthink - Modern, open & performant chat protocol. Based on gRPC.
+Copyright (C) 2020 Ophiuchus2
+
+This program is free software: you can redistribute it and/or modify it under the
+terms of the GNU Affero General Public License as published by the Free Software Foundation,
+either version 3 of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License along with this program.
+If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef DB_MESSAGE_PARTITIONS_H
+#define DB_MESSAGE_PARTITIONS_H
+
+#include <mutex>
+#include <chrono>
+#include <thread>
+#include <string>
+#include <condition_variable>
+
+#include "DBInterface.h"
+
+struct DBPartitionOptions {
+  // range partition the message table by month of mdate, postgres only
+  bool enabled = false;
+  // upcoming months that always have a partition ready
+  int monthsAhead = 2;
+  // history older than this is hidden & dropped with its partition, 0 keeps
+  // everything. communities.retention_days overrides it per community
+  int retentionDays = 0;
+  std::chrono::minutes maintenanceInterval{60};
+};
+
+/*
+ * Keeps a monthly range partitioned message table in shape: converts a plain
+ * table on first use (existing rows stay put as the message_legacy
+ * partition), creates upcoming partitions ahead of time & drops partitions
+ * once every community's retention has passed them, so expiring history
+ * never needs a DELETE.
+ */
+class MessagePartitions {
+public:
+  MessagePartitions(DBInterface& db, const DBPartitionOptions& options);
+  ~MessagePartitions();
+
+  /* turns message into a partitioned table if it isn't one yet */
+  void convert();
+  /* creates upcoming partitions & drops expired ones */
+  void maintain();
+  /* runs maintain() every maintenanceInterval until destroyed */
+  void start();
+
+private:
+  void createUpcoming(soci::session& sql);
+  void dropExpired(soci::session& sql);
+
+  DBInterface& db_;
+  DBPartitionOptions options_;
+  std::mutex mutex_;
+  std::condition_variable stopCondition_;
+  bool stopping_;
+  std::thread thread_;
+};
+
+#endif // DB_MESSAGE_PARTITIONS_H
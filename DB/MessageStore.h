@@ -0,0 +1,63 @@
+/*
+This file is part of Wrongthink.
+
+Wrongthink - Modern, open & performant chat protocol. Based on gRPC.
+Copyright (C) 2020 Ophiuchus2
+
+This program is free software: you can redistribute it and/or modify it under the
+terms of the GNU Affero General Public License as published by the Free Software Foundation,
+either version 3 of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License along with this program.
+If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef DB_MESSAGE_STORE_H
+#define DB_MESSAGE_STORE_H
+
+#include <string>
+#include <vector>
+
+/* one message as handed to bulk inserts & read back from history */
+struct MessageRow {
+  int userId;
+  int channel;
+  int threadId;
+  bool threadChild;
+  std::string text;
+  int date;
+  // msg_id, set once the row has been stored
+  int id = 0;
+};
+
+/* one keyset page of a channel's history, rows always come back oldest first */
+struct MessagePage {
+  enum class Anchor {
+    NEWEST,     // the latest limit messages
+    BEFORE_ID,  // the limit messages preceding msg_id key
+    AFTER_ID,   // the limit messages following msg_id key
+    AFTER_DATE  // the limit messages dated after key
+  };
+  Anchor anchor = Anchor::NEWEST;
+  int key = 0;
+  int limit = 100;
+};
+
+/*
+ * Storage engine for message history that replaces the sql message table
+ * when set on a DBInterface. Users, communities & channels stay in sql.
+ */
+class MessageStore {
+public:
+  virtual ~MessageStore() {}
+
+  /* durably appends rows & sets their ids, called from the message writer.
+     throws if any row failed, those are left with an id of 0 */
+  virtual void append(std::vector<MessageRow>& rows) = 0;
+  virtual void readPage(int channel, const MessagePage& page, std::vector<MessageRow>& out) = 0;
+};
+
+#endif // DB_MESSAGE_STORE_H
@@ -0,0 +1,245 @@
+/*
+This file is part of Wrongthink.
+
+Wrongthink - Modern, open & performant chat protocol. Based on gRPC.
+Copyright (C) 2020 Ophiuchus2
+
+This program is free software: you can redistribute it and/or modify it under the
+terms of the GNU Affero General Public License as published by the Free Software Foundation,
+either version 3 of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License along with this program.
+If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "MessageWriter.h"
+#include <algorithm>
+#include <iterator>
+
+namespace {
+
+MessageRow toRow(const WrongthinkMessage& msg) {
+  return MessageRow{ msg.userid(), msg.channelid(), msg.threadid(), msg.threadchild(),
+                     msg.text(), msg.date() };
+}
+
+MessageRow toRow(WrongthinkMessage&& msg) {
+  MessageRow r{ msg.userid(), msg.channelid(), msg.threadid(), msg.threadchild(),
+                std::string(), msg.date() };
+  r.text.swap(*msg.mutable_text());
+  return r;
+}
+
+}
+
+MessageWriter::MessageWriter(std::shared_ptr<DBInterface> db,
+                             std::shared_ptr<spdlog::logger> logger,
+                             const MessageWriterOptions& options,
+                             CommitListener onCommit) :
+  db_{db},
+  logger_{logger},
+  options_{options},
+  onCommit_{onCommit},
+  mutex_{},
+  queuedCondition_{},
+  committedCondition_{},
+  roomCondition_{},
+  queue_{},
+  enqueued_{0},
+  committed_{0},
+  channelTickets_{},
+  failed_{0},
+  rejected_{0},
+  stopping_{false},
+  thread_{}
+{
+  if (options_.maxBatch == 0)
+    options_.maxBatch = 1;
+  thread_ = std::thread(&MessageWriter::run, this);
+}
+
+MessageWriter::~MessageWriter() {
+  stop();
+}
+
+bool MessageWriter::enqueue(const WrongthinkMessage& msg) {
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!waitForRoom(lock, 1))
+      return false;
+    queue_.push_back(toRow(msg));
+    channelTickets_[msg.channelid()] = ++enqueued_;
+  }
+  queuedCondition_.notify_one();
+  return true;
+}
+
+bool MessageWriter::enqueue(std::vector<WrongthinkMessage>&& msgs) {
+  if (msgs.empty())
+    return true;
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!waitForRoom(lock, msgs.size()))
+      return false;
+    for (WrongthinkMessage& msg : msgs) {
+      channelTickets_[msg.channelid()] = ++enqueued_;
+      queue_.push_back(toRow(std::move(msg)));
+    }
+  }
+  queuedCondition_.notify_one();
+  return true;
+}
+
+bool MessageWriter::waitForRoom(std::unique_lock<std::mutex>& lock, size_t count) {
+  // an empty queue takes any batch, so one larger than maxQueued isn't stuck
+  bool room = roomCondition_.wait_for(lock, options_.enqueueTimeout, [this, count]() {
+    return stopping_ || queue_.empty() || queue_.size() + count <= options_.maxQueued;
+  });
+  if (!room || stopping_) {
+    rejected_ += count;
+    return false;
+  }
+  return true;
+}
+
+void MessageWriter::flushChannel(int channelid) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  auto it = channelTickets_.find(channelid);
+  if (it == channelTickets_.end())
+    return;
+  uint64_t ticket = it->second;
+  committedCondition_.wait(lock, [this, ticket]() { return committed_ >= ticket; });
+}
+
+void MessageWriter::flush() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  uint64_t ticket = enqueued_;
+  committedCondition_.wait(lock, [this, ticket]() { return committed_ >= ticket; });
+}
+
+void MessageWriter::stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (stopping_)
+      return;
+    stopping_ = true;
+  }
+  queuedCondition_.notify_one();
+  roomCondition_.notify_all();
+  if (thread_.joinable())
+    thread_.join();
+}
+
+MessageWriter::Stats MessageWriter::stats() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Stats stats;
+  stats.queued = queue_.size();
+  stats.committed = committed_ - failed_;
+  stats.failed = failed_;
+  stats.rejected = rejected_;
+  return stats;
+}
+
+void MessageWriter::run() {
+  std::vector<MessageRow> batch;
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    queuedCondition_.wait(lock, [this]() { return !queue_.empty() || stopping_; });
+    if (queue_.empty())
+      break;
+    // give a partial batch a moment to fill up
+    if (queue_.size() < options_.maxBatch && !stopping_)
+      queuedCondition_.wait_for(lock, options_.maxDelay, [this]() {
+        return queue_.size() >= options_.maxBatch || stopping_;
+      });
+    size_t count = std::min(queue_.size(), options_.maxBatch);
+    batch.assign(std::make_move_iterator(queue_.begin()),
+                 std::make_move_iterator(queue_.begin() + count));
+    queue_.erase(queue_.begin(), queue_.begin() + count);
+    lock.unlock();
+    roomCondition_.notify_all();
+
+    // the batch stays out of the queue while it is retried, so its senders
+    // keep their order & new rows wait behind it
+    size_t persisted = commit(batch);
+    for (int attempt = 0; persisted == 0 && attempt < options_.maxRetries; attempt++) {
+      std::this_thread::sleep_for(options_.retryDelay);
+      persisted = commit(batch);
+    }
+    if (persisted < batch.size())
+      logger_->error("failed to persist {} of {} messages", batch.size() - persisted, batch.size());
+    // history readers of these channels stick to the primary for a while
+    int lastChannel = 0;
+    for (const MessageRow& r : batch) {
+      if (r.channel != lastChannel)
+        db_->noteWrite("channel:" + std::to_string(r.channel));
+      lastChannel = r.channel;
+    }
+    if (onCommit_) {
+      try {
+        onCommit_(batch);
+      } catch (const std::exception& e) {
+        logger_->error("commit listener failed: {}", e.what());
+      }
+    }
+
+    lock.lock();
+    committed_ += count;
+    failed_ += batch.size() - persisted;
+    for (auto it = channelTickets_.begin(); it != channelTickets_.end();) {
+      if (it->second <= committed_)
+        it = channelTickets_.erase(it);
+      else
+        ++it;
+    }
+    committedCondition_.notify_all();
+  }
+}
+
+size_t MessageWriter::commit(std::vector<MessageRow>& batch) {
+  if (MessageStore* store = db_->messageStore()) {
+    try {
+      store->append(batch);
+      return batch.size();
+    } catch (const std::exception& e) {
+      logger_->error("failed to persist messages: {}", e.what());
+    }
+    return 0;
+  }
+  size_t persisted = 0;
+  try {
+    DBSession sql = db_->getWriterSession();
+    try {
+      soci::transaction tr(sql);
+      db_->insertMessages(sql, batch);
+      tr.commit();
+      return batch.size();
+    } catch (const std::exception& e) {
+      logger_->warn("batch insert of {} messages failed, retrying row by row: {}",
+                    batch.size(), e.what());
+    }
+    // isolate the bad rows so one of them can't take the whole batch down
+    for (MessageRow& r : batch) {
+      r.id = 0;
+      try {
+        std::vector<MessageRow> single{r};
+        soci::transaction tr(sql);
+        db_->insertMessages(sql, single);
+        tr.commit();
+        r.id = single[0].id;
+        persisted++;
+      } catch (const std::exception& e) {
+        logger_->error("failed to persist message for channel {} from user {}: {}",
+                       r.channel, r.userId, e.what());
+      }
+    }
+  } catch (const std::exception& e) {
+    logger_->error("failed to persist {} messages: {}", batch.size(), e.what());
+    for (MessageRow& r : batch)
+      r.id = 0;
+  }
+  return persisted;
+}
@@ -0,0 +1,122 @@
+/*
+This file is part of Wrongthink.
+
+Wrongthink - Modern, open & performant chat protocol. Based on gRPC.
+Copyright (C) 2020 Ophiuchus2
+
+This program is free software: you can redistribute it and/or modify it under the
+terms of the GNU Affero General Public License as published by the Free Software Foundation,
+either version 3 of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License along with this program.
+If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef DB_MESSAGE_WRITER_H
+#define DB_MESSAGE_WRITER_H
+
+#include <mutex>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <functional>
+#include <vector>
+#include <cstdint>
+#include <unordered_map>
+#include <condition_variable>
+
+#include "spdlog/spdlog.h"
+#include "wrongthink.grpc.pb.h"
+#include "DBInterface.h"
+
+struct MessageWriterOptions {
+  // rows committed per transaction at most
+  size_t maxBatch = 512;
+  // how long a partial batch waits for more rows before committing
+  std::chrono::milliseconds maxDelay{5};
+  // rows waiting to be committed at most, enqueue() waits up to
+  // enqueueTimeout for room & then refuses the rows
+  size_t maxQueued = 65536;
+  std::chrono::milliseconds enqueueTimeout{1000};
+  // a batch the database took none of is retried this many times, e.g.
+  // while it restarts. rows still failing after that are counted as failed
+  int maxRetries = 10;
+  std::chrono::milliseconds retryDelay{500};
+};
+
+/*
+ * Write-behind persistence for chat messages. Send rpcs fan a message out &
+ * enqueue it here, a dedicated thread gathers queued rows across channels &
+ * commits them in one transaction per batch, so commit latency is amortized
+ * over the batch & never paid on the rpc thread. Rows go through
+ * DBInterface::insertMessages, COPY on postgres. Destroying the writer
+ * drains & commits everything still queued.
+ *
+ * The queue is bounded: when the database falls behind or is down, enqueue()
+ * blocks for a while & then refuses, so senders see the backpressure instead
+ * of the server buffering without limit.
+ */
+class MessageWriter {
+public:
+  /* sees every committed batch before flushes waiting on it return, rows
+     that failed to persist have an id of 0 */
+  using CommitListener = std::function<void(const std::vector<MessageRow>&)>;
+
+  struct Stats {
+    size_t queued = 0;
+    uint64_t committed = 0;
+    // rows that couldn't be persisted, even after retrying
+    uint64_t failed = 0;
+    // rows refused by enqueue()
+    uint64_t rejected = 0;
+  };
+
+  MessageWriter(std::shared_ptr<DBInterface> db, std::shared_ptr<spdlog::logger> logger,
+                const MessageWriterOptions& options = MessageWriterOptions{},
+                CommitListener onCommit = nullptr);
+  ~MessageWriter();
+
+  /* false if the writer is stopped or stayed full for enqueueTimeout, the
+     rows are then not queued */
+  bool enqueue(const WrongthinkMessage& msg);
+  bool enqueue(std::vector<WrongthinkMessage>&& msgs);
+  /* blocks until every message enqueued for channelid so far is committed */
+  void flushChannel(int channelid);
+  /* blocks until every message enqueued so far is committed */
+  void flush();
+  /* commits everything queued & stops the writer thread, later enqueue()
+     calls are refused */
+  void stop();
+  Stats stats();
+
+private:
+  void run();
+  /* waits for room for count more rows, false if the rows must be refused */
+  bool waitForRoom(std::unique_lock<std::mutex>& lock, size_t count);
+  /* returns how many rows were persisted, their ids are set */
+  size_t commit(std::vector<MessageRow>& batch);
+
+  std::shared_ptr<DBInterface> db_;
+  std::shared_ptr<spdlog::logger> logger_;
+  MessageWriterOptions options_;
+  CommitListener onCommit_;
+  std::mutex mutex_;
+  std::condition_variable queuedCondition_;
+  std::condition_variable committedCondition_;
+  std::condition_variable roomCondition_;
+  std::vector<MessageRow> queue_;
+  // every message gets a ticket, commits happen in ticket order
+  uint64_t enqueued_;
+  uint64_t committed_;
+  // last ticket handed out per channel with uncommitted messages
+  std::unordered_map<int, uint64_t> channelTickets_;
+  uint64_t failed_;
+  uint64_t rejected_;
+  bool stopping_;
+  std::thread thread_;
+};
+
+#endif // DB_MESSAGE_WRITER_H
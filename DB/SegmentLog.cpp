@@ -0,0 +1,488 @@
+/*
+This file is part of Wrongthink.
+
+Wrongthink - Modern, open & performant chat protocol. Based on gRPC.
+Copyright (C) 2020 Ophiuchus2
+
+This program is free software: you can redistribute it and/or modify it under the
+terms of the GNU Affero General Public License as published by the Free Software Foundation,
+either version 3 of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License along with this program.
+If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "SegmentLog.h"
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <exception>
+#include <stdexcept>
+#include <system_error>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+/*
+ * record layout, little endian:
+ *   u32 payload length, u32 crc32 of the payload
+ *   payload: i32 id, i32 user_id, i32 thread_id, u8 thread_child, i32 date,
+ *            u32 text length, text
+ * a zero length marks the end of a segment, files are preallocated with zeros
+ */
+constexpr size_t RECORD_HEADER = 8;
+constexpr size_t RECORD_FIXED = 21;
+
+uint32_t crc32(const char* data, size_t size) {
+  static const auto table = []() {
+    std::vector<uint32_t> t(256);
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; k++)
+        c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+      t[i] = c;
+    }
+    return t;
+  }();
+  uint32_t crc = 0xFFFFFFFFu;
+  for (size_t i = 0; i < size; i++)
+    crc = table[(crc ^ static_cast<uint8_t>(data[i])) & 0xFF] ^ (crc >> 8);
+  return crc ^ 0xFFFFFFFFu;
+}
+
+template <typename T>
+void put(std::string& out, T value) {
+  out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template <typename T>
+T get(const char* in) {
+  T value;
+  std::memcpy(&value, in, sizeof(T));
+  return value;
+}
+
+void encode(std::string& out, const MessageRow& row) {
+  size_t start = out.size();
+  out.resize(start + RECORD_HEADER);
+  put<int32_t>(out, row.id);
+  put<int32_t>(out, row.userId);
+  put<int32_t>(out, row.threadId);
+  put<uint8_t>(out, row.threadChild ? 1 : 0);
+  put<int32_t>(out, row.date);
+  put<uint32_t>(out, static_cast<uint32_t>(row.text.size()));
+  out.append(row.text);
+  uint32_t length = static_cast<uint32_t>(out.size() - start - RECORD_HEADER);
+  uint32_t crc = crc32(out.data() + start + RECORD_HEADER, length);
+  std::memcpy(&out[start], &length, sizeof(length));
+  std::memcpy(&out[start + 4], &crc, sizeof(crc));
+}
+
+/* size of the valid record at offset, 0 at the end of the segment or on a torn record */
+size_t recordSize(const char* base, uint64_t offset, uint64_t limit) {
+  if (offset + RECORD_HEADER > limit)
+    return 0;
+  uint32_t length = get<uint32_t>(base + offset);
+  if (length < RECORD_FIXED || offset + RECORD_HEADER + length > limit)
+    return 0;
+  const char* payload = base + offset + RECORD_HEADER;
+  if (get<uint32_t>(payload + 17) != length - RECORD_FIXED)
+    return 0;
+  if (crc32(payload, length) != get<uint32_t>(base + offset + 4))
+    return 0;
+  return RECORD_HEADER + length;
+}
+
+void decode(const char* record, int channel, MessageRow& row) {
+  const char* payload = record + RECORD_HEADER;
+  row.id = get<int32_t>(payload);
+  row.userId = get<int32_t>(payload + 4);
+  row.threadId = get<int32_t>(payload + 8);
+  row.threadChild = get<uint8_t>(payload + 12) != 0;
+  row.date = get<int32_t>(payload + 13);
+  row.channel = channel;
+  row.text.assign(payload + RECORD_FIXED, get<uint32_t>(payload + 17));
+}
+
+std::system_error ioError(const std::string& what, const std::string& path) {
+  return std::system_error(errno, std::generic_category(), what + " " + path);
+}
+
+/* writes data to path & syncs it before returning */
+void writeDurable(const std::string& path, const std::string& data) {
+  int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    throw ioError("failed to create", path);
+  size_t written = 0;
+  while (written < data.size()) {
+    ssize_t n = write(fd, data.data() + written, data.size() - written);
+    if (n < 0) {
+      close(fd);
+      throw ioError("failed to write", path);
+    }
+    written += n;
+  }
+  if (fsync(fd) != 0) {
+    close(fd);
+    throw ioError("failed to sync", path);
+  }
+  close(fd);
+}
+
+/* makes renames & new files in directory durable */
+void syncDirectory(const std::string& directory) {
+  int fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+  if (fd < 0)
+    throw ioError("failed to open", directory);
+  int result = fsync(fd);
+  close(fd);
+  if (result != 0)
+    throw ioError("failed to sync", directory);
+}
+
+}
+
+struct SegmentLog::Segment {
+  int firstId = 0;
+  std::string path;
+  int fd = -1;
+  const char* map = nullptr;
+  uint64_t capacity = 0;
+  // bytes of published records, readers never look past this
+  uint64_t end = 0;
+
+  ~Segment() {
+    if (map)
+      munmap(const_cast<char*>(map), capacity);
+    if (fd >= 0)
+      close(fd);
+  }
+
+  std::string indexPath() const { return path.substr(0, path.size() - 4) + ".idx"; }
+};
+
+SegmentLog::SegmentLog(const std::string& directory, const SegmentLogOptions& options) :
+  directory_{directory},
+  options_{options},
+  channelsMutex_{},
+  channels_{},
+  lru_{}
+{
+  if (options_.indexInterval < 1)
+    options_.indexInterval = 1;
+  fs::create_directories(directory_);
+}
+
+SegmentLog::~SegmentLog() {
+}
+
+std::shared_ptr<SegmentLog::ChannelLog> SegmentLog::openChannel(int channel, bool create) {
+  std::lock_guard<std::mutex> lock(channelsMutex_);
+  auto it = channels_.find(channel);
+  if (it != channels_.end()) {
+    lru_.splice(lru_.begin(), lru_, it->second.lru);
+    return it->second.log;
+  }
+
+  std::string dir = directory_ + "/" + std::to_string(channel);
+  if (!fs::exists(dir)) {
+    if (!create)
+      return nullptr;
+    fs::create_directories(dir);
+  }
+
+  auto log = std::make_shared<ChannelLog>();
+  log->directory = dir;
+  std::vector<int> firstIds;
+  for (const auto& entry : fs::directory_iterator(dir)) {
+    if (entry.path().extension() == ".log")
+      firstIds.push_back(std::stoi(entry.path().stem().string()));
+  }
+  std::sort(firstIds.begin(), firstIds.end());
+  for (size_t i = 0; i < firstIds.size(); i++) {
+    auto segment = std::make_unique<Segment>();
+    segment->firstId = firstIds[i];
+    segment->path = dir + "/" + std::to_string(firstIds[i]) + ".log";
+    log->segments.push_back(std::move(segment));
+    loadSegment(*log, i, i + 1 == firstIds.size());
+  }
+  if (log->segments.empty())
+    rollSegment(*log, 1);
+  // a crash right after a roll leaves an empty active segment, its name
+  // still says where the ids continue
+  log->lastId = std::max(log->lastId, log->segments.back()->firstId - 1);
+
+  lru_.push_front(channel);
+  channels_[channel] = OpenChannel{ log, lru_.begin() };
+  closeIdle();
+  return log;
+}
+
+void SegmentLog::closeIdle() {
+  // references only come from openChannel under channelsMutex_, a channel
+  // nobody else holds stays idle while it is closed. closing one in use
+  // could let a second ChannelLog append to the same files
+  auto it = lru_.end();
+  while (channels_.size() > options_.maxOpenChannels && it != lru_.begin()) {
+    --it;
+    auto open = channels_.find(*it);
+    if (open->second.log.use_count() > 1)
+      continue;
+    channels_.erase(open);
+    it = lru_.erase(it);
+  }
+}
+
+void SegmentLog::loadSegment(ChannelLog& log, size_t index, bool last) {
+  Segment& segment = *log.segments[index];
+  segment.fd = ::open(segment.path.c_str(), O_RDWR);
+  if (segment.fd < 0)
+    throw ioError("failed to open", segment.path);
+  off_t size = lseek(segment.fd, 0, SEEK_END);
+  segment.capacity = std::max<uint64_t>(size, options_.segmentBytes);
+  if (static_cast<uint64_t>(size) < segment.capacity && ftruncate(segment.fd, segment.capacity) != 0)
+    throw ioError("failed to size", segment.path);
+  void* map = mmap(nullptr, segment.capacity, PROT_READ, MAP_SHARED, segment.fd, 0);
+  if (map == MAP_FAILED)
+    throw ioError("failed to map", segment.path);
+  segment.map = static_cast<const char*>(map);
+
+  // sealed segments carry their index in a sidecar, so only the active one is scanned
+  if (!last) {
+    std::ifstream in(segment.indexPath(), std::ios::binary);
+    uint64_t end = 0, count = 0;
+    if (in.read(reinterpret_cast<char*>(&end), sizeof(end)) &&
+        in.read(reinterpret_cast<char*>(&count), sizeof(count)) && end <= segment.capacity) {
+      std::vector<IndexEntry> entries(count);
+      bool ok = true;
+      for (IndexEntry& e : entries) {
+        int32_t id = 0, date = 0;
+        ok = ok && in.read(reinterpret_cast<char*>(&id), sizeof(id)) &&
+                   in.read(reinterpret_cast<char*>(&date), sizeof(date)) &&
+                   in.read(reinterpret_cast<char*>(&e.offset), sizeof(e.offset));
+        e.id = id;
+        e.date = date;
+        e.segment = index;
+      }
+      if (ok && !entries.empty()) {
+        segment.end = end;
+        log.index.insert(log.index.end(), entries.begin(), entries.end());
+        return;
+      }
+    }
+  }
+  scanSegment(log, index, last);
+}
+
+void SegmentLog::scanSegment(ChannelLog& log, size_t index, bool recover) {
+  Segment& segment = *log.segments[index];
+  uint64_t offset = 0;
+  MessageRow row;
+  while (size_t size = recordSize(segment.map, offset, segment.capacity)) {
+    decode(segment.map + offset, 0, row);
+    if (offset == 0 || (row.id - 1) % options_.indexInterval == 0)
+      log.index.push_back({ row.id, row.date, index, offset });
+    log.lastId = row.id;
+    offset += size;
+  }
+  segment.end = offset;
+
+  // anything after the last valid record is a torn write, zero it so the
+  // next append starts from a clean tail
+  if (recover && offset < segment.capacity) {
+    if (ftruncate(segment.fd, offset) != 0 || ftruncate(segment.fd, segment.capacity) != 0 ||
+        fdatasync(segment.fd) != 0)
+      throw ioError("failed to truncate", segment.path);
+  }
+}
+
+SegmentLog::Segment* SegmentLog::rollSegment(ChannelLog& log, int firstId) {
+  if (!log.segments.empty()) {
+    // seal the full segment, writing its slice of the sparse index next to it
+    size_t sealed = log.segments.size() - 1;
+    const Segment& last = *log.segments[sealed];
+    std::string tmp = last.indexPath() + ".tmp";
+    std::string sidecar;
+    uint64_t count = std::count_if(log.index.begin(), log.index.end(),
+      [sealed](const IndexEntry& e) { return e.segment == sealed; });
+    put<uint64_t>(sidecar, last.end);
+    put<uint64_t>(sidecar, count);
+    for (const IndexEntry& e : log.index) {
+      if (e.segment != sealed)
+        continue;
+      put<int32_t>(sidecar, e.id);
+      put<int32_t>(sidecar, e.date);
+      put<uint64_t>(sidecar, e.offset);
+    }
+    // the sidecar is synced before the rename publishes it, a crash never
+    // leaves a renamed but empty index behind
+    writeDurable(tmp, sidecar);
+    fs::rename(tmp, last.indexPath());
+  }
+
+  auto segment = std::make_unique<Segment>();
+  segment->firstId = firstId;
+  segment->path = log.directory + "/" + std::to_string(firstId) + ".log";
+  int fd = ::open(segment->path.c_str(), O_RDWR | O_CREAT, 0644);
+  if (fd < 0)
+    throw ioError("failed to create", segment->path);
+  close(fd);
+  // persists the index rename & the new segment's directory entry
+  syncDirectory(log.directory);
+
+  std::unique_lock<std::shared_mutex> lock(log.mutex);
+  log.segments.push_back(std::move(segment));
+  loadSegment(log, log.segments.size() - 1, true);
+  return log.segments.back().get();
+}
+
+void SegmentLog::commit(ChannelLog& log, Segment& segment, std::string& pending,
+                        std::vector<IndexEntry>& pendingIndex, int lastId) {
+  if (pending.empty())
+    return;
+  size_t written = 0;
+  while (written < pending.size()) {
+    ssize_t n = pwrite(segment.fd, pending.data() + written, pending.size() - written,
+                       segment.end + written);
+    if (n < 0)
+      throw ioError("failed to append to", segment.path);
+    written += n;
+  }
+  // one sync per channel per batch, this is the group commit
+  if (fdatasync(segment.fd) != 0)
+    throw ioError("failed to sync", segment.path);
+
+  std::unique_lock<std::shared_mutex> lock(log.mutex);
+  segment.end += pending.size();
+  log.index.insert(log.index.end(), pendingIndex.begin(), pendingIndex.end());
+  log.lastId = lastId;
+  pending.clear();
+  pendingIndex.clear();
+}
+
+void SegmentLog::appendChannel(ChannelLog& log, std::vector<MessageRow*>& rows) {
+  std::lock_guard<std::mutex> appendLock(log.appendMutex);
+  // only appenders change the segment list & they hold appendMutex
+  Segment* active = log.segments.back().get();
+  std::string pending;
+  std::vector<IndexEntry> pendingIndex;
+  int nextId = log.lastId + 1;
+
+  for (MessageRow* row : rows) {
+    uint64_t size = RECORD_HEADER + RECORD_FIXED + row->text.size();
+    if (size > options_.segmentBytes)
+      throw std::length_error("message larger than a log segment");
+    if (active->end + pending.size() + size > active->capacity) {
+      commit(log, *active, pending, pendingIndex, nextId - 1);
+      active = rollSegment(log, nextId);
+    }
+    row->id = nextId++;
+    uint64_t offset = active->end + pending.size();
+    if (offset == 0 || (row->id - 1) % options_.indexInterval == 0)
+      pendingIndex.push_back({ row->id, row->date, log.segments.size() - 1, offset });
+    encode(pending, *row);
+  }
+  commit(log, *active, pending, pendingIndex, nextId - 1);
+}
+
+void SegmentLog::append(std::vector<MessageRow>& rows) {
+  std::unordered_map<int, std::vector<MessageRow*>> byChannel;
+  for (MessageRow& row : rows)
+    byChannel[row.channel].push_back(&row);
+  // one failing channel must not hold back the others
+  std::exception_ptr error;
+  for (auto& it : byChannel) {
+    try {
+      appendChannel(*openChannel(it.first, true), it.second);
+    } catch (...) {
+      for (MessageRow* row : it.second)
+        row->id = 0;
+      if (!error)
+        error = std::current_exception();
+    }
+  }
+  if (error)
+    std::rethrow_exception(error);
+}
+
+template <typename Visit>
+void SegmentLog::scanFrom(ChannelLog& log, const IndexEntry& start, Visit visit) {
+  MessageRow row;
+  for (size_t s = start.segment; s < log.segments.size(); s++) {
+    const Segment& segment = *log.segments[s];
+    uint64_t offset = s == start.segment ? start.offset : 0;
+    while (offset < segment.end) {
+      // published bytes were checksummed on the way in, no need to verify again
+      uint32_t length = get<uint32_t>(segment.map + offset);
+      decode(segment.map + offset, 0, row);
+      if (!visit(row))
+        return;
+      offset += RECORD_HEADER + length;
+    }
+  }
+}
+
+void SegmentLog::readPage(int channel, const MessagePage& page, std::vector<MessageRow>& out) {
+  std::shared_ptr<ChannelLog> log = openChannel(channel, false);
+  if (!log)
+    return;
+  std::shared_lock<std::shared_mutex> lock(log->mutex);
+  if (log->lastId == 0 || log->index.empty() || page.limit <= 0)
+    return;
+  // out may already hold rows from the caller, only this page counts
+  size_t base = out.size();
+
+  int limit = page.limit;
+  int first = 1, before = log->lastId + 1, afterDate = 0;
+  bool byDate = false;
+  switch (page.anchor) {
+    case MessagePage::Anchor::AFTER_ID:
+      first = page.key + 1;
+      break;
+    case MessagePage::Anchor::BEFORE_ID:
+      before = std::min(page.key, before);
+      first = before - limit;
+      break;
+    case MessagePage::Anchor::AFTER_DATE:
+      byDate = true;
+      afterDate = page.key;
+      break;
+    case MessagePage::Anchor::NEWEST:
+    default:
+      first = log->lastId - limit + 1;
+      break;
+  }
+  first = std::max(first, 1);
+  if (!byDate && first > log->lastId)
+    return;
+
+  // ids are dense, so the sparse index lands within indexInterval records
+  // of the first wanted id. dates only grow with ids, the same works for them
+  auto start = byDate ?
+    std::upper_bound(log->index.begin(), log->index.end(), afterDate,
+      [](int date, const IndexEntry& e) { return date < e.date; }) :
+    std::upper_bound(log->index.begin(), log->index.end(), first,
+      [](int id, const IndexEntry& e) { return id < e.id; });
+  if (start != log->index.begin())
+    --start;
+
+  scanFrom(*log, *start, [&](MessageRow& row) {
+    if (row.id >= before)
+      return false;
+    if (byDate ? row.date <= afterDate : row.id < first)
+      return true;
+    row.channel = channel;
+    out.push_back(row);
+    return static_cast<int>(out.size() - base) < limit;
+  });
+}
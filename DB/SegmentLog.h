@@ -0,0 +1,102 @@
+/*
+This file is part of Wrongthink.
+
+Wrongthink - Modern, open & performant chat protocol. Based on gRPC.
+Copyright (C) 2020 Ophiuchus2
+
+This program is free software: you can redistribute it and/or modify it under the
+terms of the GNU Affero General Public License as published by the Free Software Foundation,
+either version 3 of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License along with this program.
+If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef DB_SEGMENT_LOG_H
+#define DB_SEGMENT_LOG_H
+
+#include <list>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <shared_mutex>
+#include <unordered_map>
+
+#include "MessageStore.h"
+
+struct SegmentLogOptions {
+  // segment files are preallocated to this size & rolled when full
+  uint64_t segmentBytes = 64ull * 1024 * 1024;
+  // one sparse index entry per this many messages
+  int indexInterval = 64;
+  // idle channels past this many are closed, least recently used first,
+  // each open channel holds an fd & a mapping per segment
+  size_t maxOpenChannels = 256;
+};
+
+/*
+ * Append-only message store, one directory per channel holding segment files
+ * named after the first msg_id they contain. Records are checksummed, a torn
+ * tail left by a crash is cut off when the channel is reopened. Reads scan
+ * the memory mapped segments from the nearest sparse index entry.
+ *
+ * msg ids are dense & per channel, starting at 1.
+ */
+class SegmentLog : public MessageStore {
+public:
+  explicit SegmentLog(const std::string& directory,
+                      const SegmentLogOptions& options = SegmentLogOptions{});
+  ~SegmentLog();
+
+  void append(std::vector<MessageRow>& rows) override;
+  void readPage(int channel, const MessagePage& page, std::vector<MessageRow>& out) override;
+
+private:
+  struct Segment;
+  struct IndexEntry {
+    int id;
+    int date;
+    size_t segment;
+    uint64_t offset;
+  };
+  struct ChannelLog {
+    std::string directory;
+    // appends are serialized per channel, readers only see published bytes
+    std::mutex appendMutex;
+    std::shared_mutex mutex;
+    std::vector<std::unique_ptr<Segment>> segments;
+    std::vector<IndexEntry> index;
+    int lastId = 0;
+  };
+  struct OpenChannel {
+    std::shared_ptr<ChannelLog> log;
+    std::list<int>::iterator lru;
+  };
+
+  std::shared_ptr<ChannelLog> openChannel(int channel, bool create);
+  /* closes idle channels until at most maxOpenChannels stay open */
+  void closeIdle();
+  void loadSegment(ChannelLog& log, size_t segment, bool last);
+  void scanSegment(ChannelLog& log, size_t segment, bool recover);
+  Segment* rollSegment(ChannelLog& log, int firstId);
+  void commit(ChannelLog& log, Segment& segment, std::string& pending,
+              std::vector<IndexEntry>& pendingIndex, int lastId);
+  void appendChannel(ChannelLog& log, std::vector<MessageRow*>& rows);
+  /* calls visit on each record from start on, until it returns false */
+  template <typename Visit>
+  void scanFrom(ChannelLog& log, const IndexEntry& start, Visit visit);
+
+  std::string directory_;
+  SegmentLogOptions options_;
+  std::mutex channelsMutex_;
+  std::unordered_map<int, OpenChannel> channels_;
+  // most recently used channel first
+  std::list<int> lru_;
+};
+
+#endif // DB_SEGMENT_LOG_H
@@ -0,0 +1,112 @@
+/*
+This file is part of Wrongthink.
+
+Wrongthink - Modern, open & performant chat protocol. Based on gRPC.
+Copyright (C) 2020 Ophiuchus2
+
+This program is free software: you can redistribute it and/or modify it under the
+terms of the GNU Affero General Public License as published by the Free Software Foundation,
+either version 3 of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License along with this program.
+If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef DB_TTL_CACHE_H
+#define DB_TTL_CACHE_H
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+
+/*
+ * Sharded map whose entries expire after a per-entry ttl. Lookups take a
+ * shared lock on one shard only. Misses are resolved by the caller, which
+ * grabs version() before reading the source of truth & passes it to put(),
+ * so a value read before an erase() can't be cached after it.
+ */
+template <typename K, typename V, size_t SHARDS = 16>
+class TTLCache {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  explicit TTLCache(size_t maxEntriesPerShard = 4096) : maxEntries_{maxEntriesPerShard} {}
+
+  bool get(const K& key, V& value) const {
+    const Shard& shard = shardFor(key);
+    std::shared_lock<std::shared_mutex> lock(shard.mutex);
+    auto it = shard.entries.find(key);
+    if (it == shard.entries.end() || it->second.expires <= Clock::now())
+      return false;
+    value = it->second.value;
+    return true;
+  }
+
+  uint64_t version(const K& key) const {
+    const Shard& shard = shardFor(key);
+    std::shared_lock<std::shared_mutex> lock(shard.mutex);
+    return shard.version;
+  }
+
+  void put(const K& key, const V& value, Clock::duration ttl, uint64_t version) {
+    Shard& shard = shardFor(key);
+    std::unique_lock<std::shared_mutex> lock(shard.mutex);
+    if (shard.version != version)
+      return;
+    auto now = Clock::now();
+    if (shard.entries.size() >= maxEntries_ && shard.entries.find(key) == shard.entries.end()) {
+      for (auto it = shard.entries.begin(); it != shard.entries.end();) {
+        if (it->second.expires <= now)
+          it = shard.entries.erase(it);
+        else
+          ++it;
+      }
+      // still full of live entries, start the shard over rather than track lru
+      if (shard.entries.size() >= maxEntries_)
+        shard.entries.clear();
+    }
+    shard.entries[key] = Entry{ value, now + ttl };
+  }
+
+  void erase(const K& key) {
+    Shard& shard = shardFor(key);
+    std::unique_lock<std::shared_mutex> lock(shard.mutex);
+    shard.entries.erase(key);
+    ++shard.version;
+  }
+
+  void clear() {
+    for (Shard& shard : shards_) {
+      std::unique_lock<std::shared_mutex> lock(shard.mutex);
+      shard.entries.clear();
+      ++shard.version;
+    }
+  }
+
+private:
+  struct Entry {
+    V value;
+    Clock::time_point expires;
+  };
+
+  struct Shard {
+    mutable std::shared_mutex mutex;
+    std::unordered_map<K, Entry> entries;
+    uint64_t version = 0;
+  };
+
+  Shard& shardFor(const K& key) { return shards_[std::hash<K>{}(key) % SHARDS]; }
+  const Shard& shardFor(const K& key) const { return shards_[std::hash<K>{}(key) % SHARDS]; }
+
+  size_t maxEntries_;
+  std::array<Shard, SHARDS> shards_;
+};
+
+#endif // DB_TTL_CACHE_H
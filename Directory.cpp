@@ -0,0 +1,183 @@
+/*
+This file is part of Wrongthink.
+
+Wrongthink - Modern, open & performant chat protocol. Based on gRPC.
+Copyright (C) 2020 Ophiuchus2
+
+This program is free software: you can redistribute it and/or modify it under the
+terms of the GNU Affero General Public License as published by the Free Software Foundation,
+either version 3 of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License along with this program.
+If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "Directory.h"
+
+#include <random>
+
+constexpr std::chrono::seconds Directory::DEFAULT_REFRESH;
+
+Directory::Directory(std::chrono::seconds refresh) :
+  refresh_{refresh},
+  epoch_{std::random_device{}() | (static_cast<uint64_t>(std::random_device{}()) << 32)},
+  mutex_{},
+  version_{0},
+  communities_{},
+  channels_{}
+{
+}
+
+Directory::Result Directory::communities(const std::string& known, const CommunityLoader& load,
+                                         std::vector<WrongthinkCommunity>& out,
+                                         std::string& version) {
+  return read(communities_, known, load,
+              [](const WrongthinkCommunity& c) { return c.communityid(); }, out, version);
+}
+
+Directory::Result Directory::channels(int community, const std::string& known,
+                                      const ChannelLoader& load,
+                                      std::vector<WrongthinkChannel>& out, std::string& version) {
+  auto id = [](const WrongthinkChannel& c) { return c.channelid(); };
+  Listing<WrongthinkChannel>* listing = nullptr;
+  {
+    // node based map, the listing stays put while other communities are added
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = channels_.find(community);
+    if (it != channels_.end())
+      listing = &it->second;
+  }
+  if (!listing) {
+    // only communities with channels get a listing, so ids that don't exist
+    // can't grow the map
+    std::vector<WrongthinkChannel> loaded;
+    load(loaded);
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (loaded.empty()) {
+      version = token(version_);
+      return Result::FULL;
+    }
+    auto inserted = channels_.try_emplace(community);
+    listing = &inserted.first->second;
+    // a concurrent first read may have added it already
+    if (inserted.second) {
+      merge(*listing, loaded, id);
+      listing->stale = false;
+      listing->loaded = Clock::now();
+    }
+  }
+  return read(*listing, known, load, id, out, version);
+}
+
+void Directory::invalidateCommunities() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  communities_.stale = true;
+}
+
+void Directory::invalidateChannels(int community) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = channels_.find(community);
+  if (it != channels_.end())
+    it->second.stale = true;
+}
+
+template<typename T, typename Loader, typename Id>
+Directory::Result Directory::read(Listing<T>& listing, const std::string& known,
+                                  const Loader& load, Id id, std::vector<T>& out,
+                                  std::string& version) {
+  bool reload;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    reload = !fresh(listing.stale, listing.loaded);
+    // a create racing with the load below marks it stale again
+    if (reload)
+      listing.stale = false;
+  }
+  if (reload) {
+    // the query runs unlocked, concurrent reloads merge to the same result
+    std::vector<T> loaded;
+    try {
+      load(loaded);
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      listing.stale = true;
+      throw;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    merge(listing, loaded, id);
+    listing.loaded = Clock::now();
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  version = token(version_);
+  uint64_t since = 0;
+  if (!parseToken(known, since) || since < listing.resetVersion || since > version_) {
+    for (const auto& entry : listing.entries)
+      out.push_back(entry.value);
+    return Result::FULL;
+  }
+  size_t before = out.size();
+  for (const auto& entry : listing.entries) {
+    if (entry.version > since)
+      out.push_back(entry.value);
+  }
+  return out.size() == before ? Result::UNCHANGED : Result::DELTA;
+}
+
+template<typename T, typename Id>
+void Directory::merge(Listing<T>& listing, std::vector<T>& fresh, Id id) {
+  std::unordered_map<int, const typename Listing<T>::Entry*> current;
+  for (const auto& entry : listing.entries)
+    current.emplace(id(entry.value), &entry);
+
+  // entries keep their version while they stay the same
+  std::vector<typename Listing<T>::Entry> entries;
+  entries.reserve(fresh.size());
+  uint64_t next = version_ + 1;
+  bool changed = false;
+  size_t kept = 0;
+  for (T& value : fresh) {
+    auto it = current.find(id(value));
+    if (it != current.end()) {
+      kept++;
+      if (it->second->value.SerializeAsString() == value.SerializeAsString()) {
+        entries.push_back({it->second->version, std::move(value)});
+        continue;
+      }
+    }
+    changed = true;
+    entries.push_back({next, std::move(value)});
+  }
+  // deltas only add & replace, a removal needs a full listing
+  bool removed = kept < listing.entries.size();
+  if (removed || listing.resetVersion == 0)
+    listing.resetVersion = next;
+  if (changed || removed || listing.resetVersion == next)
+    version_ = next;
+  listing.entries = std::move(entries);
+}
+
+bool Directory::fresh(bool stale, Clock::time_point loaded) const {
+  return !stale && Clock::now() - loaded < refresh_;
+}
+
+std::string Directory::token(uint64_t version) const {
+  return std::to_string(epoch_) + "." + std::to_string(version);
+}
+
+bool Directory::parseToken(const std::string& token, uint64_t& version) const {
+  size_t dot = token.find('.');
+  if (dot == std::string::npos)
+    return false;
+  try {
+    if (std::stoull(token.substr(0, dot)) != epoch_)
+      return false;
+    version = std::stoull(token.substr(dot + 1));
+  } catch (const std::exception&) {
+    return false;
+  }
+  return true;
+}
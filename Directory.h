@@ -0,0 +1,99 @@
+/*
+This file is part of Wrongthink.
+
+Wrongthink - Modern, open & performant chat protocol. Based on gRPC.
+Copyright (C) 2020 Ophiuchus2
+
+This program is free software: you can redistribute it and/or modify it under the
+terms of the GNU Affero General Public License as published by the Free Software Foundation,
+either version 3 of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License along with this program.
+If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef DIRECTORY_H
+#define DIRECTORY_H
+
+#include <mutex>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+
+#include "wrongthink.grpc.pb.h"
+
+/*
+ * In memory copy of the community & channel listings. Every change bumps a
+ * single version counter & each entry remembers the version that last
+ * changed it, so a client that already holds a listing at some version only
+ * needs the entries changed after it, or nothing at all. Listings are loaded
+ * on first use, reloaded after invalidate*() (this server created something)
+ * or once refresh has passed (another server may have).
+ */
+class Directory {
+public:
+  static constexpr std::chrono::seconds DEFAULT_REFRESH{30};
+  using CommunityLoader = std::function<void(std::vector<WrongthinkCommunity>& out)>;
+  using ChannelLoader = std::function<void(std::vector<WrongthinkChannel>& out)>;
+
+  /* what a listing read returns to the caller */
+  enum class Result {
+    FULL,      // every entry was written, replace the listing
+    DELTA,     // only entries changed since the known version, apply by id
+    UNCHANGED  // nothing changed since the known version
+  };
+
+  explicit Directory(std::chrono::seconds refresh = DEFAULT_REFRESH);
+
+  /* appends the communities changed after known (a version token, empty for
+     all of them) to out & sets version to the token of the current listing */
+  Result communities(const std::string& known, const CommunityLoader& load,
+                     std::vector<WrongthinkCommunity>& out, std::string& version);
+  Result channels(int community, const std::string& known, const ChannelLoader& load,
+                  std::vector<WrongthinkChannel>& out, std::string& version);
+  /* the next read reloads, call after a create */
+  void invalidateCommunities();
+  void invalidateChannels(int community);
+
+private:
+  using Clock = std::chrono::steady_clock;
+
+  template<typename T>
+  struct Listing {
+    struct Entry {
+      uint64_t version;
+      T value;
+    };
+    std::vector<Entry> entries;
+    // older versions can't be brought up to date by a delta
+    uint64_t resetVersion = 0;
+    bool stale = true;
+    Clock::time_point loaded;
+  };
+
+  template<typename T, typename Loader, typename Id>
+  Result read(Listing<T>& listing, const std::string& known, const Loader& load, Id id,
+              std::vector<T>& out, std::string& version);
+  template<typename T, typename Id>
+  void merge(Listing<T>& listing, std::vector<T>& fresh, Id id);
+  bool fresh(bool stale, Clock::time_point loaded) const;
+  std::string token(uint64_t version) const;
+  /* false for malformed tokens & tokens handed out by another process */
+  bool parseToken(const std::string& token, uint64_t& version) const;
+
+  std::chrono::seconds refresh_;
+  // tells this process's tokens apart from those of earlier runs
+  uint64_t epoch_;
+  std::mutex mutex_;
+  uint64_t version_;
+  Listing<WrongthinkCommunity> communities_;
+  std::unordered_map<int, Listing<WrongthinkChannel>> channels_;
+};
+
+#endif // DIRECTORY_H
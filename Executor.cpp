@@ -0,0 +1,127 @@
+/*
+This file is part of Wrongthink.
+
+Wrongthink - Modern, open & performant chat protocol. Based on gRPC.
+Copyright (C) 2020 Ophiuchus2
+
+This program is free software: you can redistribute it and/or modify it under the
+terms of the GNU Affero General Public License as published by the Free Software Foundation,
+either version 3 of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License along with this program.
+If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "Executor.h"
+
+#include <iostream>
+#include <algorithm>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+bool pinThread(std::thread::native_handle_type thread, const std::vector<int>& cpus) {
+#ifdef __linux__
+  if (cpus.empty())
+    return false;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : cpus)
+    CPU_SET(cpu, &set);
+  return pthread_setaffinity_np(thread, sizeof(set), &set) == 0;
+#else
+  (void)thread;
+  (void)cpus;
+  return false;
+#endif
+}
+
+Executor::Executor(const std::string& name, size_t threads, size_t maxQueued) :
+  name_{name},
+  maxQueued_{maxQueued == 0 ? 1 : maxQueued},
+  mutex_{},
+  workAvailable_{},
+  spaceAvailable_{},
+  tasks_{},
+  stats_{},
+  stopping_{false},
+  threads_{}
+{
+  if (threads == 0)
+    threads = 1;
+  for (size_t i = 0; i < threads; i++)
+    threads_.emplace_back([this]() { run(); });
+}
+
+Executor::~Executor() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  workAvailable_.notify_all();
+  spaceAvailable_.notify_all();
+  for (std::thread& thread : threads_)
+    thread.join();
+}
+
+void Executor::submit(std::function<void()> task) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  spaceAvailable_.wait(lock, [this]() { return stopping_ || tasks_.size() < maxQueued_; });
+  tasks_.push_back(Task{std::move(task), Clock::now()});
+  workAvailable_.notify_one();
+}
+
+bool Executor::trySubmit(std::function<void()> task) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (tasks_.size() >= maxQueued_) {
+    stats_.rejected++;
+    return false;
+  }
+  tasks_.push_back(Task{std::move(task), Clock::now()});
+  workAvailable_.notify_one();
+  return true;
+}
+
+Executor::Stats Executor::stats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Stats stats = stats_;
+  stats.queued = tasks_.size();
+  return stats;
+}
+
+bool Executor::pin(const std::vector<int>& cpus) {
+  bool pinned = true;
+  for (std::thread& thread : threads_)
+    pinned = pinThread(thread.native_handle(), cpus) && pinned;
+  return pinned;
+}
+
+void Executor::run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    workAvailable_.wait(lock, [this]() { return stopping_ || !tasks_.empty(); });
+    if (tasks_.empty())
+      return;
+    Task task = std::move(tasks_.front());
+    tasks_.pop_front();
+    auto wait = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - task.queued);
+    stats_.totalWait += wait;
+    stats_.maxWait = std::max(stats_.maxWait, wait);
+    stats_.active++;
+    spaceAvailable_.notify_one();
+    lock.unlock();
+    try {
+      task.run();
+    } catch (const std::exception& e) {
+      // tasks report their own errors, this only keeps the worker alive
+      std::cout << name_ << " task failed: " << e.what() << std::endl;
+    }
+    lock.lock();
+    stats_.active--;
+    stats_.completed++;
+  }
+}
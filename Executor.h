@@ -0,0 +1,85 @@
+/*
+This file is part of Wrongthink.
+
+Wrongthink - Modern, open & performant chat protocol. Based on gRPC.
+Copyright (C) 2020 Ophiuchus2
+
+This program is free software: you can redistribute it and/or modify it under the
+terms of the GNU Affero General Public License as published by the Free Software Foundation,
+either version 3 of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License along with this program.
+If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef EXECUTOR_H
+#define EXECUTOR_H
+
+#include <deque>
+#include <mutex>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <condition_variable>
+
+/* restricts a thread to cpus, false if the platform can't or cpus is empty */
+bool pinThread(std::thread::native_handle_type thread, const std::vector<int>& cpus);
+
+/*
+ * Fixed pool of worker threads running submitted tasks in order. Keeps
+ * blocking database work off the threads serving grpc. At most maxQueued
+ * tasks wait, submit() blocks beyond that & trySubmit() refuses, so a burst
+ * can't queue unbounded work.
+ */
+class Executor {
+public:
+  struct Stats {
+    // tasks waiting for a worker & tasks running right now
+    size_t queued = 0;
+    size_t active = 0;
+    uint64_t completed = 0;
+    // trySubmit() calls turned away by a full queue
+    uint64_t rejected = 0;
+    // time tasks spent queued before a worker picked them up
+    std::chrono::microseconds totalWait{0};
+    std::chrono::microseconds maxWait{0};
+  };
+
+  Executor(const std::string& name, size_t threads, size_t maxQueued = 1024);
+  /* runs the tasks already queued, then joins the workers */
+  ~Executor();
+
+  void submit(std::function<void()> task);
+  /* for callers that must not block, false if the queue is full */
+  bool trySubmit(std::function<void()> task);
+  Stats stats() const;
+  /* restricts the workers to cpus, empty leaves them alone */
+  bool pin(const std::vector<int>& cpus);
+
+private:
+  using Clock = std::chrono::steady_clock;
+  struct Task {
+    std::function<void()> run;
+    Clock::time_point queued;
+  };
+
+  void run();
+
+  std::string name_;
+  size_t maxQueued_;
+  mutable std::mutex mutex_;
+  std::condition_variable workAvailable_;
+  std::condition_variable spaceAvailable_;
+  std::deque<Task> tasks_;
+  Stats stats_;
+  bool stopping_;
+  std::vector<std::thread> threads_;
+};
+
+#endif // EXECUTOR_H
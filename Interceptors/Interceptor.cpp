@@ -1,7 +1,25 @@
 #include "Interceptor.h"
+#include <cstring>
 
 namespace WrongthinkInterceptors {
 
+namespace {
+
+// raw methods receive grpc::ByteBuffer instead of a protobuf message
+const char* RAW_METHODS[] = {
+  "/wrongthink/ListenWrongthinkMessages"
+};
+
+bool isRawMethod(const char* method) {
+  for (const char* raw : RAW_METHODS) {
+    if (strcmp(method, raw) == 0)
+      return true;
+  }
+  return false;
+}
+
+}
+
 LoggingInterceptor::LoggingInterceptor(grpc::experimental::ServerRpcInfo* info,
                     std::shared_ptr<DBInterface> db,
                     std::shared_ptr<spdlog::logger> logger) : info_{info},
@@ -38,6 +56,11 @@ void LoggingInterceptor::Intercept(grpc::experimental::InterceptorBatchMethods*
           grpc::experimental::InterceptionHookPoints::POST_RECV_MESSAGE)) {
     //logger->info("POST_RECV_MESSAGE");
     grpc_impl::ServerContextBase* serverContext = info_->server_context();
+    if (isRawMethod(info_->method())) {
+      logger_->info("RPC method: {}, peer: {}, raw request", info_->method(), serverContext->peer());
+      methods->Proceed();
+      return;
+    }
     auto msg = static_cast<grpc::protobuf::Message*>(methods->GetRecvMessage());
     std::string data;
     //msg->SerializeToString(&data);
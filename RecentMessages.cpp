@@ -0,0 +1,167 @@
+/*
+This file is part of Wrongthink.
+
+Wrongthink - Modern, open & performant chat protocol. Based on gRPC.
+Copyright (C) 2020 Ophiuchus2
+
+This program is free software: you can redistribute it and/or modify it under the
+terms of the GNU Affero General Public License as published by the Free Software Foundation,
+either version 3 of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License along with this program.
+If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "RecentMessages.h"
+#include <algorithm>
+
+namespace {
+
+uint64_t messageBytes(const WrongthinkMessage& msg) {
+  return sizeof(WrongthinkMessage) + msg.ByteSizeLong();
+}
+
+}
+
+RecentMessages::RecentMessages(size_t capacity) :
+  capacity_{std::max<size_t>(capacity, 1)},
+  mutex_{},
+  messages_{},
+  warm_{false},
+  warming_{false},
+  pending_{},
+  bytes_{0},
+  onResize_{},
+  complete_{false},
+  settled_{0}
+{ }
+
+void RecentMessages::warm(const HistoryReader& read) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (warm_ || warming_)
+      return;
+    warming_ = true;
+  }
+  // the database read doesn't hold up commits of this channel, those land
+  // in pending_ meanwhile
+  std::vector<WrongthinkMessage> tail;
+  try {
+    read(static_cast<int>(capacity_), tail);
+  } catch (...) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    warming_ = false;
+    pending_.clear();
+    throw;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  bool complete = tail.size() < capacity_;
+  tail.insert(tail.end(), pending_.begin(), pending_.end());
+  pending_.clear();
+  assign(tail);
+  // the read was short, unless commits pushed the tail past capacity the
+  // whole history is here
+  complete_ = complete && messages_.size() < capacity_;
+  warming_ = false;
+  warm_ = true;
+}
+
+uint64_t RecentMessages::append(const WrongthinkMessage& msg) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  ++settled_;
+  if (warming_) {
+    pending_.push_back(msg);
+    return settled_;
+  }
+  if (!warm_)
+    return settled_;
+  if (!messages_.empty() && msg.messageid() <= messages_.back().messageid())
+    return settled_;
+  push(msg);
+  if (messages_.size() > capacity_) {
+    popFront();
+    complete_ = false;
+  }
+  return settled_;
+}
+
+uint64_t RecentMessages::discard() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return ++settled_;
+}
+
+void RecentMessages::assign(std::vector<WrongthinkMessage>& messages) {
+  std::sort(messages.begin(), messages.end(),
+    [](const WrongthinkMessage& a, const WrongthinkMessage& b) {
+      return a.messageid() < b.messageid();
+    });
+  messages.erase(std::unique(messages.begin(), messages.end(),
+    [](const WrongthinkMessage& a, const WrongthinkMessage& b) {
+      return a.messageid() == b.messageid();
+    }), messages.end());
+  while (!messages_.empty())
+    popFront();
+  size_t skip = messages.size() > capacity_ ? messages.size() - capacity_ : 0;
+  for (size_t i = skip; i < messages.size(); i++)
+    push(messages[i]);
+}
+
+void RecentMessages::push(const WrongthinkMessage& msg) {
+  messages_.push_back(msg);
+  uint64_t bytes = messageBytes(msg);
+  bytes_ += bytes;
+  if (onResize_)
+    onResize_(bytes);
+}
+
+void RecentMessages::popFront() {
+  uint64_t bytes = messageBytes(messages_.front());
+  messages_.pop_front();
+  bytes_ -= bytes;
+  if (onResize_)
+    onResize_(-bytes);
+}
+
+uint64_t RecentMessages::residentBytes() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return bytes_;
+}
+
+bool RecentMessages::serve(const MessagePage& page, std::vector<WrongthinkMessage>& out,
+                           uint64_t& settled) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  settled = settled_;
+  if (!warm_ || page.limit <= 0)
+    return false;
+  size_t limit = static_cast<size_t>(page.limit);
+
+  switch (page.anchor) {
+    case MessagePage::Anchor::NEWEST: {
+      if (messages_.size() < limit && !complete_)
+        return false;
+      size_t count = std::min(limit, messages_.size());
+      out.insert(out.end(), messages_.end() - count, messages_.end());
+      return true;
+    }
+    case MessagePage::Anchor::AFTER_ID: {
+      // ids between key & the oldest message held may exist in the database
+      if (!complete_ && (messages_.empty() || page.key < messages_.front().messageid()))
+        return false;
+      auto first = std::upper_bound(messages_.begin(), messages_.end(), page.key,
+        [](int key, const WrongthinkMessage& msg) { return key < msg.messageid(); });
+      size_t count = std::min<size_t>(limit, messages_.end() - first);
+      out.insert(out.end(), first, first + count);
+      return true;
+    }
+    default:
+      return false;
+  }
+}
+
+bool RecentMessages::isWarm() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return warm_;
+}
@@ -0,0 +1,93 @@
+/*
+This file is part of Wrongthink.
+
+Wrongthink - Modern, open & performant chat protocol. Based on gRPC.
+Copyright (C) 2020 Ophiuchus2
+
+This program is free software: you can redistribute it and/or modify it under the
+terms of the GNU Affero General Public License as published by the Free Software Foundation,
+either version 3 of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License along with this program.
+If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef RECENT_MESSAGES_H
+#define RECENT_MESSAGES_H
+
+#include <deque>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+#include <functional>
+
+#include "wrongthink.grpc.pb.h"
+#include "DB/MessageStore.h"
+
+/*
+ * The newest persisted messages of a live channel, complete with messageid,
+ * uname & date, so the latest page & "after id" pages skip the database.
+ * Warmed from history once, then kept current by the message writer's
+ * commit callback. Holds a contiguous tail of the channel's history: every
+ * message with an id past the oldest one held is in here. Also counts the
+ * messages the writer is done with, committed or given up on, which is the
+ * sequence number of the newest settled message in the channel's ring.
+ */
+class RecentMessages {
+public:
+  static constexpr size_t DEFAULT_CAPACITY = 256;
+  /* fills out with the newest limit messages of the channel, oldest first */
+  using HistoryReader = std::function<void(int limit, std::vector<WrongthinkMessage>& out)>;
+  /* told how many bytes the cache grew by, a shrink wraps around */
+  using ResizeListener = std::function<void(uint64_t delta)>;
+
+  explicit RecentMessages(size_t capacity = DEFAULT_CAPACITY);
+
+  /* loads the tail through read unless already warm. the read runs unlocked,
+     commits arriving meanwhile are held back & merged by id afterwards */
+  void warm(const HistoryReader& read);
+  /* records a committed message, only counted until warm. both return the
+     new settled count, the message's sequence number in the channel's ring */
+  uint64_t append(const WrongthinkMessage& msg);
+  /* counts a message the writer gave up on */
+  uint64_t discard();
+  /* serves NEWEST & AFTER_ID pages the cache fully covers, returns false
+     when the caller has to go to the database. settled is set to the
+     number of messages settled at the time of the snapshot */
+  bool serve(const MessagePage& page, std::vector<WrongthinkMessage>& out,
+             uint64_t& settled) const;
+  bool serve(const MessagePage& page, std::vector<WrongthinkMessage>& out) const {
+    uint64_t settled;
+    return serve(page, out, settled);
+  }
+  bool isWarm() const;
+  /* approximate memory held by the cached messages */
+  uint64_t residentBytes() const;
+  /* call before the cache is shared */
+  void setResizeListener(ResizeListener listener) { onResize_ = std::move(listener); }
+
+private:
+  /* replaces messages_ with the newest capacity_ of messages, by id */
+  void assign(std::vector<WrongthinkMessage>& messages);
+  void push(const WrongthinkMessage& msg);
+  void popFront();
+
+  size_t capacity_;
+  mutable std::mutex mutex_;
+  std::deque<WrongthinkMessage> messages_;
+  bool warm_;
+  // a warm() read is running, commits go to pending_ until it merges
+  bool warming_;
+  std::vector<WrongthinkMessage> pending_;
+  uint64_t bytes_;
+  ResizeListener onResize_;
+  // true while messages_ holds the channel's entire history
+  bool complete_;
+  // messages committed or discarded by the writer, cached or not
+  uint64_t settled_;
+};
+
+#endif // RECENT_MESSAGES_H
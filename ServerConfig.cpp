@@ -0,0 +1,209 @@
+/*
+This file is part of Wrongthink.
+
+Wrongthink - Modern, open & performant chat protocol. Based on gRPC.
+Copyright (C) 2020 Ophiuchus2
+
+This program is free software: you can redistribute it and/or modify it under the
+terms of the GNU Affero General Public License as published by the Free Software Foundation,
+either version 3 of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License along with this program.
+If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "ServerConfig.h"
+
+#include <map>
+#include <cctype>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <stdexcept>
+
+namespace {
+
+std::string trim(const std::string& s) {
+  size_t start = s.find_first_not_of(" \t\r");
+  if (start == std::string::npos)
+    return "";
+  size_t end = s.find_last_not_of(" \t\r");
+  return s.substr(start, end - start + 1);
+}
+
+long long toNumber(const std::string& key, const std::string& value) {
+  size_t used = 0;
+  long long n = 0;
+  try {
+    n = std::stoll(value, &used);
+  } catch (const std::exception&) {
+    used = 0;
+  }
+  if (used == 0 || used != value.size() || n < 0)
+    throw std::runtime_error("config: " + key + " expects a non negative number, got '" + value + "'");
+  return n;
+}
+
+bool toBool(const std::string& value) {
+  // any other value enables, so WRONGTHINK_MESSAGE_PARTITIONS=1 keeps working
+  return !(value.empty() || value == "0" || value == "false" || value == "no" || value == "off");
+}
+
+std::vector<std::string> split(const std::string& value, char sep) {
+  std::vector<std::string> out;
+  size_t start = 0;
+  while (start <= value.size()) {
+    size_t end = value.find(sep, start);
+    if (end == std::string::npos)
+      end = value.size();
+    std::string item = trim(value.substr(start, end - start));
+    if (!item.empty())
+      out.push_back(item);
+    start = end + 1;
+  }
+  return out;
+}
+
+using Setter = std::function<void(ServerConfig&, const std::string& key, const std::string& value)>;
+
+template<typename T>
+Setter number(T ServerConfig::* field) {
+  return [field](ServerConfig& c, const std::string& key, const std::string& value) {
+    c.*field = static_cast<T>(toNumber(key, value));
+  };
+}
+
+Setter flag(bool ServerConfig::* field) {
+  return [field](ServerConfig& c, const std::string&, const std::string& value) {
+    c.*field = toBool(value);
+  };
+}
+
+Setter text(std::string ServerConfig::* field) {
+  return [field](ServerConfig& c, const std::string&, const std::string& value) {
+    c.*field = value;
+  };
+}
+
+Setter cpus(std::vector<int> ServerConfig::* field) {
+  return [field](ServerConfig& c, const std::string&, const std::string& value) {
+    c.*field = ServerConfig::parseCpuList(value);
+  };
+}
+
+const std::map<std::string, Setter>& setters() {
+  static const std::map<std::string, Setter> table = {
+    { "address", text(&ServerConfig::address) },
+    { "server_instances", number(&ServerConfig::serverInstances) },
+    { "completion_queues", number(&ServerConfig::completionQueues) },
+    { "min_pollers", number(&ServerConfig::minPollers) },
+    { "max_pollers", number(&ServerConfig::maxPollers) },
+    { "max_threads", number(&ServerConfig::maxThreads) },
+    { "resource_quota_bytes", number(&ServerConfig::resourceQuotaBytes) },
+    { "max_concurrent_streams", number(&ServerConfig::maxConcurrentStreams) },
+    { "keepalive_time_ms", number(&ServerConfig::keepaliveTimeMs) },
+    { "keepalive_timeout_ms", number(&ServerConfig::keepaliveTimeoutMs) },
+    { "keepalive_min_ping_interval_ms", number(&ServerConfig::keepaliveMinPingIntervalMs) },
+    { "keepalive_permit_without_calls", flag(&ServerConfig::keepalivePermitWithoutCalls) },
+    { "shutdown_grace_ms", number(&ServerConfig::shutdownGraceMs) },
+    { "server_cpus", cpus(&ServerConfig::serverCpus) },
+    { "executor_cpus", cpus(&ServerConfig::executorCpus) },
+    { "unary_threads", number(&ServerConfig::unaryThreads) },
+    { "history_threads", number(&ServerConfig::historyThreads) },
+    { "history_compression", text(&ServerConfig::historyCompression) },
+    { "directory_compression", text(&ServerConfig::directoryCompression) },
+    { "compression_min_bytes", number(&ServerConfig::compressionMinBytes) },
+    { "listener_max_messages", number(&ServerConfig::listenerMaxMessages) },
+    { "listener_max_bytes", number(&ServerConfig::listenerMaxBytes) },
+    { "listener_policy", text(&ServerConfig::listenerPolicy) },
+    { "channel_memory_budget", number(&ServerConfig::channelMemoryBudget) },
+    { "db_connection", text(&ServerConfig::dbConnection) },
+    { "db_pool_size", number(&ServerConfig::dbPoolSize) },
+    { "db_replica_pool_size", number(&ServerConfig::dbReplicaPoolSize) },
+    { "db_replicas", [](ServerConfig& c, const std::string&, const std::string& value) {
+      c.dbReplicas = split(value, ';');
+    } },
+    { "retention_days", number(&ServerConfig::retentionDays) },
+    { "message_partitions", flag(&ServerConfig::messagePartitions) },
+    { "message_log", text(&ServerConfig::messageLog) },
+    { "search_index", text(&ServerConfig::searchIndex) },
+  };
+  return table;
+}
+
+}
+
+void ServerConfig::set(const std::string& key, const std::string& value) {
+  auto it = setters().find(key);
+  if (it == setters().end())
+    throw std::runtime_error("config: unknown key '" + key + "'");
+  it->second(*this, key, value);
+}
+
+void ServerConfig::parse(std::istream& in) {
+  std::string line;
+  int lineNo = 0;
+  while (std::getline(in, line)) {
+    lineNo++;
+    // '#' starts a comment at the start of a line or after whitespace, so
+    // values like password=ab#cd survive
+    for (size_t i = 0; i < line.size(); i++) {
+      if (line[i] == '#' && (i == 0 || line[i - 1] == ' ' || line[i - 1] == '\t')) {
+        line.erase(i);
+        break;
+      }
+    }
+    line = trim(line);
+    if (line.empty())
+      continue;
+    size_t eq = line.find('=');
+    if (eq == std::string::npos)
+      throw std::runtime_error("config: line " + std::to_string(lineNo) + " is not key = value");
+    set(trim(line.substr(0, eq)), trim(line.substr(eq + 1)));
+  }
+}
+
+void ServerConfig::load(const std::string& file) {
+  std::ifstream in(file);
+  if (!in)
+    throw std::runtime_error("config: can't open " + file);
+  parse(in);
+}
+
+void ServerConfig::applyEnvironment() {
+  for (const auto& entry : setters()) {
+    std::string name = "WRONGTHINK_";
+    for (char c : entry.first)
+      name += static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+    if (const char* value = std::getenv(name.c_str()))
+      entry.second(*this, entry.first, value);
+  }
+}
+
+std::vector<int> ServerConfig::instanceCpus(int instance) const {
+  if (serverCpus.empty() || serverInstances <= 0)
+    return {};
+  size_t n = serverCpus.size(), k = serverInstances;
+  // fewer cpus than instances, instances share them round robin
+  if (n < k)
+    return { serverCpus[instance % n] };
+  return std::vector<int>(serverCpus.begin() + instance * n / k,
+                          serverCpus.begin() + (instance + 1) * n / k);
+}
+
+std::vector<int> ServerConfig::parseCpuList(const std::string& list) {
+  std::vector<int> out;
+  for (const std::string& item : split(list, ',')) {
+    size_t dash = item.find('-');
+    int first = toNumber("cpu list", trim(item.substr(0, dash)));
+    int last = dash == std::string::npos ? first : toNumber("cpu list", trim(item.substr(dash + 1)));
+    if (last < first)
+      throw std::runtime_error("config: bad cpu range '" + item + "'");
+    for (int cpu = first; cpu <= last; cpu++)
+      out.push_back(cpu);
+  }
+  return out;
+}
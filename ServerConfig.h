@@ -0,0 +1,104 @@
+/*
+This file is part of Wrongthink.
+
+Wrongthink - Modern, open & performant chat protocol. Based on gRPC.
+Copyright (C) 2020 Ophiuchus2
+
+This program is free software: you can redistribute it and/or modify it under the
+terms of the GNU Affero General Public License as published by the Free Software Foundation,
+either version 3 of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License along with this program.
+If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef SERVER_CONFIG_H
+#define SERVER_CONFIG_H
+
+#include <string>
+#include <vector>
+#include <istream>
+#include <cstddef>
+
+/*
+ * Runtime settings of the server. Read from a file of "key = value" lines,
+ * '#' at the start of a line or after whitespace starts a comment. Each key
+ * can then be overridden by an environment variable named WRONGTHINK_
+ * followed by the key in upper case, e.g. max_concurrent_streams ->
+ * WRONGTHINK_MAX_CONCURRENT_STREAMS. Zero keeps the grpc default for the
+ * numeric server settings.
+ */
+struct ServerConfig {
+  // every instance listens here, the kernel spreads connections over them
+  // through SO_REUSEPORT
+  std::string address = "0.0.0.0:50051";
+  int serverInstances = 1;
+
+  // sync server completion queues & polling threads, per instance
+  int completionQueues = 0;
+  int minPollers = 0;
+  int maxPollers = 0;
+  // per instance resource quota, caps grpc's threads & buffer memory
+  int maxThreads = 0;
+  size_t resourceQuotaBytes = 0;
+  int maxConcurrentStreams = 0;
+  int keepaliveTimeMs = 0;
+  int keepaliveTimeoutMs = 0;
+  // shortest ping interval accepted from clients without calls in flight
+  int keepaliveMinPingIntervalMs = 0;
+  bool keepalivePermitWithoutCalls = false;
+
+  // how long in flight calls get to finish on SIGINT/SIGTERM before they
+  // are cancelled, a second signal exits right away
+  int shutdownGraceMs = 10000;
+
+  // cpu lists like "0-15,32-47". server cpus are split evenly between the
+  // instances, executor cpus are shared by the database executors
+  std::vector<int> serverCpus;
+  std::vector<int> executorCpus;
+  // database executor threads, 0 keeps the service defaults
+  size_t unaryThreads = 0;
+  size_t historyThreads = 0;
+  // "none", "low", "medium" or "high", empty keeps the service defaults.
+  // messages under compression_min_bytes are always sent plain
+  std::string historyCompression;
+  std::string directoryCompression;
+  size_t compressionMinBytes = 0;
+  // unsent backlog allowed per listen stream, 0 keeps the service defaults.
+  // listener_policy is "gap", "drop_oldest" or "disconnect"
+  size_t listenerMaxMessages = 0;
+  size_t listenerMaxBytes = 0;
+  std::string listenerPolicy;
+  // bytes live channels may hold before idle ones are evicted, 0 never evicts
+  size_t channelMemoryBudget = 512ull * 1024 * 1024;
+
+  std::string dbConnection = "host=localhost dbname=wrongthink user=wrongthink password=test";
+  size_t dbPoolSize = 8;
+  size_t dbReplicaPoolSize = 8;
+  // read only replicas, ';' separated connection strings (file names for sqlite)
+  std::vector<std::string> dbReplicas;
+  // history older than this many days is hidden & eventually dropped,
+  // communities can override it
+  int retentionDays = 0;
+  // monthly message partitions, converts an existing message table on start
+  bool messagePartitions = false;
+  // keep message history in an append-only segment log instead of sql
+  std::string messageLog;
+  // full text search over message history, indexed under this directory
+  std::string searchIndex;
+
+  /* throws on unknown keys & malformed values */
+  void parse(std::istream& in);
+  void load(const std::string& file);
+  void applyEnvironment();
+  void set(const std::string& key, const std::string& value);
+
+  /* the slice of serverCpus for one instance, empty when unpinned */
+  std::vector<int> instanceCpus(int instance) const;
+  static std::vector<int> parseCpuList(const std::string& list);
+};
+
+#endif
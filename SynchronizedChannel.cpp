@@ -16,17 +16,126 @@ You should have received a copy of the GNU Affero General Public License along w
 If not, see <https://www.gnu.org/licenses/>.
 */
 #include "SynchronizedChannel.h"
+#include <algorithm>
+#include <stdexcept>
+#include <thread>
+#include <ctime>
 
-SynchronizedChannel::SynchronizedChannel(const WrongthinkChannel& wtChannel):
+namespace {
+
+// rough footprint of an entry: the struct, the parsed message & its payload
+uint64_t entryBytes(const ChannelEntry& entry) {
+  return sizeof(ChannelEntry) + 2 * entry.payload.Length();
+}
+
+size_t roundCapacity(size_t capacity) {
+  size_t rounded = 1;
+  while (rounded < capacity)
+    rounded <<= 1;
+  return rounded;
+}
+
+}
+
+WrongthinkMessage makeGapMarker(int channelid, uint64_t skipped, int messageid) {
+  WrongthinkMessage msg;
+  msg.set_channelid(channelid);
+  msg.set_messageid(messageid);
+  msg.set_uname(GAP_MARKER_UNAME);
+  msg.set_date(static_cast<int>(std::time(nullptr)));
+  msg.set_text(std::to_string(skipped));
+  return msg;
+}
+
+SlowConsumerPolicy parseSlowConsumerPolicy(const std::string& name) {
+  if (name == "gap")
+    return SlowConsumerPolicy::GAP;
+  if (name == "drop_oldest")
+    return SlowConsumerPolicy::DROP_OLDEST;
+  if (name == "disconnect")
+    return SlowConsumerPolicy::DISCONNECT;
+  throw std::runtime_error("unknown slow consumer policy '" + name + "'");
+}
+
+BudgetAction applyListenerBudget(const ListenerBudget& budget,
+                                 std::vector<ChannelEntryPtr>& pending,
+                                 size_t& pos, size_t lost, uint64_t& discarded,
+                                 int& storedId) {
+  discarded = 0;
+  storedId = 0;
+  // newest first, the writer commits in publish order so the first hit is it
+  auto newestStored = [&](size_t from, size_t to) {
+    for (size_t i = to; i > from; i--) {
+      if (int id = pending[i - 1]->messageid.load())
+        return id;
+    }
+    return 0;
+  };
+  auto backlogBytes = [&]() -> uint64_t {
+    if (pos == pending.size())
+      return 0;
+    const ChannelEntry& first = *pending[pos];
+    const ChannelEntry& last = *pending.back();
+    return last.byteOffset + last.payload.Length() - first.byteOffset;
+  };
+  auto overBudget = [&]() {
+    return pending.size() - pos > budget.maxMessages || backlogBytes() > budget.maxBytes;
+  };
+  if (!lost && !overBudget())
+    return BudgetAction::KEEP;
+
+  switch (budget.policy) {
+    case SlowConsumerPolicy::DISCONNECT:
+      discarded = lost + pending.size() - pos;
+      storedId = newestStored(pos, pending.size());
+      pending.clear();
+      pos = 0;
+      return BudgetAction::DISCONNECT;
+    case SlowConsumerPolicy::GAP:
+      discarded = lost + pending.size() - pos;
+      storedId = newestStored(pos, pending.size());
+      pending.clear();
+      pos = 0;
+      return BudgetAction::GAP;
+    case SlowConsumerPolicy::DROP_OLDEST: {
+      size_t first = pos;
+      while (overBudget())
+        ++pos;
+      discarded = lost + pos - first;
+      storedId = newestStored(first, pos);
+      return BudgetAction::KEEP;
+    }
+  }
+  return BudgetAction::KEEP;
+}
+
+SynchronizedChannel::SynchronizedChannel(const WrongthinkChannel& wtChannel,
+                                         size_t capacity):
   wtChannel_{wtChannel},
-  lastMessage_{},
-  msgVector_{},
-  channelMutex_{},
-  channelCondition_{}
-{ }
+  ring_(roundCapacity(capacity)),
+  mask_{ring_.size() - 1},
+  head_{0},
+  totalBytes_{0},
+  budget_{std::make_shared<const ListenerBudget>()},
+  residentBytes_{sizeof(SynchronizedChannel) + ring_.size() * sizeof(ChannelEntryPtr)},
+  residentTotal_{nullptr},
+  lastActivity_{std::chrono::steady_clock::now().time_since_epoch().count()},
+  writerMutex_{},
+  publishMutex_{},
+  waitMutex_{},
+  channelCondition_{},
+  waiters_{0},
+  listenersMutex_{},
+  listeners_{std::make_shared<const std::vector<ChannelListener*>>()},
+  recent_{}
+{
+  // the cached history counts towards the channel's memory
+  recent_.setResizeListener([this](uint64_t delta) { addResidentBytes(delta); });
+}
 
 SynchronizedChannel::SynchronizedChannel(int channelId,
-                    const std::string& channelName): wtChannel_{} {
+                    const std::string& channelName,
+                    size_t capacity): SynchronizedChannel(WrongthinkChannel{}, capacity) {
   wtChannel_.set_channelid(channelId);
   wtChannel_.set_name(channelName);
 }
@@ -35,29 +144,215 @@ void SynchronizedChannel::sendMessage(const WrongthinkMessage& msg) {
 
 }
 
-void SynchronizedChannel::appendMessage(const WrongthinkMessage& msg) {
+uint64_t SynchronizedChannel::appendMessage(const WrongthinkMessage& msg) {
+  // copy & serialize before taking the lock, publishing is just a pointer swap
+  auto entry = std::make_shared<ChannelEntry>();
+  entry->msg = msg;
+  bool ownBuffer;
+  grpc::Status status = grpc::SerializationTraits<WrongthinkMessage>::Serialize(
+    entry->msg, &entry->payload, &ownBuffer);
+  if (!status.ok())
+    throw std::runtime_error("failed to serialize message: " + status.error_message());
+  uint64_t seq;
+  // released after unlocking, freeing the overwritten message isn't free
+  ChannelEntryPtr evicted;
   {
-    std::lock_guard<std::mutex> lock(channelMutex_);
-    msgVector_.push_back(msg);
-    lastMessage_ = msg;
+    std::lock_guard<std::mutex> lock(writerMutex_);
+    seq = head_.load() + 1;
+    entry->seq = seq;
+    entry->byteOffset = totalBytes_;
+    totalBytes_ += entry->payload.Length();
+    uint64_t added = entryBytes(*entry);
+    evicted = std::atomic_exchange(&ring_[seq & mask_],
+                                                   ChannelEntryPtr(std::move(entry)));
+    head_.store(seq);
+    // unsigned wrap around makes a shrink a negative delta
+    addResidentBytes(added - (evicted ? entryBytes(*evicted) : 0));
   }
-  channelCondition_.notify_all();
+  touch();
+  // only touch the wait mutex when a listener is actually parked
+  if (waiters_.load() > 0) {
+    std::lock_guard<std::mutex> lock(waitMutex_);
+    channelCondition_.notify_all();
+  }
+  // a listener may take its own locks in here, none of ours are held
+  std::shared_ptr<const std::vector<ChannelListener*>> listeners = std::atomic_load(&listeners_);
+  for (ChannelListener* listener : *listeners)
+    listener->onMessageAvailable();
+  return seq;
+}
+
+uint64_t SynchronizedChannel::publishMessage(const WrongthinkMessage& msg,
+    const std::function<bool(const WrongthinkMessage&)>& persist) {
+  std::lock_guard<std::mutex> lock(publishMutex_);
+  if (!persist(msg))
+    return 0;
+  return appendMessage(msg);
+}
+
+bool SynchronizedChannel::serveRecent(const MessagePage& page,
+                                      std::vector<WrongthinkMessage>& out) {
+  std::vector<WrongthinkMessage> committed;
+  uint64_t settled;
+  if (!recent_.serve(page, committed, settled))
+    return false;
+  // settled counts the channel's messages the writer is done with, every
+  // message after it in the ring is still queued. a commit landing before
+  // its append pushes settled past the head, that message is cached already
+  std::vector<ChannelEntryPtr> queued;
+  uint64_t cursor = settled;
+  if (readMessages(cursor, queued) > 0)
+    return false;
+
+  size_t limit = static_cast<size_t>(page.limit);
+  if (page.anchor == MessagePage::Anchor::NEWEST) {
+    // the queued messages are the newest ones
+    size_t skip = queued.size() > limit ? queued.size() - limit : 0;
+    size_t keep = std::min(committed.size(), limit - (queued.size() - skip));
+    out.insert(out.end(), committed.end() - keep, committed.end());
+    for (size_t i = skip; i < queued.size(); i++)
+      out.push_back(queued[i]->msg);
+  } else {
+    // an after id page only gets to the queued messages past the cache
+    out.insert(out.end(), committed.begin(), committed.end());
+    for (size_t i = 0; i < queued.size() && committed.size() + i < limit; i++)
+      out.push_back(queued[i]->msg);
+  }
+  return true;
 }
 
 WrongthinkMessage SynchronizedChannel::lastMessage() {
-  std::lock_guard<std::mutex> lock(channelMutex_);
-  return lastMessage_;
+  ChannelEntryPtr entry = loadSlot(head_.load());
+  return entry ? entry->msg : WrongthinkMessage{};
+}
+
+void SynchronizedChannel::setMessageId(uint64_t seq, int messageid) {
+  ChannelEntryPtr entry = loadSlot(seq);
+  if (entry && entry->seq == seq)
+    entry->messageid.store(messageid);
+}
+
+std::vector<ChannelEntryPtr> SynchronizedChannel::getMessages() {
+  uint64_t head = head_.load();
+  uint64_t cursor = head > ring_.size() ? head - ring_.size() : 0;
+  std::vector<ChannelEntryPtr> entries;
+  entries.reserve(head - cursor);
+  readMessages(cursor, entries);
+  return entries;
+}
+
+size_t SynchronizedChannel::readMessages(uint64_t& cursor,
+                                         std::vector<ChannelEntryPtr>& out,
+                                         size_t max) {
+  const uint64_t capacity = ring_.size();
+  uint64_t head = head_.load();
+  size_t lost = 0;
+  size_t count = 0;
+  while (cursor < head && count < max) {
+    if (head - cursor > capacity) {
+      // the oldest unread messages were already overwritten
+      lost += head - cursor - capacity;
+      cursor = head - capacity;
+    }
+    ChannelEntryPtr entry = loadSlot(cursor + 1);
+    if (!entry || entry->seq < cursor + 1)
+      break;
+    if (entry->seq > cursor + 1) {
+      // a publisher lapped us while we were reading, catch up & retry
+      head = head_.load();
+      continue;
+    }
+    out.push_back(std::move(entry));
+    ++cursor;
+    ++count;
+  }
+  return lost;
+}
+
+bool SynchronizedChannel::waitMessages(uint64_t cursor,
+                                       std::chrono::milliseconds timeout) {
+  if (head_.load() > cursor)
+    return true;
+  waiters_.fetch_add(1);
+  bool ready;
+  {
+    std::unique_lock<std::mutex> lock(waitMutex_);
+    ready = channelCondition_.wait_for(lock, timeout,
+      [this, cursor]() { return head_.load() > cursor; });
+  }
+  waiters_.fetch_sub(1);
+  return ready;
+}
+
+std::chrono::steady_clock::duration SynchronizedChannel::idleFor() const {
+  std::chrono::steady_clock::duration last(lastActivity_.load());
+  return std::chrono::steady_clock::now().time_since_epoch() - last;
+}
+
+void SynchronizedChannel::touch() {
+  lastActivity_.store(std::chrono::steady_clock::now().time_since_epoch().count());
+}
+
+void SynchronizedChannel::trackResidentBytes(std::shared_ptr<std::atomic<uint64_t>> total) {
+  residentTotal_ = std::move(total);
+  if (residentTotal_)
+    *residentTotal_ += residentBytes_.load();
+}
+
+void SynchronizedChannel::addResidentBytes(uint64_t delta) {
+  residentBytes_ += delta;
+  if (residentTotal_)
+    *residentTotal_ += delta;
+}
+
+void SynchronizedChannel::setListenerBudget(const ListenerBudget& budget) {
+  std::atomic_store(&budget_, std::make_shared<const ListenerBudget>(budget));
+}
+
+ListenerBudget SynchronizedChannel::listenerBudget() const {
+  return *std::atomic_load(&budget_);
+}
+
+void SynchronizedChannel::replaceListeners(
+    std::shared_ptr<const std::vector<ChannelListener*>> listeners) {
+  std::shared_ptr<const std::vector<ChannelListener*>> replaced =
+    std::atomic_exchange(&listeners_, std::move(listeners));
+  // publishers that loaded the replaced list may still be notifying from it,
+  // new ones only see the current list. every change drains the list it
+  // replaced, so no older one is left
+  while (replaced.use_count() > 1)
+    std::this_thread::yield();
+  std::atomic_thread_fence(std::memory_order_acquire);
+}
+
+void SynchronizedChannel::addListener(ChannelListener* listener) {
+  std::lock_guard<std::mutex> lock(listenersMutex_);
+  auto listeners = std::make_shared<std::vector<ChannelListener*>>(*std::atomic_load(&listeners_));
+  listeners->push_back(listener);
+  replaceListeners(std::move(listeners));
+  touch();
+}
+
+void SynchronizedChannel::removeListener(ChannelListener* listener) {
+  std::lock_guard<std::mutex> lock(listenersMutex_);
+  auto listeners = std::make_shared<std::vector<ChannelListener*>>(*std::atomic_load(&listeners_));
+  auto it = std::find(listeners->begin(), listeners->end(), listener);
+  if (it != listeners->end()) {
+    *it = listeners->back();
+    listeners->pop_back();
+    replaceListeners(std::move(listeners));
+  }
+  touch();
 }
 
-std::vector<WrongthinkMessage> SynchronizedChannel::getMessages() {
-  std::lock_guard<std::mutex> lock(channelMutex_);
-  return msgVector_;
+size_t SynchronizedChannel::listenerCount() {
+  return std::atomic_load(&listeners_)->size();
 }
 
-WrongthinkMessage SynchronizedChannel::waitMessage() {
-  std::unique_lock<std::mutex> lock(channelMutex_);
-  channelCondition_.wait(lock);
-  return lastMessage_;
+ChannelEntryPtr SynchronizedChannel::loadSlot(uint64_t seq) const {
+  if (seq == 0)
+    return nullptr;
+  return std::atomic_load(&ring_[seq & mask_]);
 }
 
 bool SynchronizedChannel::operator==(const SynchronizedChannel& sch) {
@@ -15,34 +15,214 @@ See the GNU Affero General Public License for more details.
 You should have received a copy of the GNU Affero General Public License along with this program.
 If not, see <https://www.gnu.org/licenses/>.
 */
+#ifndef SYNCHRONIZED_CHANNEL_H
+#define SYNCHRONIZED_CHANNEL_H
+
 #include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
 #include <string>
 #include <vector>
+#include <cstdint>
+#include <functional>
 #include <condition_variable>
 
 #include "wrongthink.grpc.pb.h"
+#include "RecentMessages.h"
+
+/* a message published to a channel. entries are immutable once published &
+   are shared by the ring buffer, history snapshots & every listener. payload
+   holds msg serialized once at publish time, listeners write that ref-counted
+   buffer instead of serializing msg again per stream */
+struct ChannelEntry {
+  uint64_t seq;
+  // payload bytes published to the channel before this entry
+  uint64_t byteOffset;
+  WrongthinkMessage msg;
+  grpc::ByteBuffer payload;
+  // id the writer committed msg under, 0 until then. msg itself stays
+  // untouched, listeners already got its payload
+  mutable std::atomic<int> messageid{0};
+};
+
+using ChannelEntryPtr = std::shared_ptr<const ChannelEntry>;
+
+/* what to do with a listener whose unsent backlog exceeds its budget */
+enum class SlowConsumerPolicy {
+  // discard the oldest queued messages until the backlog fits
+  DROP_OLDEST,
+  // discard the whole backlog & send a gap marker, the client refetches
+  // the missed range with GetWrongthinkMessages
+  GAP,
+  // end the stream with RESOURCE_EXHAUSTED
+  DISCONNECT
+};
+
+/* per listener limits on messages published but not yet written */
+struct ListenerBudget {
+  size_t maxMessages = 256;
+  size_t maxBytes = 1 << 20;
+  SlowConsumerPolicy policy = SlowConsumerPolicy::GAP;
+};
+
+/* "gap", "drop_oldest" or "disconnect", throws on anything else */
+SlowConsumerPolicy parseSlowConsumerPolicy(const std::string& name);
+
+/* what a listener has to do after applyListenerBudget() */
+enum class BudgetAction {
+  // write what is left of the backlog
+  KEEP,
+  // write a gap marker instead of the discarded backlog
+  GAP,
+  // end the stream
+  DISCONNECT
+};
 
+/* applies budget to a listener's unsent backlog pending[pos..], lost more
+   messages were overwritten in the ring before the listener read them.
+   DROP_OLDEST advances pos until the backlog fits, GAP clears the backlog.
+   discarded is set to the number of messages the listener misses, storedId
+   to the id of the newest discarded message already committed, 0 if none is */
+BudgetAction applyListenerBudget(const ListenerBudget& budget,
+                                 std::vector<ChannelEntryPtr>& pending,
+                                 size_t& pos, size_t lost, uint64_t& discarded,
+                                 int& storedId);
+inline BudgetAction applyListenerBudget(const ListenerBudget& budget,
+                                        std::vector<ChannelEntryPtr>& pending,
+                                        size_t& pos, size_t lost, uint64_t& discarded) {
+  int storedId;
+  return applyListenerBudget(budget, pending, pos, lost, discarded, storedId);
+}
+
+/* uname carried by gap markers, real user names can't contain ':' */
+constexpr const char* GAP_MARKER_UNAME = "wrongthink:gap";
+
+/* ':' is reserved for server generated names like GAP_MARKER_UNAME, users
+   can neither register nor send under such a name */
+inline bool isReservedUserName(const std::string& uname) {
+  return uname.find(':') != std::string::npos;
+}
+
+/* builds the marker telling a listener that skipped messages were discarded,
+   text holds the number of discarded messages & messageid the id of the
+   newest one already committed, 0 if none is */
+WrongthinkMessage makeGapMarker(int channelid, uint64_t skipped, int messageid);
+
+/* implemented by listeners that want to be woken up when a message is
+   published instead of parking a thread in waitMessages() */
+class ChannelListener {
+public:
+  virtual ~ChannelListener() {}
+  /* called on the publishing thread, must not block */
+  virtual void onMessageAvailable() = 0;
+};
+
+/*
+ * Bounded per-channel message ring. Every published message is assigned a
+ * sequence number (starting at 1), listeners keep their own cursor (the last
+ * sequence number they consumed) & drain everything after it without taking
+ * the writer lock. A listener that falls more than capacity messages behind
+ * is moved forward & told how many messages it lost.
+ */
 class SynchronizedChannel {
 public:
-  SynchronizedChannel(const WrongthinkChannel& wtChannel);
-  SynchronizedChannel() { }
+  static constexpr size_t DEFAULT_CAPACITY = 1024;
+
+  SynchronizedChannel(const WrongthinkChannel& wtChannel,
+                      size_t capacity = DEFAULT_CAPACITY);
+  SynchronizedChannel() : SynchronizedChannel(WrongthinkChannel{}) { }
   SynchronizedChannel(int channelId,
-                      const std::string& channelName);
+                      const std::string& channelName,
+                      size_t capacity = DEFAULT_CAPACITY);
   const WrongthinkChannel& getChannel() const { return wtChannel_; }
-  void appendMessage(const WrongthinkMessage& msg);
+  /* publishes msg, returns its sequence number */
+  uint64_t appendMessage(const WrongthinkMessage& msg);
+  /* publishes msg once persist, which queues it for the database, accepted
+     it. both run under one lock so the ring holds the channel's messages in
+     the order the writer commits them. returns the sequence number, 0 if
+     persist refused msg */
+  uint64_t publishMessage(const WrongthinkMessage& msg,
+                          const std::function<bool(const WrongthinkMessage&)>& persist);
   void sendMessage(const WrongthinkMessage& msg);
   WrongthinkMessage lastMessage();
-  std::vector<WrongthinkMessage> getMessages();
-  WrongthinkMessage waitMessage();
+  /* snapshot of the messages currently held in the ring, oldest first */
+  std::vector<ChannelEntryPtr> getMessages();
+  /* sequence number of the newest message, 0 if nothing was published yet */
+  uint64_t headSeq() const { return head_.load(); }
+  size_t capacity() const { return ring_.size(); }
+  /* approximate memory held by the channel, the messages in its ring & the
+     recent message cache */
+  uint64_t residentBytes() const { return residentBytes_.load(); }
+  /* mirrors every change of residentBytes() into total, call before the
+     channel is shared. total is shared so a channel outliving its registry
+     never writes to freed memory */
+  void trackResidentBytes(std::shared_ptr<std::atomic<uint64_t>> total);
+  /* time since the last publish or listener (un)registration */
+  std::chrono::steady_clock::duration idleFor() const;
+  void setListenerBudget(const ListenerBudget& budget);
+  ListenerBudget listenerBudget() const;
+  /* records the id the writer committed the message with sequence number
+     seq under, a no-op once it left the ring */
+  void setMessageId(uint64_t seq, int messageid);
+  /* persisted tail of the channel's history, see GetWrongthinkMessages */
+  RecentMessages& recentMessages() { return recent_; }
+  /* serves a NEWEST or AFTER_ID page from memory, the cached history
+     followed by the messages published but not committed yet. those have
+     no messageid yet, like on a listen stream. returns false if the page
+     reaches past the cache or the ring, only lines up when every message
+     went through publishMessage() */
+  bool serveRecent(const MessagePage& page, std::vector<WrongthinkMessage>& out);
+  /* appends up to max entries newer than cursor to out & advances cursor past
+     them. returns the number of messages that were overwritten before they
+     could be read */
+  size_t readMessages(uint64_t& cursor, std::vector<ChannelEntryPtr>& out,
+                      size_t max = SIZE_MAX);
+  /* blocks until a message newer than cursor exists or the timeout expires,
+     returns true if there is something to read */
+  bool waitMessages(uint64_t cursor, std::chrono::milliseconds timeout);
+  /* registered listeners are notified after every append, outside of any
+     channel lock. once removeListener() returns the listener is no longer
+     referenced. neither may be called from onMessageAvailable() */
+  void addListener(ChannelListener* listener);
+  void removeListener(ChannelListener* listener);
+  size_t listenerCount();
   bool operator==(const SynchronizedChannel& sch);
   bool operator==(const WrongthinkChannel& sch);
   bool operator<(const SynchronizedChannel& sch);
   bool operator<(const WrongthinkChannel& sch);
 
 private:
+  ChannelEntryPtr loadSlot(uint64_t seq) const;
+  void addResidentBytes(uint64_t delta);
+  void touch();
+  /* installs listeners & waits until no publisher reads the replaced list,
+     called with listenersMutex_ held */
+  void replaceListeners(std::shared_ptr<const std::vector<ChannelListener*>> listeners);
+
   WrongthinkChannel wtChannel_;
-  WrongthinkMessage lastMessage_;
-  std::vector<WrongthinkMessage> msgVector_;
-  std::mutex channelMutex_;
+  std::vector<ChannelEntryPtr> ring_;
+  uint64_t mask_;
+  std::atomic<uint64_t> head_;
+  // payload bytes published so far, guarded by writerMutex_
+  uint64_t totalBytes_;
+  std::shared_ptr<const ListenerBudget> budget_;
+  std::atomic<uint64_t> residentBytes_;
+  std::shared_ptr<std::atomic<uint64_t>> residentTotal_;
+  std::atomic<std::chrono::steady_clock::rep> lastActivity_;
+  // serializes publishers only, readers never take it
+  std::mutex writerMutex_;
+  // keeps the writer's queue & the ring in the same order
+  std::mutex publishMutex_;
+  // only used to park listeners with nothing to read
+  std::mutex waitMutex_;
   std::condition_variable channelCondition_;
+  std::atomic<int> waiters_;
+  // serializes listener changes. publishers notify from a snapshot of
+  // listeners_, which is copied on every change, without taking it
+  std::mutex listenersMutex_;
+  std::shared_ptr<const std::vector<ChannelListener*>> listeners_;
+  RecentMessages recent_;
 };
+
+#endif // SYNCHRONIZED_CHANNEL_H
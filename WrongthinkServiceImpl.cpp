@@ -21,32 +21,96 @@ If not, see <https://www.gnu.org/licenses/>.
 #include "boost/stacktrace.hpp"
 #include "WrongthinkServiceImpl.h"
 #include "Authentication/WrongthinkTokenAuthenticator.h"
+#include <map>
 #include <memory>
 
+namespace {
+
+/* writes everything with the buffer hint but the last message, which
+   flushes the lot in as few frames as possible */
+template<typename T>
+bool writeAll(ServerWriterWrapper<T>* writer, const std::vector<T>& items) {
+  for (size_t i = 0; i < items.size(); i++) {
+    grpc::WriteOptions options;
+    if (i + 1 < items.size())
+      options.set_buffer_hint();
+    if (!writer->Write(items[i], options))
+      return false;
+  }
+  return true;
+}
+
+}
+
 WrongthinkServiceImpl::WrongthinkServiceImpl( const std::shared_ptr<DBInterface> db,
-                                              const std::shared_ptr<spdlog::logger> logger) :
-  db{ db }, logger{ logger }
+                                              const std::shared_ptr<spdlog::logger> logger,
+                                              const WrongthinkServiceOptions& options) :
+  db{ db }, logger{ logger },
+  channels{ [this](int channelid, WrongthinkChannel& channel) {
+    return loadChannel(channelid, channel);
+  } },
+  historyCompression{ options.historyCompression },
+  directoryCompression{ options.directoryCompression },
+  dbExecutor{ "db", options.historyThreads },
+  messageWriter{ std::make_unique<MessageWriter>(db, logger, MessageWriterOptions{},
+    [this](const std::vector<MessageRow>& rows) { onMessagesCommitted(rows); }) },
+  unaryExecutor{ "unary", options.unaryThreads, options.unaryQueue }
 {
+  channels.setListenerBudget(options.listenerBudget);
+}
 
+ServerUnaryReactor* WrongthinkServiceImpl::runUnary(CallbackServerContext* context,
+  std::function<Status()> work) {
+  ServerUnaryReactor* reactor = context->DefaultReactor();
+  bool queued = unaryExecutor.trySubmit([context, reactor, work = std::move(work)]() {
+    // the client may have gone away while the call sat in the queue
+    if (context->IsCancelled()) {
+      reactor->Finish(Status::CANCELLED);
+      return;
+    }
+    Status status;
+    try {
+      status = work();
+    } catch (const std::exception& e) {
+      std::cout << e.what() << std::endl;
+      std::cout << boost::stacktrace::stacktrace();
+      status = Status(StatusCode::INTERNAL, "");
+    }
+    reactor->Finish(status);
+  });
+  if (!queued)
+    reactor->Finish(Status(StatusCode::RESOURCE_EXHAUSTED, "server busy"));
+  return reactor;
 }
 
-Status WrongthinkServiceImpl::BanUser(ServerContext* context, const BanUserRequest* request,
-  GenericResponse* response) {
+ServerUnaryReactor* WrongthinkServiceImpl::BanUser(CallbackServerContext* context,
+  const BanUserRequest* request, GenericResponse* response) {
+  logger->debug("enter BanUser()");
+  logger->debug("client metadata:");
+  auto meta = context->client_metadata();
+  for(auto& it : meta) {
+    // grpc::string_ref, what a useful class
+    auto strf = it.first;
+    auto strf1 = it.second;
+    std::string s1(strf.data(), strf.length());
+    std::string s2(strf1.data(), strf1.length());
+    logger->debug("{}: {}", s1, s2);
+  }
+  // metadata is only read here, the executor gets a copy of the creds
+  if (!WrongthinkTokenAuth::hasCredentials(context)) {
+    ServerUnaryReactor* reactor = context->DefaultReactor();
+    reactor->Finish(Status(StatusCode::UNAUTHENTICATED, "No credentials attached to the channel"));
+    return reactor;
+  }
+  auto creds = WrongthinkTokenAuth::getCredentials(context);
+  return runUnary(context, [this, creds, request, response]() {
+    return BanUserImpl(creds, request, response);
+  });
+}
+
+Status WrongthinkServiceImpl::BanUserImpl(const std::pair<std::string, std::string>& creds,
+  const BanUserRequest* request, GenericResponse* response) {
     try {
-      logger->debug("enter BanUser()");
-      logger->debug("client metadata:");
-      auto meta = context->client_metadata();
-      for(auto& it : meta) {
-        // grpc::string_ref, what a useful class
-        auto strf = it.first;
-        auto strf1 = it.second;
-        std::string s1(strf.data(), strf.length());
-        std::string s2(strf1.data(), strf1.length());
-        logger->debug("{}: {}", s1, s2);
-      }
-      if (!WrongthinkTokenAuth::hasCredentials(context))
-        return Status(StatusCode::UNAUTHENTICATED, "No credentials attached to the channel");
-      auto creds = WrongthinkTokenAuth::getCredentials(context);
       if (!db->isUserValid(creds.first, creds.second))
         return Status(StatusCode::UNAUTHENTICATED, "Invalid user");
       if (!db->isUserAdmin(creds.first))
@@ -61,7 +125,14 @@ Status WrongthinkServiceImpl::BanUser(ServerContext* context, const BanUserReque
     return Status::OK;
 }
 
-Status WrongthinkServiceImpl::GenerateUser(ServerContext* context, const GenericRequest* request,
+ServerUnaryReactor* WrongthinkServiceImpl::GenerateUser(CallbackServerContext* context,
+  const GenericRequest* request, WrongthinkUser* response) {
+  return runUnary(context, [this, request, response]() {
+    return GenerateUserImpl(request, response);
+  });
+}
+
+Status WrongthinkServiceImpl::GenerateUserImpl(const GenericRequest* request,
   WrongthinkUser* response) {
   try {
     (void)request;
@@ -95,22 +166,22 @@ Status WrongthinkServiceImpl::GenerateUser(ServerContext* context, const Generic
 
 /* needed to make the rpc function testable */
 Status WrongthinkServiceImpl::GetWrongthinkCommunitiesImpl(const GetWrongthinkCommunitiesRequest* request,
-  ServerWriterWrapper<WrongthinkCommunity>* writer) {
+  ServerWriterWrapper<WrongthinkCommunity>* writer, DirectorySync* sync) {
   try {
     // not using request data yet
     (void)request;
 
-    soci::session sql = db->getSociSession();
-    rowset<row> rs = db->getCommunityRowset( sql );
-
-    for (rowset<row>::const_iterator it = rs.begin(); it != rs.end(); ++it) {
-      WrongthinkCommunity community;
-      row const& row = *it;
-      community.set_communityid(row.get<int>(0));
-      community.set_name(row.get<std::string>(1));
-      community.set_unameadmin(row.get<std::string>(5));
-      writer->Write(community);
-    }
+    DirectorySync full;
+    if (!sync)
+      sync = &full;
+    std::vector<WrongthinkCommunity> communities;
+    sync->result = directory.communities(sync->known,
+      [this](std::vector<WrongthinkCommunity>& out) {
+        DBSession sql = db->getReadSession("communities");
+        db->getCommunities(sql, out);
+      }, communities, sync->version);
+
+    writeAll(writer, communities);
   } catch (const std::exception& e) {
     std::cout << e.what() << std::endl;
     std::cout << boost::stacktrace::stacktrace();
@@ -123,37 +194,44 @@ Status WrongthinkServiceImpl::GetWrongthinkCommunitiesImpl(const GetWrongthinkCo
 Status WrongthinkServiceImpl::GetWrongthinkCommunities(ServerContext* context,
   const GetWrongthinkCommunitiesRequest* request,
   ServerWriter<WrongthinkCommunity>* writer) {
-    (void)context;
     ServerWriterWrapper<WrongthinkCommunity> wrapper(writer);
-    return GetWrongthinkCommunitiesImpl(request, &wrapper);
+    directoryCompression.apply(context);
+    wrapper.setCompression(directoryCompression, &directoryCompressed);
+    DirectorySync sync;
+    sync.known = directoryVersion(context);
+    Status st = GetWrongthinkCommunitiesImpl(request, &wrapper, &sync);
+    if (st.ok())
+      addDirectoryTrailers(context, sync);
+    return st;
 }
 
 Status WrongthinkServiceImpl::GetWrongthinkChannels(ServerContext* context,
   const GetWrongthinkChannelsRequest* request,
   ServerWriter<WrongthinkChannel>* writer) {
-  (void)context;
   ServerWriterWrapper<WrongthinkChannel> wrapper(writer);
-  return GetWrongthinkChannelsImpl(request, &wrapper);
+  directoryCompression.apply(context);
+  wrapper.setCompression(directoryCompression, &directoryCompressed);
+  DirectorySync sync;
+  sync.known = directoryVersion(context);
+  Status st = GetWrongthinkChannelsImpl(request, &wrapper, &sync);
+  if (st.ok())
+    addDirectoryTrailers(context, sync);
+  return st;
 }
 
 Status WrongthinkServiceImpl::GetWrongthinkChannelsImpl(const GetWrongthinkChannelsRequest* request,
-  ServerWriterWrapper<WrongthinkChannel>* writer) {
+  ServerWriterWrapper<WrongthinkChannel>* writer, DirectorySync* sync) {
   try {
     int community = request->communityid();
 
-    soci::session sql = db->getSociSession();
-    rowset<row> rs = db->getCommunityChannelsRowset(sql, community);
-
-    for (rowset<row>::const_iterator it = rs.begin(); it != rs.end(); ++it) {
-      WrongthinkChannel channel;
-      row const& row = *it;
-      channel.set_channelid(row.get<int>(0));
-      channel.set_name(row.get<std::string>(1));
-      channel.set_anonymous(row.get<int>(2));
-      channel.set_communityid(community);
-      channel.set_unameadmin(row.get<std::string>(6));
-      writer->Write(channel);
-    }
+    DirectorySync full;
+    if (!sync)
+      sync = &full;
+    std::vector<WrongthinkChannel> channelList;
+    sync->result = directory.channels(community, sync->known, channelLoader(community),
+      channelList, sync->version);
+
+    writeAll(writer, channelList);
   } catch (const std::exception& e) {
     std::cout << e.what() << std::endl;
     std::cout << boost::stacktrace::stacktrace();
@@ -162,9 +240,15 @@ Status WrongthinkServiceImpl::GetWrongthinkChannelsImpl(const GetWrongthinkChann
   return Status::OK;
 }
 
-Status WrongthinkServiceImpl::CreateWrongthinkChannel(ServerContext* context,
+ServerUnaryReactor* WrongthinkServiceImpl::CreateWrongthinkChannel(CallbackServerContext* context,
+  const CreateWrongThinkChannelRequest* request, WrongthinkChannel* response) {
+  return runUnary(context, [this, request, response]() {
+    return CreateWrongthinkChannelImpl(request, response);
+  });
+}
+
+Status WrongthinkServiceImpl::CreateWrongthinkChannelImpl(
   const CreateWrongThinkChannelRequest* request, WrongthinkChannel* response) {
-  (void)context;
   try {
     int channelid = 0;
     int community = request->communityid();
@@ -173,6 +257,7 @@ Status WrongthinkServiceImpl::CreateWrongthinkChannel(ServerContext* context,
     int admin = request->adminid();
 
     channelid = db->createChannel( name, community, admin, anonymous );
+    directory.invalidateChannels(community);
 
     response->set_channelid(channelid);
   } catch (const std::exception& e) {
@@ -183,7 +268,14 @@ Status WrongthinkServiceImpl::CreateWrongthinkChannel(ServerContext* context,
   return Status::OK;
 }
 
-Status WrongthinkServiceImpl::CreateWrongthinkCommunity(ServerContext* context,
+ServerUnaryReactor* WrongthinkServiceImpl::CreateWrongthinkCommunity(CallbackServerContext* context,
+  const CreateWrongthinkCommunityRequest* request, WrongthinkCommunity* response) {
+  return runUnary(context, [this, request, response]() {
+    return CreateWrongthinkCommunityImpl(request, response);
+  });
+}
+
+Status WrongthinkServiceImpl::CreateWrongthinkCommunityImpl(
   const CreateWrongthinkCommunityRequest* request, WrongthinkCommunity* response) {
   try {
     int communityid = 0;
@@ -192,6 +284,7 @@ Status WrongthinkServiceImpl::CreateWrongthinkCommunity(ServerContext* context,
     int pub = request->public_();
 
     communityid = db->createCommunity( name, admin, pub );
+    directory.invalidateCommunities();
 
     response->set_communityid(communityid);
   } catch (const std::exception& e) {
@@ -202,22 +295,27 @@ Status WrongthinkServiceImpl::CreateWrongthinkCommunity(ServerContext* context,
   return Status::OK;
 }
 
-Status WrongthinkServiceImpl::SendWrongthinkMessageWeb(ServerContext* context,
+ServerUnaryReactor* WrongthinkServiceImpl::SendWrongthinkMessageWeb(CallbackServerContext* context,
   const WrongthinkMessage* msg, WrongthinkMeta* response) {
+  return runUnary(context, [this, msg, response]() {
+    return SendWrongthinkMessageWebImpl(msg, response);
+  });
+}
+
+Status WrongthinkServiceImpl::SendWrongthinkMessageWebImpl(const WrongthinkMessage* msg,
+  WrongthinkMeta* response) {
   try {
-    int channelid = msg->channelid();
-    int user_id = msg->userid();
-    int thread_id = msg->threadid();
-    int thread_child = msg->threadchild();
-    std::string text = msg->text();
-    soci::session sql = db->getSociSession();
-    if(!checkForChannel(msg->channelid(), sql))
+    if (isReservedUserName(msg->uname()))
+      return Status(StatusCode::INVALID_ARGUMENT, "reserved user name");
+    ChannelRegistry::ChannelPtr channel = channels.get(msg->channelid());
+    if(!channel)
       return Status(StatusCode::INVALID_ARGUMENT, "");
-    channelMap[msg->channelid()].appendMessage(*msg);
-    sql << "insert into message(user_id,channel,thread_id,thread_child, mtext)"
-        << " values(:user_id,:channel,:thread_id,:thread_child,:text)",
-        use(user_id), use(channelid), use(thread_id), use(thread_child),
-        use(text);
+    // the server clock is authoritative, listeners & the db see the same date
+    WrongthinkMessage stamped(*msg);
+    stamped.set_date(std::time(nullptr));
+    // only messages the writer accepted go out live
+    if (!channel->publishMessage(stamped, persistMessage()))
+      return Status(StatusCode::RESOURCE_EXHAUSTED, "message queue full");
   } catch (const std::exception& e) {
     std::cout << e.what() << std::endl;
     std::cout << boost::stacktrace::stacktrace();
@@ -237,28 +335,22 @@ Status WrongthinkServiceImpl::SendWrongthinkMessageImpl(ServerReaderWrapper< Wro
   WrongthinkMeta* response) {
   (void) response;
   WrongthinkMessage msg;
+  ChannelRegistry::ChannelPtr channel;
   try {
-    soci::session sql = db->getSociSession();
-    int channelid = 0;
-    int user_id = 0;
-    int thread_id = 0;
-    int thread_child = 0;
-    std::string text;
-    statement st = (sql.prepare <<
-              "insert into message(user_id,channel,thread_id,thread_child, mtext)"
-              <<" values(:user_id,:channel,:thread_id,:thread_child,:text)",
-              use(user_id), use(channelid), use(thread_id), use(thread_child),
-              use(text));
     while (reader->Read(&msg)) {
-      channelid = msg.channelid();
-      user_id = msg.userid();
-      thread_id = msg.threadid();
-      thread_child = msg.threadchild();
-      text = msg.text();
-      if(!checkForChannel(msg.channelid(), sql))
+      if (isReservedUserName(msg.uname()))
+        return Status(StatusCode::INVALID_ARGUMENT, "reserved user name");
+      int channelid = msg.channelid();
+      // streams usually stick to one channel, skip the lookup when they do
+      if (!channel || channel->getChannel().channelid() != channelid)
+        channel = channels.get(channelid);
+      if(!channel)
         return Status(StatusCode::INVALID_ARGUMENT, "");
-      channelMap[msg.channelid()].appendMessage(msg);
-      st.execute(true);
+      msg.set_date(std::time(nullptr));
+      // only messages the writer accepted go out live, the stream ends at
+      // the first one it refuses
+      if (!channel->publishMessage(msg, persistMessage()))
+        return Status(StatusCode::RESOURCE_EXHAUSTED, "message queue full");
     }
   } catch (const std::exception& e) {
     std::cout << e.what() << std::endl;
@@ -268,34 +360,60 @@ Status WrongthinkServiceImpl::SendWrongthinkMessageImpl(ServerReaderWrapper< Wro
   return Status::OK;
 }
 
-Status WrongthinkServiceImpl::ListenWrongthinkMessages(ServerContext* context,
-  const ListenWrongthinkMessagesRequest* request,
-  ServerWriter< WrongthinkMessage>* writer) {
-  (void) context;
-  ServerWriterWrapper< WrongthinkMessage> wrapper(writer);
-  return ListenWrongthinkMessagesImpl(request, &wrapper);
+ServerWriteReactor< grpc::ByteBuffer>* WrongthinkServiceImpl::ListenWrongthinkMessages(
+  CallbackServerContext* context,
+  const grpc::ByteBuffer* request) {
+  return listen(context, request, false);
 }
 
-/* needed to make the rpc function testable */
-Status WrongthinkServiceImpl::ListenWrongthinkMessagesImpl(const ListenWrongthinkMessagesRequest* request,
-  ServerWriterWrapper< WrongthinkMessage>* writer) {
-  soci::session sql = db->getSociSession();
-  int channelid = request->channelid();
-  int count = 0;
-  if (!checkForChannel(channelid, sql))
-    return Status(StatusCode::INVALID_ARGUMENT, "");
-  SynchronizedChannel& channel = channelMap[request->channelid()];
-  while (true) {
-    writer->Write(channel.waitMessage());
+ServerWriteReactor< grpc::ByteBuffer>* WrongthinkServiceImpl::ListenWrongthinkMessageBatches(
+  CallbackServerContext* context,
+  const grpc::ByteBuffer* request) {
+  return listen(context, request, true);
+}
+
+ServerWriteReactor< grpc::ByteBuffer>* WrongthinkServiceImpl::listen(CallbackServerContext* context,
+  const grpc::ByteBuffer* request, bool batched) {
+  // live messages go out as soon as they arrive, never compressed
+  context->set_compression_level(GRPC_COMPRESS_LEVEL_NONE);
+  // the reactor deletes itself once grpc is done with the stream
+  ChannelListenReactor* reactor = new ChannelListenReactor(logger, listenBatching, batched);
+  // raw method, deserialize the request ourselves (Deserialize consumes the buffer)
+  grpc::ByteBuffer buffer(*request);
+  ListenWrongthinkMessagesRequest req;
+  if (!grpc::SerializationTraits<ListenWrongthinkMessagesRequest>::Deserialize(&buffer, &req).ok()) {
+    reactor->attach(nullptr);
+    return reactor;
   }
-  return Status::OK;
+  int channelid = req.channelid();
+  if (ChannelRegistry::ChannelPtr channel = channels.find(channelid)) {
+    reactor->attach(channel);
+    return reactor;
+  }
+  // loading the channel hits the database, keep it off the callback thread
+  bool queued = dbExecutor.trySubmit([this, reactor, channelid]() {
+    ChannelRegistry::ChannelPtr channel;
+    try {
+      channel = channels.get(channelid);
+    } catch (const std::exception& e) {
+      std::cout << e.what() << std::endl;
+      std::cout << boost::stacktrace::stacktrace();
+      reactor->abandon(Status(StatusCode::INTERNAL, ""));
+      return;
+    }
+    reactor->attach(channel);
+  });
+  if (!queued)
+    reactor->abandon(Status(StatusCode::RESOURCE_EXHAUSTED, "server busy"));
+  return reactor;
 }
 
 Status WrongthinkServiceImpl::GetWrongthinkMessages(ServerContext* context,
   const GetWrongthinkMessagesRequest* request,
   ServerWriter< WrongthinkMessage>* writer) {
-  (void)context;
   ServerWriterWrapper< WrongthinkMessage> wrapper(writer);
+  historyCompression.apply(context);
+  wrapper.setCompression(historyCompression, &historyCompressed);
   return GetWrongthinkMessagesImpl(request, &wrapper);
 }
 
@@ -307,25 +425,50 @@ Status WrongthinkServiceImpl::GetWrongthinkMessagesImpl(const GetWrongthinkMessa
   int afterid = request->afterid();
   int afterdate = request->afterdate();
   try {
+    // the request has no before field, a negative limit pages backwards
+    // from afterid instead
+    MessagePage page;
+    // clamp before negating, -INT_MIN overflows
+    if (limit == 0)
+      page.limit = DEFAULT_MESSAGE_PAGE;
+    else if (limit < 0)
+      page.limit = limit < -MAX_MESSAGE_PAGE ? MAX_MESSAGE_PAGE : -limit;
+    else
+      page.limit = std::min(limit, MAX_MESSAGE_PAGE);
+    if (afterid > 0) {
+      page.anchor = limit < 0 ? MessagePage::Anchor::BEFORE_ID : MessagePage::Anchor::AFTER_ID;
+      page.key = afterid;
+    } else if (afterdate > 0) {
+      page.anchor = MessagePage::Anchor::AFTER_DATE;
+      page.key = afterdate;
+    }
 
-    soci::session sql = db->getSociSession();
-    rowset<row> rs = db->getChannelMessages(sql, channelid);
-
-    for (rowset<row>::const_iterator it = rs.begin(); it != rs.end(); ++it) {
-      row const& row = *it;
-      WrongthinkMessage msg;
-      msg.set_uname(row.get<std::string>("uname"));
-      msg.set_channelid(channelid);
-      msg.set_userid(row.get<int>("user_id"));
-      msg.set_threadid(row.get<int>("thread_id"));
-      msg.set_threadchild(row.get<int>("thread_child"));
-      msg.set_edited(row.get<int>("edited"));
-      msg.set_text(row.get<std::string>("mtext"));
-      //msg tm = row.get<int>("mdate");
-      msg.set_date(row.get<int>("mdate"));
-      msg.set_messageid(row.get<int>("msg_id"));
-      writer->Write(msg);
+    // the latest & after id pages of a resident channel come from memory,
+    // including what is still queued for the database. paging through old
+    // history neither loads the channel nor warms its cache, only listened
+    // channels & newest pages do
+    ChannelRegistry::ChannelPtr channel = channels.find(channelid);
+    if (channel) {
+      RecentMessages& recent = channel->recentMessages();
+      if (page.anchor == MessagePage::Anchor::NEWEST || channel->listenerCount() > 0) {
+        recent.warm([this, channelid](int limit, std::vector<WrongthinkMessage>& out) {
+          MessagePage newest;
+          newest.limit = limit;
+          readHistory(channelid, newest, out);
+        });
+      }
+      std::vector<WrongthinkMessage> messages;
+      if (channel->serveRecent(page, messages)) {
+        writeAll(writer, messages);
+        return Status::OK;
+      }
     }
+    // read your writes, the page reaches past memory so anything still
+    // queued for this channel lands first. a page before an id can't
+    // contain queued messages
+    if (page.anchor != MessagePage::Anchor::BEFORE_ID)
+      messageWriter->flushChannel(channelid);
+    return streamHistory(channelid, page, writer);
   } catch (const std::exception& e) {
     std::cout << e.what() << std::endl;
     std::cout << boost::stacktrace::stacktrace();
@@ -334,10 +477,139 @@ Status WrongthinkServiceImpl::GetWrongthinkMessagesImpl(const GetWrongthinkMessa
   return Status::OK;
 }
 
-Status WrongthinkServiceImpl::CreateUser(ServerContext* context, const CreateUserRequest* request,
+Status WrongthinkServiceImpl::SearchMessages(ServerContext* context,
+  const SearchMessagesRequest* request,
+  ServerWriter< WrongthinkMessage>* writer) {
+  ServerWriterWrapper< WrongthinkMessage> wrapper(writer);
+  historyCompression.apply(context);
+  wrapper.setCompression(historyCompression, &historyCompressed);
+  return SearchMessagesImpl(request, &wrapper);
+}
+
+Status WrongthinkServiceImpl::SearchMessagesImpl(const SearchMessagesRequest* request,
+  ServerWriterWrapper< WrongthinkMessage>* writer) {
+  try {
+    // never falls back to scanning the message table
+    std::shared_ptr<MessageIndex> index = std::atomic_load(&searchIndex);
+    if (!index)
+      return Status(StatusCode::UNIMPLEMENTED, "search is disabled");
+
+    SearchQuery query;
+    query.text = request->text();
+    query.limit = request->limit() <= 0 ? DEFAULT_SEARCH_PAGE
+                                        : std::min(request->limit(), MAX_SEARCH_PAGE);
+    query.after.date = request->after().date();
+    query.after.channel = request->after().channelid();
+    query.after.id = request->after().messageid();
+    if (request->channelid() != 0) {
+      query.channels.push_back(request->channelid());
+    } else if (request->communityid() != 0) {
+      std::vector<WrongthinkChannel> channelList;
+      std::string version;
+      directory.channels(request->communityid(), "", channelLoader(request->communityid()),
+        channelList, version);
+      if (channelList.empty())
+        return Status::OK;
+      for (const WrongthinkChannel& channel : channelList)
+        query.channels.push_back(channel.channelid());
+    }
+
+    std::vector<SearchHit> hits;
+    index->search(query, hits);
+
+    // one read per channel, then back into rank order. hits hidden by
+    // retention come back without a message & are dropped
+    std::map<int, std::vector<int>> ids;
+    for (const SearchHit& hit : hits)
+      ids[hit.channel].push_back(hit.id);
+    std::vector<WrongthinkMessage> messages;
+    for (auto& channel : ids)
+      readMessages(channel.first, channel.second, messages);
+    std::sort(messages.begin(), messages.end(),
+      [](const WrongthinkMessage& a, const WrongthinkMessage& b) {
+        return SearchHit{a.date(), a.channelid(), a.messageid()} <
+               SearchHit{b.date(), b.channelid(), b.messageid()};
+      });
+
+    for (const WrongthinkMessage& msg : messages)
+      writer->Write(msg);
+  } catch (const std::exception& e) {
+    std::cout << e.what() << std::endl;
+    std::cout << boost::stacktrace::stacktrace();
+    return Status(StatusCode::INTERNAL, "");
+  }
+  return Status::OK;
+}
+
+void WrongthinkServiceImpl::setSearchIndex(std::shared_ptr<MessageIndex> index) {
+  std::atomic_store(&searchIndex, index);
+}
+
+void WrongthinkServiceImpl::indexBacklog() {
+  std::shared_ptr<MessageIndex> index = std::atomic_load(&searchIndex);
+  if (!index)
+    return;
+  // messages dated the newest persisted second may be in the index already,
+  // adding them again is harmless
+  int since = index->persistedThrough();
+
+  std::vector<WrongthinkCommunity> communities;
+  std::string version;
+  directory.communities("", [this](std::vector<WrongthinkCommunity>& out) {
+      DBSession sql = db->getReadSession("communities");
+      db->getCommunities(sql, out);
+    }, communities, version);
+  std::vector<WrongthinkMessage> messages;
+  std::vector<MessageRow> rows;
+  for (const WrongthinkCommunity& community : communities) {
+    std::vector<WrongthinkChannel> channelList;
+    directory.channels(community.communityid(), "", channelLoader(community.communityid()),
+      channelList, version);
+    for (const WrongthinkChannel& channel : channelList) {
+      MessagePage page;
+      page.anchor = MessagePage::Anchor::AFTER_DATE;
+      page.key = since - 1;
+      page.limit = MAX_MESSAGE_PAGE;
+      while (true) {
+        if (backlogStopped.load())
+          return;
+        messages.clear();
+        readHistory(channel.channelid(), page, messages);
+        rows.clear();
+        for (const WrongthinkMessage& msg : messages) {
+          MessageRow row{ msg.userid(), msg.channelid(), msg.threadid(), msg.threadchild(),
+                          msg.text(), msg.date() };
+          row.id = msg.messageid();
+          rows.push_back(std::move(row));
+        }
+        index->add(rows);
+        if (static_cast<int>(messages.size()) < page.limit)
+          break;
+        // only the first page is found by date, later ones continue after the
+        // last id so messages sharing a date can't fall between two pages
+        int last = 0;
+        for (const WrongthinkMessage& msg : messages)
+          last = std::max(last, msg.messageid());
+        page.anchor = MessagePage::Anchor::AFTER_ID;
+        page.key = last;
+      }
+    }
+  }
+}
+
+ServerUnaryReactor* WrongthinkServiceImpl::CreateUser(CallbackServerContext* context,
+  const CreateUserRequest* request, WrongthinkUser* response) {
+  return runUnary(context, [this, request, response]() {
+    return CreateUserImpl(request, response);
+  });
+}
+
+Status WrongthinkServiceImpl::CreateUserImpl(const CreateUserRequest* request,
   WrongthinkUser* response) {
   try {
     std::string uname = request->uname();
+    if (isReservedUserName(uname))
+      return Status(StatusCode::INVALID_ARGUMENT, "user names can't contain ':'");
     std::string password = request->password();
     int admin = request->admin();
     int uid = 0;
@@ -355,18 +627,158 @@ Status WrongthinkServiceImpl::CreateUser(ServerContext* context, const CreateUse
   return Status::OK;
 }
 
-bool WrongthinkServiceImpl::checkForChannel(int channelid, soci::session &sql) {
-  if (channelMap.count(channelid) != 1) {
+std::string WrongthinkServiceImpl::directoryVersion(ServerContext* context) {
+  auto meta = context->client_metadata();
+  auto it = meta.find(DIRECTORY_VERSION_KEY);
+  if (it == meta.end())
+    return "";
+  return std::string(it->second.data(), it->second.length());
+}
+
+void WrongthinkServiceImpl::addDirectoryTrailers(ServerContext* context, const DirectorySync& sync) {
+  context->AddTrailingMetadata(DIRECTORY_VERSION_KEY, sync.version);
+  switch (sync.result) {
+    case Directory::Result::DELTA:
+      context->AddTrailingMetadata(DIRECTORY_RESULT_KEY, "delta");
+      break;
+    case Directory::Result::UNCHANGED:
+      context->AddTrailingMetadata(DIRECTORY_RESULT_KEY, "unchanged");
+      break;
+    case Directory::Result::FULL:
+    default:
+      context->AddTrailingMetadata(DIRECTORY_RESULT_KEY, "full");
+      break;
+  }
+}
+
+void WrongthinkServiceImpl::readHistory(int channelid, const MessagePage& page,
+  std::vector<WrongthinkMessage>& out) {
+  readHistory(channelid, page, [&out](std::vector<WrongthinkMessage>& batch) {
+    out.insert(out.end(), std::make_move_iterator(batch.begin()),
+      std::make_move_iterator(batch.end()));
+    return true;
+  });
+}
+
+void WrongthinkServiceImpl::readHistory(int channelid, const MessagePage& page,
+  const DBInterface::MessageSink& sink) {
+  if (MessageStore* store = db->messageStore()) {
+    // the store reads the page from memory mapped segments in one go
+    std::vector<MessageRow> rows;
+    store->readPage(channelid, page, rows);
+    std::vector<WrongthinkMessage> batch;
+    batch.reserve(rows.size());
+    for (const MessageRow& r : rows)
+      batch.push_back(toMessage(r));
+    sink(batch);
+    return;
+  }
+
+  DBSession sql = db->getReadSession("channel:" + std::to_string(channelid));
+  db->getChannelMessages(sql, channelid, page, sink);
+}
+
+Status WrongthinkServiceImpl::streamHistory(int channelid, const MessagePage& page,
+  ServerWriterWrapper< WrongthinkMessage>* writer) {
+  using Batches = BoundedQueue<std::vector<WrongthinkMessage>>;
+  auto queue = std::make_shared<Batches>(HISTORY_QUEUE_BATCHES);
+  dbExecutor.submit([this, queue, channelid, page]() {
+    try {
+      // a full queue stalls the fetch, a closed one (the client left) ends it
+      readHistory(channelid, page, [&queue](std::vector<WrongthinkMessage>& batch) {
+        return queue->push(std::move(batch));
+      });
+      queue->close();
+    } catch (...) {
+      queue->fail(std::current_exception());
+    }
+  });
+
+  std::vector<WrongthinkMessage> batch;
+  // rethrows what the fetch threw
+  while (queue->pop(batch)) {
+    for (size_t i = 0; i < batch.size(); i++) {
+      // coalesce while more is ready, flush once the next write would wait on the db
+      grpc::WriteOptions options;
+      if (i + 1 < batch.size() || !queue->empty())
+        options.set_buffer_hint();
+      if (!writer->Write(batch[i], options)) {
+        queue->close();
+        return Status(StatusCode::CANCELLED, "");
+      }
+    }
+  }
+  return Status::OK;
+}
+
+void WrongthinkServiceImpl::readMessages(int channelid, const std::vector<int>& ids,
+  std::vector<WrongthinkMessage>& out) {
+  if (MessageStore* store = db->messageStore()) {
+    // store ids are dense, each one is the page right after its predecessor
+    std::vector<MessageRow> rows;
+    for (int id : ids) {
+      MessagePage page;
+      page.anchor = MessagePage::Anchor::AFTER_ID;
+      page.key = id - 1;
+      page.limit = 1;
+      rows.clear();
+      store->readPage(channelid, page, rows);
+      if (!rows.empty() && rows.front().id == id)
+        out.push_back(toMessage(rows.front()));
+    }
+    return;
+  }
+
+  DBSession sql = db->getReadSession("channel:" + std::to_string(channelid));
+  db->getMessagesById(sql, channelid, ids, out);
+}
+
+Directory::ChannelLoader WrongthinkServiceImpl::channelLoader(int community) {
+  return [this, community](std::vector<WrongthinkChannel>& out) {
+    DBSession sql = db->getReadSession("community:" + std::to_string(community));
+    db->getCommunityChannels(sql, community, out);
+  };
+}
 
-    auto r = db->getChannelRow( sql, channelid );
+WrongthinkMessage WrongthinkServiceImpl::toMessage(const MessageRow& row) {
+  WrongthinkMessage msg;
+  msg.set_uname(db->getUserName(row.userId));
+  msg.set_channelid(row.channel);
+  msg.set_userid(row.userId);
+  msg.set_threadid(row.threadId);
+  msg.set_threadchild(row.threadChild);
+  msg.set_text(row.text);
+  msg.set_date(row.date);
+  msg.set_messageid(row.id);
+  return msg;
+}
 
-    if(r->get_indicator(0) != soci::i_null)
-      channelMap.emplace( std::piecewise_construct,
-                          std::forward_as_tuple(channelid),
-                          std::forward_as_tuple(channelid,
-                                                r->get<std::string>(0)));
+void WrongthinkServiceImpl::onMessagesCommitted(const std::vector<MessageRow>& rows) {
+  if (std::shared_ptr<MessageIndex> index = std::atomic_load(&searchIndex))
+    index->add(rows);
+
+  ChannelRegistry::ChannelPtr channel;
+  for (const MessageRow& r : rows) {
+    // only live channels keep a cache, don't load anything here
+    if (!channel || channel->getChannel().channelid() != r.channel)
+      channel = channels.find(r.channel);
+    if (!channel)
+      continue;
+    // failed rows never made it to the database but are settled all the same
+    if (r.id == 0)
+      channel->recentMessages().discard();
     else
-      return false;
+      channel->setMessageId(channel->recentMessages().append(toMessage(r)), r.id);
   }
+}
+
+bool WrongthinkServiceImpl::loadChannel(int channelid, WrongthinkChannel& channel) {
+  DBSession sql = db->getSociSession();
+  auto r = db->getChannelRow( sql, channelid );
+
+  if(r->get_indicator(0) == soci::i_null)
+    return false;
+  channel.set_channelid(channelid);
+  channel.set_name(r->get<std::string>(0));
   return true;
 }
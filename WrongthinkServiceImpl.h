@@ -18,11 +18,24 @@ If not, see <https://www.gnu.org/licenses/>.
 #include <grpcpp/grpcpp.h>
 #include "spdlog/spdlog.h"
 #include "wrongthink.grpc.pb.h"
+#include "wrongthink_search.grpc.pb.h"
+#include "wrongthink_listen.grpc.pb.h"
 #include "SynchronizedChannel.h"
+#include "ChannelListenReactor.h"
+#include "ChannelRegistry.h"
+#include "Directory.h"
+#include "Executor.h"
+#include "Compression.h"
+#include "BoundedQueue.h"
 #include "DB/DBInterface.h"
+#include "DB/MessageWriter.h"
+#include "DB/MessageIndex.h"
 #include <vector>
 #include <ctime>
 #include <memory>
+#include <atomic>
+#include <algorithm>
+#include <cstdlib>
 
 // grpc using statements
 using grpc::Server;
@@ -33,6 +46,9 @@ using grpc::ServerReader;
 using grpc::ServerReaderWriter;
 using grpc::Status;
 using grpc::StatusCode;
+using grpc::experimental::CallbackServerContext;
+using grpc::experimental::ServerWriteReactor;
+using grpc::experimental::ServerUnaryReactor;
 
 // soci using statements
 using soci::session;
@@ -73,12 +89,43 @@ public:
   ServerWriterWrapper(): objList{}, writer{} { }
   ServerWriterWrapper(ServerWriter<obj>* _writer): objList{}, writer{_writer} { }
 
-  void Write(const obj& _obj) {
+  /* messages the policy finds too small go out uncompressed, the call level
+     is set on the context */
+  void setCompression(const CompressionPolicy& _policy, CompressionStats* _stats) {
+    policy = &_policy;
+    stats = _stats;
+  }
+
+  bool Write(const obj& _obj) {
+    if (policy)
+      return Write(_obj, grpc::WriteOptions());
 #ifdef GTEST
-    objList.push_back(_obj);
-#else
-    writer->Write(_obj);
+    // tests calling the Impl methods directly collect the messages
+    if (!writer) {
+      objList.push_back(_obj);
+      return true;
+    }
+#endif
+    return writer->Write(_obj);
+  }
+
+  /* buffer_hint lets grpc hold the message back & coalesce it with the next */
+  bool Write(const obj& _obj, grpc::WriteOptions options) {
+    if (policy) {
+      size_t bytes = _obj.ByteSizeLong();
+      bool compressed = policy->compresses(bytes);
+      if (!compressed)
+        options.set_no_compression();
+      if (stats)
+        stats->record(_obj, bytes, compressed);
+    }
+#ifdef GTEST
+    if (!writer) {
+      objList.push_back(_obj);
+      return true;
+    }
 #endif
+    return writer->Write(_obj, options);
   }
 
   std::vector<obj>& getObjList() { return objList; }
@@ -86,32 +133,102 @@ public:
 private:
   std::vector<obj> objList;
   ServerWriter<obj>* writer;
+  const CompressionPolicy* policy = nullptr;
+  CompressionStats* stats = nullptr;
+};
+
+// metadata carrying the directory version a client holds, sent back as a
+// trailer with the version of the listing it now has
+const std::string DIRECTORY_VERSION_KEY = "wt-directory-version";
+// trailer telling how to apply the listing: "full", "delta" or "unchanged"
+const std::string DIRECTORY_RESULT_KEY = "wt-directory-result";
+
+/* directory version exchanged with a listing rpc */
+struct DirectorySync {
+  std::string known;
+  std::string version;
+  Directory::Result result = Directory::Result::FULL;
 };
 
-class WrongthinkServiceImpl final : public wrongthink::Service {
+// GetWrongthinkMessages page size when the request leaves limit at 0, & its cap
+constexpr int DEFAULT_MESSAGE_PAGE = 100;
+constexpr int MAX_MESSAGE_PAGE = 1000;
+
+// history batches fetched ahead of the stream writing them out
+constexpr size_t HISTORY_QUEUE_BATCHES = 4;
+// threads running blocking database reads for streaming rpcs
+constexpr size_t DB_EXECUTOR_THREADS = 4;
+// threads & queue bound of the executor running unary rpcs, a full queue
+// answers RESOURCE_EXHAUSTED
+constexpr size_t UNARY_EXECUTOR_THREADS = 8;
+constexpr size_t UNARY_EXECUTOR_QUEUE = 1024;
+
+// history & directory listings are mostly text & compress, live listen
+// streams never do, they favour latency. smaller messages aren't worth it
+constexpr size_t COMPRESSION_MIN_BYTES = 128;
+
+struct WrongthinkServiceOptions {
+  size_t historyThreads = DB_EXECUTOR_THREADS;
+  size_t unaryThreads = UNARY_EXECUTOR_THREADS;
+  size_t unaryQueue = UNARY_EXECUTOR_QUEUE;
+  CompressionPolicy historyCompression{ GRPC_COMPRESS_LEVEL_MED, COMPRESSION_MIN_BYTES };
+  CompressionPolicy directoryCompression{ GRPC_COMPRESS_LEVEL_MED, COMPRESSION_MIN_BYTES };
+  // backlog a listener may build up before its channel's policy kicks in
+  ListenerBudget listenerBudget;
+};
+
+// SearchMessages page size when the request leaves limit at 0, & its cap
+constexpr int DEFAULT_SEARCH_PAGE = 20;
+constexpr int MAX_SEARCH_PAGE = 100;
+
+/* listen streams & unary rpcs are served by the callback API. idle
+   listeners don't pin a sync server thread & unary handlers hand their
+   database work to an executor, so the grpc threads never block on it.
+   the listen method is raw so listeners can share pre-serialized message
+   buffers. the remaining streams stay on the sync service */
+using WrongthinkServiceBase =
+  wrongthink::ExperimentalWithCallbackMethod_BanUser<
+  wrongthink::ExperimentalWithCallbackMethod_GenerateUser<
+  wrongthink::ExperimentalWithCallbackMethod_CreateUser<
+  wrongthink::ExperimentalWithCallbackMethod_CreateWrongthinkChannel<
+  wrongthink::ExperimentalWithCallbackMethod_CreateWrongthinkCommunity<
+  wrongthink::ExperimentalWithCallbackMethod_SendWrongthinkMessageWeb<
+  wrongthink::ExperimentalWithRawCallbackMethod_ListenWrongthinkMessages<
+    wrongthink::Service>>>>>>>;
+
+class WrongthinkServiceImpl final : public WrongthinkServiceBase {
 public:
   WrongthinkServiceImpl(std::shared_ptr<DBInterface> db,
-    const std::shared_ptr<spdlog::logger> logger);
+    const std::shared_ptr<spdlog::logger> logger,
+    const WrongthinkServiceOptions& options = WrongthinkServiceOptions{});
 
-  WrongthinkServiceImpl() {}
+  WrongthinkServiceImpl() : channels{ nullptr }, dbExecutor{ "db", 1 },
+    unaryExecutor{ "unary", 1 } {}
 
   // not yet implemented
   Status DeleteMessage(ServerContext* context, const DeleteMessageRequest* request,
       GenericResponse* response) override { return {}; };
 
-  Status BanUser(ServerContext* context, const BanUserRequest* request,
+  ServerUnaryReactor* BanUser(CallbackServerContext* context, const BanUserRequest* request,
     GenericResponse* response) override;
 
-  Status GenerateUser(ServerContext* context, const GenericRequest* request,
+  /* needed to make the rpc function testable, creds are the caller's uname & token */
+  Status BanUserImpl(const std::pair<std::string, std::string>& creds,
+    const BanUserRequest* request, GenericResponse* response);
+
+  ServerUnaryReactor* GenerateUser(CallbackServerContext* context, const GenericRequest* request,
     WrongthinkUser* response) override;
 
+  /* needed to make the rpc function testable */
+  Status GenerateUserImpl(const GenericRequest* request, WrongthinkUser* response);
+
   Status GetWrongthinkChannels(ServerContext* context,
     const GetWrongthinkChannelsRequest* request,
     ServerWriter<WrongthinkChannel>* writer) override;
 
   /* needed to make the rpc function testable */
   Status GetWrongthinkCommunitiesImpl(const GetWrongthinkCommunitiesRequest* request,
-    ServerWriterWrapper<WrongthinkCommunity>* writer);
+    ServerWriterWrapper<WrongthinkCommunity>* writer, DirectorySync* sync = nullptr);
 
   /* needed to make the rpc function testable */
   Status GetWrongthinkCommunities(ServerContext* context,
@@ -120,19 +237,30 @@ public:
 
   /* needed to make the rpc function testable */
   Status GetWrongthinkChannelsImpl(const GetWrongthinkChannelsRequest* request,
-    ServerWriterWrapper<WrongthinkChannel>* writer);
+    ServerWriterWrapper<WrongthinkChannel>* writer, DirectorySync* sync = nullptr);
 
-  Status CreateWrongthinkChannel(ServerContext* context,
+  ServerUnaryReactor* CreateWrongthinkChannel(CallbackServerContext* context,
     const CreateWrongThinkChannelRequest* request,
     WrongthinkChannel* response) override;
 
-  Status CreateWrongthinkCommunity(ServerContext* context,
+  /* needed to make the rpc function testable */
+  Status CreateWrongthinkChannelImpl(const CreateWrongThinkChannelRequest* request,
+    WrongthinkChannel* response);
+
+  ServerUnaryReactor* CreateWrongthinkCommunity(CallbackServerContext* context,
     const CreateWrongthinkCommunityRequest* request,
     WrongthinkCommunity* response) override;
 
-  Status SendWrongthinkMessageWeb(ServerContext* context,
+  /* needed to make the rpc function testable */
+  Status CreateWrongthinkCommunityImpl(const CreateWrongthinkCommunityRequest* request,
+    WrongthinkCommunity* response);
+
+  ServerUnaryReactor* SendWrongthinkMessageWeb(CallbackServerContext* context,
     const WrongthinkMessage* request, WrongthinkMeta* response) override;
 
+  /* needed to make the rpc function testable */
+  Status SendWrongthinkMessageWebImpl(const WrongthinkMessage* request, WrongthinkMeta* response);
+
   Status SendWrongthinkMessage(ServerContext* context,
     ServerReader< WrongthinkMessage>* reader, WrongthinkMeta* response) override;
 
@@ -140,13 +268,15 @@ public:
   Status SendWrongthinkMessageImpl(ServerReaderWrapper< WrongthinkMessage>* reader,
     WrongthinkMeta* response);
 
-  Status ListenWrongthinkMessages(ServerContext* context,
-    const ListenWrongthinkMessagesRequest* request,
-    ServerWriter< WrongthinkMessage>* writer) override;
+  ServerWriteReactor< grpc::ByteBuffer>* ListenWrongthinkMessages(
+    CallbackServerContext* context,
+    const grpc::ByteBuffer* request) override;
 
-  /* needed to make the rpc function testable */
-  Status ListenWrongthinkMessagesImpl(const ListenWrongthinkMessagesRequest* request,
-    ServerWriterWrapper< WrongthinkMessage>* writer);
+  /* served by WrongthinkListenServiceImpl, the same stream writing a
+     WrongthinkMessageBatch per batch */
+  ServerWriteReactor< grpc::ByteBuffer>* ListenWrongthinkMessageBatches(
+    CallbackServerContext* context,
+    const grpc::ByteBuffer* request);
 
   Status GetWrongthinkMessages(ServerContext* context,
     const GetWrongthinkMessagesRequest* request,
@@ -156,13 +286,125 @@ public:
   Status GetWrongthinkMessagesImpl(const GetWrongthinkMessagesRequest* request,
     ServerWriterWrapper< WrongthinkMessage>* writer);
 
-  Status CreateUser(ServerContext* context, const CreateUserRequest* request,
+  ServerUnaryReactor* CreateUser(CallbackServerContext* context, const CreateUserRequest* request,
     WrongthinkUser* response) override;
 
+  /* needed to make the rpc function testable */
+  Status CreateUserImpl(const CreateUserRequest* request, WrongthinkUser* response);
+
+  /* served through WrongthinkSearchServiceImpl, not an override */
+  Status SearchMessages(ServerContext* context, const SearchMessagesRequest* request,
+    ServerWriter< WrongthinkMessage>* writer);
+
+  /* full text search, newest matches first */
+  Status SearchMessagesImpl(const SearchMessagesRequest* request,
+    ServerWriterWrapper< WrongthinkMessage>* writer);
+
+  /* serves search from index & keeps it current from the commit path */
+  void setSearchIndex(std::shared_ptr<MessageIndex> index);
+  /* indexes history newer than what the index persisted, after a crash
+     lost its live postings. returns early once stopIndexBacklog() is called */
+  void indexBacklog();
+  void stopIndexBacklog() { backlogStopped.store(true); }
+
+  /* caps the memory held by live channels, idle channels are evicted LRU */
+  void setChannelMemoryBudget(uint64_t bytes) { channels.setMemoryBudget(bytes); }
+
+  /* queue depth & wait times of the executors doing database work */
+  Executor::Stats unaryStats() const { return unaryExecutor.stats(); }
+  Executor::Stats historyStats() const { return dbExecutor.stats(); }
+  /* messages sent by history & directory streams, with the estimated savings */
+  CompressionStats::Snapshot historyCompressionStats() const { return historyCompressed.snapshot(); }
+  CompressionStats::Snapshot directoryCompressionStats() const { return directoryCompressed.snapshot(); }
+  /* commits every queued message & stops the writer, run once the servers
+     are down */
+  void drainMessages() { messageWriter->stop(); }
+  /* blocks until every queued message is committed */
+  void flushMessages() { messageWriter->flush(); }
+  MessageWriter::Stats writerStats() { return messageWriter->stats(); }
+
+  /* restricts the executor threads to cpus */
+  bool pinExecutors(const std::vector<int>& cpus) {
+    return dbExecutor.pin(cpus) && unaryExecutor.pin(cpus);
+  }
+
 private:
-  bool checkForChannel(int channelid, soci::session& sql);
-  std::map<int, SynchronizedChannel> channelMap;
-  std::mutex channelMapMutex;
+  /* runs work on the unary executor & finishes the call with its status */
+  ServerUnaryReactor* runUnary(CallbackServerContext* context, std::function<Status()> work);
+  /* starts a listen stream, one write per message or per batch */
+  ServerWriteReactor< grpc::ByteBuffer>* listen(CallbackServerContext* context,
+    const grpc::ByteBuffer* request, bool batched);
+  bool loadChannel(int channelid, WrongthinkChannel& channel);
+  /* directory version the client sent, empty when it holds no listing */
+  static std::string directoryVersion(ServerContext* context);
+  static void addDirectoryTrailers(ServerContext* context, const DirectorySync& sync);
+  /* reads a page of history from the message store or the database */
+  void readHistory(int channelid, const MessagePage& page, std::vector<WrongthinkMessage>& out);
+  void readHistory(int channelid, const MessagePage& page, const DBInterface::MessageSink& sink);
+  /* fetches the page on the db executor while this thread writes the batches
+     it produced so far, fetching & sending overlap */
+  Status streamHistory(int channelid, const MessagePage& page,
+    ServerWriterWrapper< WrongthinkMessage>* writer);
+  /* reads the messages with these ids, ids that don't exist are skipped */
+  void readMessages(int channelid, const std::vector<int>& ids, std::vector<WrongthinkMessage>& out);
+  Directory::ChannelLoader channelLoader(int community);
+  WrongthinkMessage toMessage(const MessageRow& row);
+  /* queues a published message for the database, see
+     SynchronizedChannel::publishMessage */
+  std::function<bool(const WrongthinkMessage&)> persistMessage() {
+    return [this](const WrongthinkMessage& msg) { return messageWriter->enqueue(msg); };
+  }
+  /* feeds persisted messages, now carrying their ids, to the search index &
+     the settled counts & caches of resident channels */
+  void onMessagesCommitted(const std::vector<MessageRow>& rows);
   std::shared_ptr<DBInterface> db;
   std::shared_ptr<spdlog::logger> logger;
+  ChannelRegistry channels;
+  Directory directory;
+  // set once at startup while the writer runs, accessed atomically
+  std::shared_ptr<MessageIndex> searchIndex;
+  std::atomic<bool> backlogStopped{ false };
+  ListenBatching listenBatching;
+  CompressionPolicy historyCompression;
+  CompressionPolicy directoryCompression;
+  CompressionStats historyCompressed;
+  CompressionStats directoryCompressed;
+  // finishes queued reads before anything they use goes away
+  Executor dbExecutor;
+  // declared after everything its commit callback touches, so it drains first
+  std::unique_ptr<MessageWriter> messageWriter;
+  // declared last, queued unary rpcs finish before the writer drains
+  Executor unaryExecutor;
+};
+
+/* the search rpc comes from a local proto, so it is a service of its own.
+   registered next to the main service & forwarding to it */
+class WrongthinkSearchServiceImpl final : public wrongthinksearch::Service {
+public:
+  explicit WrongthinkSearchServiceImpl(WrongthinkServiceImpl& service) : service{ service } {}
+
+  Status SearchMessages(ServerContext* context, const SearchMessagesRequest* request,
+    ServerWriter< WrongthinkMessage>* writer) override {
+    return service.SearchMessages(context, request, writer);
+  }
+
+private:
+  WrongthinkServiceImpl& service;
+};
+
+/* the batched listen rpc comes from a local proto as well, raw like
+   ListenWrongthinkMessages so batches are framed around shared payloads */
+class WrongthinkListenServiceImpl final :
+  public wrongthinklisten::ExperimentalWithRawCallbackMethod_ListenWrongthinkMessageBatches<
+    wrongthinklisten::Service> {
+public:
+  explicit WrongthinkListenServiceImpl(WrongthinkServiceImpl& service) : service{ service } {}
+
+  ServerWriteReactor< grpc::ByteBuffer>* ListenWrongthinkMessageBatches(
+    CallbackServerContext* context, const grpc::ByteBuffer* request) override {
+    return service.ListenWrongthinkMessageBatches(context, request);
+  }
+
+private:
+  WrongthinkServiceImpl& service;
 };
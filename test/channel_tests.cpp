@@ -0,0 +1,491 @@
+/*
+This file is part of Wrongthink.
+
+Wrongthink - Modern, open & performant chat protocol. Based on gRPC.
+Copyright (C) 2020 Ophiuchus2
+
+This program is free software: you can redistribute it and/or modify it under the
+terms of the GNU Affero General Public License as published by the Free Software Foundation,
+either version 3 of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License along with this program.
+If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "gtest/gtest.h"
+#include "SynchronizedChannel.h"
+#include "ChannelRegistry.h"
+#include <vector>
+#include <thread>
+#include <string>
+#include <atomic>
+#include <stdexcept>
+
+namespace {
+
+  WrongthinkMessage makeMessage(const std::string& text) {
+    WrongthinkMessage msg;
+    msg.set_channelid(1);
+    msg.set_text(text);
+    return msg;
+  }
+
+  TEST(SynchronizedChannelTest, TestCursorDrainsInOrder) {
+    SynchronizedChannel channel(1, "channel 1", 8);
+    uint64_t cursor = channel.headSeq();
+    for (int i = 0; i < 5; i++)
+      channel.appendMessage(makeMessage("msg" + std::to_string(i)));
+
+    std::vector<ChannelEntryPtr> entries;
+    size_t lost = channel.readMessages(cursor, entries);
+    EXPECT_EQ(lost, 0);
+    ASSERT_EQ(entries.size(), 5);
+    for (int i = 0; i < 5; i++) {
+      EXPECT_EQ(entries[i]->seq, i + 1);
+      EXPECT_EQ(entries[i]->msg.text(), "msg" + std::to_string(i));
+    }
+    EXPECT_EQ(cursor, channel.headSeq());
+
+    // nothing new, the cursor stays put
+    entries.clear();
+    EXPECT_EQ(channel.readMessages(cursor, entries), 0);
+    EXPECT_TRUE(entries.empty());
+  }
+
+  TEST(SynchronizedChannelTest, TestLappedListener) {
+    SynchronizedChannel channel(1, "channel 1", 8);
+    uint64_t cursor = 0;
+    for (int i = 0; i < 20; i++)
+      channel.appendMessage(makeMessage("msg" + std::to_string(i)));
+
+    std::vector<ChannelEntryPtr> entries;
+    size_t lost = channel.readMessages(cursor, entries);
+    EXPECT_EQ(lost, 12);
+    ASSERT_EQ(entries.size(), 8);
+    EXPECT_EQ(entries.front()->msg.text(), "msg12");
+    EXPECT_EQ(entries.back()->msg.text(), "msg19");
+
+    // history snapshot holds the same window
+    std::vector<ChannelEntryPtr> snapshot = channel.getMessages();
+    ASSERT_EQ(snapshot.size(), 8);
+    EXPECT_EQ(snapshot.front()->seq, 13);
+    EXPECT_EQ(channel.lastMessage().text(), "msg19");
+  }
+
+  TEST(SynchronizedChannelTest, TestWaitMessages) {
+    SynchronizedChannel channel(1, "channel 1");
+    uint64_t cursor = channel.headSeq();
+    EXPECT_FALSE(channel.waitMessages(cursor, std::chrono::milliseconds(10)));
+
+    std::thread publisher([&channel]() {
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+      channel.appendMessage(makeMessage("wake"));
+    });
+    EXPECT_TRUE(channel.waitMessages(cursor, std::chrono::seconds(5)));
+    publisher.join();
+
+    std::vector<ChannelEntryPtr> entries;
+    channel.readMessages(cursor, entries);
+    ASSERT_EQ(entries.size(), 1);
+    EXPECT_EQ(entries[0]->msg.text(), "wake");
+  }
+
+  // counts notifications & flags any that arrive after it was removed
+  class CountingListener : public ChannelListener {
+  public:
+    void onMessageAvailable() override {
+      if (removed.load())
+        late++;
+      notified++;
+    }
+    std::atomic<bool> removed{ false };
+    std::atomic<int> notified{ 0 };
+    std::atomic<int> late{ 0 };
+  };
+
+  TEST(SynchronizedChannelTest, TestRemovedListenerIsNotCalled) {
+    SynchronizedChannel channel(1, "channel 1", 8);
+    std::atomic<bool> stop{ false };
+    std::vector<std::thread> publishers;
+    for (int i = 0; i < 4; i++) {
+      publishers.emplace_back([&channel, &stop]() {
+        while (!stop.load())
+          channel.appendMessage(makeMessage("msg"));
+      });
+    }
+    for (int i = 0; i < 50; i++) {
+      CountingListener listener;
+      channel.addListener(&listener);
+      while (listener.notified.load() == 0)
+        std::this_thread::yield();
+      channel.removeListener(&listener);
+      listener.removed.store(true);
+      std::this_thread::yield();
+      EXPECT_EQ(listener.late.load(), 0);
+    }
+    stop.store(true);
+    for (std::thread& publisher : publishers)
+      publisher.join();
+    EXPECT_EQ(channel.listenerCount(), 0);
+  }
+
+  // reads the whole ring of a channel holding count messages
+  std::vector<ChannelEntryPtr> backlog(SynchronizedChannel& channel, int count) {
+    uint64_t cursor = channel.headSeq();
+    for (int i = 0; i < count; i++)
+      channel.appendMessage(makeMessage("msg" + std::to_string(i)));
+    std::vector<ChannelEntryPtr> entries;
+    channel.readMessages(cursor, entries);
+    return entries;
+  }
+
+  TEST(ListenerBudgetTest, TestWithinBudget) {
+    SynchronizedChannel channel(1, "channel 1", 16);
+    std::vector<ChannelEntryPtr> pending = backlog(channel, 4);
+    ListenerBudget budget;
+    budget.maxMessages = 4;
+    budget.policy = SlowConsumerPolicy::DISCONNECT;
+    size_t pos = 0;
+    uint64_t discarded = 0;
+    EXPECT_EQ(applyListenerBudget(budget, pending, pos, 0, discarded), BudgetAction::KEEP);
+    EXPECT_EQ(pos, 0);
+    EXPECT_EQ(pending.size(), 4);
+    EXPECT_EQ(discarded, 0);
+  }
+
+  TEST(ListenerBudgetTest, TestDropOldest) {
+    SynchronizedChannel channel(1, "channel 1", 16);
+    std::vector<ChannelEntryPtr> pending = backlog(channel, 10);
+    ListenerBudget budget;
+    budget.maxMessages = 4;
+    budget.policy = SlowConsumerPolicy::DROP_OLDEST;
+    size_t pos = 1;
+    uint64_t discarded = 0;
+    EXPECT_EQ(applyListenerBudget(budget, pending, pos, 0, discarded), BudgetAction::KEEP);
+    // the newest four are kept
+    EXPECT_EQ(pos, 6);
+    EXPECT_EQ(discarded, 5);
+    EXPECT_EQ(pending[pos]->msg.text(), "msg6");
+
+    // the byte limit trims the backlog the same way
+    pos = 0;
+    budget.maxMessages = 100;
+    budget.maxBytes = pending[8]->payload.Length() + pending[9]->payload.Length();
+    EXPECT_EQ(applyListenerBudget(budget, pending, pos, 0, discarded), BudgetAction::KEEP);
+    EXPECT_EQ(pos, 8);
+    EXPECT_EQ(discarded, 8);
+
+    // messages lost in the ring count as dropped
+    pos = 8;
+    EXPECT_EQ(applyListenerBudget(budget, pending, pos, 3, discarded), BudgetAction::KEEP);
+    EXPECT_EQ(pos, 8);
+    EXPECT_EQ(discarded, 3);
+  }
+
+  TEST(ListenerBudgetTest, TestGap) {
+    SynchronizedChannel channel(1, "channel 1", 16);
+    std::vector<ChannelEntryPtr> pending = backlog(channel, 10);
+    ListenerBudget budget;
+    budget.maxMessages = 4;
+    budget.policy = SlowConsumerPolicy::GAP;
+    size_t pos = 2;
+    uint64_t discarded = 0;
+    EXPECT_EQ(applyListenerBudget(budget, pending, pos, 0, discarded), BudgetAction::GAP);
+    EXPECT_TRUE(pending.empty());
+    EXPECT_EQ(pos, 0);
+    EXPECT_EQ(discarded, 8);
+
+    // a lapped listener gets a gap even if what is left fits
+    pending = backlog(channel, 2);
+    EXPECT_EQ(applyListenerBudget(budget, pending, pos, 5, discarded), BudgetAction::GAP);
+    EXPECT_TRUE(pending.empty());
+    EXPECT_EQ(discarded, 7);
+  }
+
+  TEST(ListenerBudgetTest, TestGapMarkerId) {
+    SynchronizedChannel channel(1, "channel 1", 16);
+    std::vector<ChannelEntryPtr> pending = backlog(channel, 10);
+    // the writer committed the first six messages, the rest are queued
+    for (int i = 0; i < 6; i++)
+      channel.setMessageId(pending[i]->seq, 100 + i);
+    ListenerBudget budget;
+    budget.maxMessages = 4;
+    budget.policy = SlowConsumerPolicy::GAP;
+    size_t pos = 2;
+    uint64_t discarded = 0;
+    int storedId = 0;
+    EXPECT_EQ(applyListenerBudget(budget, pending, pos, 0, discarded, storedId),
+              BudgetAction::GAP);
+    EXPECT_EQ(storedId, 105);
+
+    WrongthinkMessage marker = makeGapMarker(1, discarded, storedId);
+    EXPECT_EQ(marker.uname(), GAP_MARKER_UNAME);
+    EXPECT_EQ(marker.messageid(), 105);
+    EXPECT_EQ(marker.text(), "8");
+
+    // nothing committed yet
+    pending = backlog(channel, 6);
+    pos = 0;
+    EXPECT_EQ(applyListenerBudget(budget, pending, pos, 0, discarded, storedId),
+              BudgetAction::GAP);
+    EXPECT_EQ(storedId, 0);
+  }
+
+  TEST(ListenerBudgetTest, TestDisconnect) {
+    SynchronizedChannel channel(1, "channel 1", 16);
+    std::vector<ChannelEntryPtr> pending = backlog(channel, 10);
+    ListenerBudget budget;
+    budget.maxBytes = pending[0]->payload.Length() * 3;
+    budget.policy = SlowConsumerPolicy::DISCONNECT;
+    size_t pos = 0;
+    uint64_t discarded = 0;
+    EXPECT_EQ(applyListenerBudget(budget, pending, pos, 0, discarded), BudgetAction::DISCONNECT);
+    EXPECT_TRUE(pending.empty());
+    EXPECT_EQ(discarded, 10);
+  }
+
+  TEST(ListenerBudgetTest, TestParsePolicy) {
+    EXPECT_EQ(parseSlowConsumerPolicy("gap"), SlowConsumerPolicy::GAP);
+    EXPECT_EQ(parseSlowConsumerPolicy("drop_oldest"), SlowConsumerPolicy::DROP_OLDEST);
+    EXPECT_EQ(parseSlowConsumerPolicy("disconnect"), SlowConsumerPolicy::DISCONNECT);
+    EXPECT_THROW(parseSlowConsumerPolicy("block"), std::runtime_error);
+  }
+
+  TEST(ChannelRegistryTest, TestSingleLoadUnderContention) {
+    std::atomic<int> loads{0};
+    ChannelRegistry registry([&loads](int channelid, WrongthinkChannel& channel) {
+      loads++;
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+      channel.set_channelid(channelid);
+      channel.set_name("channel " + std::to_string(channelid));
+      return true;
+    });
+
+    std::vector<std::thread> threads;
+    std::vector<ChannelRegistry::ChannelPtr> results(16);
+    for (int i = 0; i < 16; i++)
+      threads.emplace_back([&registry, &results, i]() { results[i] = registry.get(7); });
+    for (auto& t : threads)
+      t.join();
+
+    EXPECT_EQ(loads.load(), 1);
+    ASSERT_TRUE(results[0]);
+    for (auto& channel : results)
+      EXPECT_EQ(channel.get(), results[0].get());
+    EXPECT_EQ(results[0]->getChannel().name(), "channel 7");
+    EXPECT_EQ(registry.size(), 1);
+  }
+
+  TEST(ChannelRegistryTest, TestMissingChannel) {
+    int loads = 0;
+    ChannelRegistry registry([&loads](int channelid, WrongthinkChannel& channel) {
+      loads++;
+      return false;
+    });
+    EXPECT_FALSE(registry.get(3));
+    // misses are not cached, the channel may be created later
+    EXPECT_FALSE(registry.get(3));
+    EXPECT_EQ(loads, 2);
+    EXPECT_FALSE(registry.find(3));
+    EXPECT_EQ(registry.size(), 0);
+  }
+
+  TEST(ChannelRegistryTest, TestListenerBudget) {
+    ChannelRegistry registry([](int channelid, WrongthinkChannel& channel) {
+      channel.set_channelid(channelid);
+      return true;
+    });
+    ChannelRegistry::ChannelPtr resident = registry.get(1);
+    ListenerBudget budget;
+    budget.maxMessages = 8;
+    budget.policy = SlowConsumerPolicy::DROP_OLDEST;
+    registry.setListenerBudget(budget);
+
+    // resident channels & channels loaded later both get it
+    for (auto channel : { resident, registry.get(2) }) {
+      EXPECT_EQ(channel->listenerBudget().maxMessages, 8);
+      EXPECT_EQ(channel->listenerBudget().policy, SlowConsumerPolicy::DROP_OLDEST);
+    }
+  }
+
+  TEST(ChannelRegistryTest, TestIdleEviction) {
+    ChannelRegistry registry([](int channelid, WrongthinkChannel& channel) {
+      channel.set_channelid(channelid);
+      return true;
+    });
+    registry.get(1)->appendMessage(makeMessage("msg"));
+    registry.get(2);
+    ChannelRegistry::ChannelPtr held = registry.get(3);
+    EXPECT_EQ(registry.size(), 3);
+    EXPECT_GT(registry.residentBytes(), 0);
+
+    // budget of one byte, everything idle & unreferenced goes
+    registry.setMemoryBudget(1, std::chrono::seconds(0), std::chrono::seconds(3600));
+    EXPECT_EQ(registry.trim(), 2);
+    EXPECT_FALSE(registry.find(1));
+    EXPECT_FALSE(registry.find(2));
+    // still referenced by an rpc, must stay resident
+    EXPECT_EQ(registry.find(3).get(), held.get());
+    // the running total follows evictions
+    EXPECT_EQ(registry.residentBytes(), held->residentBytes());
+    uint64_t before = registry.residentBytes();
+    held->appendMessage(makeMessage("more"));
+    EXPECT_GT(registry.residentBytes(), before);
+    EXPECT_EQ(registry.residentBytes(), held->residentBytes());
+
+    // evicted channels are rehydrated on demand
+    EXPECT_TRUE(registry.get(1));
+  }
+
+  TEST(ChannelRegistryTest, TestOverBudgetLoadWakesSweeper) {
+    ChannelRegistry registry([](int channelid, WrongthinkChannel& channel) {
+      channel.set_channelid(channelid);
+      return true;
+    });
+    // the periodic sweep never fires, only a load over budget wakes it
+    registry.setMemoryBudget(1, std::chrono::seconds(0), std::chrono::seconds(3600));
+    registry.get(1);
+    registry.get(2);
+    for (int i = 0; i < 100 && registry.size() > 0; i++)
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    EXPECT_EQ(registry.size(), 0);
+    EXPECT_EQ(registry.residentBytes(), 0);
+  }
+
+  TEST(RecentMessagesTest, TestServesCoveredPages) {
+    RecentMessages recent(4);
+    MessagePage page;
+    page.limit = 2;
+    std::vector<WrongthinkMessage> out;
+    // nothing is served before the cache is warm
+    EXPECT_FALSE(recent.serve(page, out));
+
+    recent.warm([](int limit, std::vector<WrongthinkMessage>& tail) {
+      EXPECT_EQ(limit, 4);
+      for (int id = 1; id <= 3; id++) {
+        tail.push_back(makeMessage("msg" + std::to_string(id)));
+        tail.back().set_messageid(id);
+      }
+    });
+    // a commit the warm read already saw is dropped
+    WrongthinkMessage dup = makeMessage("msg3");
+    dup.set_messageid(3);
+    recent.append(dup);
+    for (int id = 4; id <= 6; id++) {
+      WrongthinkMessage msg = makeMessage("msg" + std::to_string(id));
+      msg.set_messageid(id);
+      recent.append(msg);
+    }
+
+    // holds ids 3-6 now
+    ASSERT_TRUE(recent.serve(page, out));
+    ASSERT_EQ(out.size(), 2);
+    EXPECT_EQ(out[0].messageid(), 5);
+    EXPECT_EQ(out[1].messageid(), 6);
+
+    out.clear();
+    page.anchor = MessagePage::Anchor::AFTER_ID;
+    page.key = 3;
+    ASSERT_TRUE(recent.serve(page, out));
+    EXPECT_EQ(out[0].messageid(), 4);
+
+    // older ranges & bigger pages than the cache holds go to the database
+    page.key = 1;
+    EXPECT_FALSE(recent.serve(page, out));
+    page.anchor = MessagePage::Anchor::NEWEST;
+    page.limit = 5;
+    EXPECT_FALSE(recent.serve(page, out));
+  }
+
+  TEST(RecentMessagesTest, TestCommitsDuringWarmAreMerged) {
+    SynchronizedChannel channel(1, "channel 1", 8);
+    RecentMessages& recent = channel.recentMessages();
+    uint64_t empty = channel.residentBytes();
+    auto message = [](int id) {
+      WrongthinkMessage msg = makeMessage("msg" + std::to_string(id));
+      msg.set_messageid(id);
+      return msg;
+    };
+
+    // commits land while the read runs, one of them the read saw as well
+    recent.warm([&](int limit, std::vector<WrongthinkMessage>& tail) {
+      EXPECT_FALSE(recent.isWarm());
+      recent.append(message(3));
+      recent.append(message(4));
+      for (int id = 1; id <= 3; id++)
+        tail.push_back(message(id));
+    });
+    ASSERT_TRUE(recent.isWarm());
+
+    MessagePage page;
+    page.limit = 10;
+    std::vector<WrongthinkMessage> out;
+    ASSERT_TRUE(recent.serve(page, out));
+    ASSERT_EQ(out.size(), 4);
+    for (int id = 1; id <= 4; id++)
+      EXPECT_EQ(out[id - 1].messageid(), id);
+
+    // the cached messages count towards the channel's memory
+    EXPECT_GT(recent.residentBytes(), 0);
+    EXPECT_EQ(channel.residentBytes(), empty + recent.residentBytes());
+  }
+
+  TEST(RecentMessagesTest, TestServesQueuedMessages) {
+    SynchronizedChannel channel(1, "channel 1", 8);
+    RecentMessages& recent = channel.recentMessages();
+    recent.warm([](int limit, std::vector<WrongthinkMessage>& tail) {
+      for (int id = 1; id <= 2; id++) {
+        tail.push_back(makeMessage("msg" + std::to_string(id)));
+        tail.back().set_messageid(id);
+      }
+    });
+    // a refused message never reaches the ring
+    auto refuse = [](const WrongthinkMessage&) { return false; };
+    EXPECT_EQ(channel.publishMessage(makeMessage("refused"), refuse), 0);
+    auto accept = [](const WrongthinkMessage&) { return true; };
+    for (int id = 3; id <= 5; id++)
+      EXPECT_EQ(channel.publishMessage(makeMessage("msg" + std::to_string(id)), accept), id - 2);
+    WrongthinkMessage committed = makeMessage("msg3");
+    committed.set_messageid(3);
+    recent.append(committed);
+
+    // msg4 & msg5 are still queued, they follow the cache without an id
+    MessagePage page;
+    page.limit = 10;
+    std::vector<WrongthinkMessage> out;
+    ASSERT_TRUE(channel.serveRecent(page, out));
+    ASSERT_EQ(out.size(), 5);
+    EXPECT_EQ(out[2].messageid(), 3);
+    EXPECT_EQ(out[3].text(), "msg4");
+    EXPECT_EQ(out[3].messageid(), 0);
+    EXPECT_EQ(out[4].text(), "msg5");
+
+    out.clear();
+    page.limit = 3;
+    ASSERT_TRUE(channel.serveRecent(page, out));
+    ASSERT_EQ(out.size(), 3);
+    EXPECT_EQ(out[0].messageid(), 3);
+    EXPECT_EQ(out[2].text(), "msg5");
+
+    out.clear();
+    page.anchor = MessagePage::Anchor::AFTER_ID;
+    page.key = 2;
+    page.limit = 2;
+    ASSERT_TRUE(channel.serveRecent(page, out));
+    ASSERT_EQ(out.size(), 2);
+    EXPECT_EQ(out[0].messageid(), 3);
+    EXPECT_EQ(out[1].text(), "msg4");
+
+    // a message the writer gave up on drops out of the page
+    recent.discard();
+    out.clear();
+    page.anchor = MessagePage::Anchor::NEWEST;
+    page.limit = 10;
+    ASSERT_TRUE(channel.serveRecent(page, out));
+    ASSERT_EQ(out.size(), 4);
+    EXPECT_EQ(out[3].text(), "msg5");
+  }
+}
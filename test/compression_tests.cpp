@@ -0,0 +1,57 @@
+/*
+This file is part of Wrongthink.
+
+Wrongthink - Modern, open & performant chat protocol. Based on gRPC.
+Copyright (C) 2020 Ophiuchus2
+
+This program is free software: you can redistribute it and/or modify it under the
+terms of the GNU Affero General Public License as published by the Free Software Foundation,
+either version 3 of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License along with this program.
+If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "gtest/gtest.h"
+#include "Compression.h"
+#include "wrongthink.grpc.pb.h"
+#include <string>
+#include <stdexcept>
+
+namespace {
+
+  WrongthinkMessage makeMessage(const std::string& text) {
+    WrongthinkMessage msg;
+    msg.set_channelid(1);
+    msg.set_text(text);
+    return msg;
+  }
+
+  TEST(CompressionTest, TestPolicyAndStats) {
+    CompressionPolicy off;
+    EXPECT_FALSE(off.compresses(1 << 20));
+    CompressionPolicy history{ GRPC_COMPRESS_LEVEL_MED, 128 };
+    EXPECT_FALSE(history.compresses(127));
+    EXPECT_TRUE(history.compresses(128));
+    EXPECT_EQ(CompressionPolicy::parseLevel("high"), GRPC_COMPRESS_LEVEL_HIGH);
+    EXPECT_THROW(CompressionPolicy::parseLevel("max"), std::runtime_error);
+
+    // every compressed message sampled
+    CompressionStats stats(1);
+    WrongthinkMessage small = makeMessage("hi");
+    WrongthinkMessage big = makeMessage(std::string(1000, 'a'));
+    stats.record(small, small.ByteSizeLong(), history.compresses(small.ByteSizeLong()));
+    stats.record(big, big.ByteSizeLong(), history.compresses(big.ByteSizeLong()));
+
+    CompressionStats::Snapshot snap = stats.snapshot();
+    EXPECT_EQ(snap.messages, 2);
+    EXPECT_EQ(snap.compressed, 1);
+    EXPECT_EQ(snap.bytes, small.ByteSizeLong() + big.ByteSizeLong());
+    EXPECT_EQ(snap.sampledBytes, big.ByteSizeLong());
+    EXPECT_LT(snap.ratio(), 0.1);
+    EXPECT_LT(snap.estimatedWireBytes(), snap.bytes);
+  }
+}
@@ -0,0 +1,89 @@
+/*
+This file is part of Wrongthink.
+
+Wrongthink - Modern, open & performant chat protocol. Based on gRPC.
+Copyright (C) 2020 Ophiuchus2
+
+This program is free software: you can redistribute it and/or modify it under the
+terms of the GNU Affero General Public License as published by the Free Software Foundation,
+either version 3 of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License along with this program.
+If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "gtest/gtest.h"
+#include "ServerConfig.h"
+#include <sstream>
+#include <stdexcept>
+#include <cstdlib>
+
+namespace {
+
+  TEST(ServerConfigTest, TestParse) {
+    std::istringstream in(
+      "# 64 core host\n"
+      "address = 0.0.0.0:6000\n"
+      "server_instances = 4   # one per numa node\n"
+      "max_concurrent_streams=200\n"
+      "keepalive_permit_without_calls = true\n"
+      "server_cpus = 0-3, 8\n"
+      "db_replicas = host=r1 dbname=wt; host=r2 dbname=wt\n"
+      "listener_max_messages = 1024\n"
+      "listener_policy = drop_oldest\n"
+      "shutdown_grace_ms = 2500\n"
+      "channel_memory_budget = 1048576\n"
+      "\n");
+    ServerConfig config;
+    config.parse(in);
+    EXPECT_EQ(config.address, "0.0.0.0:6000");
+    EXPECT_EQ(config.serverInstances, 4);
+    EXPECT_EQ(config.maxConcurrentStreams, 200);
+    EXPECT_TRUE(config.keepalivePermitWithoutCalls);
+    EXPECT_EQ(config.serverCpus, (std::vector<int>{ 0, 1, 2, 3, 8 }));
+    ASSERT_EQ(config.dbReplicas.size(), 2);
+    EXPECT_EQ(config.dbReplicas[1], "host=r2 dbname=wt");
+    EXPECT_EQ(config.listenerMaxMessages, 1024);
+    EXPECT_EQ(config.listenerPolicy, "drop_oldest");
+    EXPECT_EQ(config.shutdownGraceMs, 2500);
+    EXPECT_EQ(config.channelMemoryBudget, 1048576);
+    // untouched keys keep their defaults
+    EXPECT_EQ(config.dbPoolSize, 8);
+
+    // '#' inside a value isn't a comment
+    std::istringstream hash("db_connection = host=db password=ab#cd # primary\n");
+    config.parse(hash);
+    EXPECT_EQ(config.dbConnection, "host=db password=ab#cd");
+
+    std::istringstream unknown("max_streams = 10\n");
+    EXPECT_THROW(config.parse(unknown), std::runtime_error);
+    std::istringstream malformed("db_pool_size = lots\n");
+    EXPECT_THROW(config.parse(malformed), std::runtime_error);
+  }
+
+  TEST(ServerConfigTest, TestEnvironmentOverridesFile) {
+    std::istringstream in("db_pool_size = 16\nretention_days = 30\n");
+    ServerConfig config;
+    config.parse(in);
+    setenv("WRONGTHINK_DB_POOL_SIZE", "32", 1);
+    config.applyEnvironment();
+    unsetenv("WRONGTHINK_DB_POOL_SIZE");
+    EXPECT_EQ(config.dbPoolSize, 32);
+    EXPECT_EQ(config.retentionDays, 30);
+  }
+
+  TEST(ServerConfigTest, TestInstanceCpus) {
+    ServerConfig config;
+    EXPECT_TRUE(config.instanceCpus(0).empty());
+    config.serverCpus = ServerConfig::parseCpuList("0-7");
+    config.serverInstances = 2;
+    EXPECT_EQ(config.instanceCpus(0), (std::vector<int>{ 0, 1, 2, 3 }));
+    EXPECT_EQ(config.instanceCpus(1), (std::vector<int>{ 4, 5, 6, 7 }));
+    // more instances than cpus, they share
+    config.serverInstances = 10;
+    EXPECT_EQ(config.instanceCpus(9), (std::vector<int>{ 1 }));
+  }
+}
@@ -0,0 +1,152 @@
+/*
+This file is part of Wrongthink.
+
+Wrongthink - Modern, open & performant chat protocol. Based on gRPC.
+Copyright (C) 2020 Ophiuchus2
+
+This program is free software: you can redistribute it and/or modify it under the
+terms of the GNU Affero General Public License as published by the Free Software Foundation,
+either version 3 of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License along with this program.
+If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "gtest/gtest.h"
+#include "DB/DBConnectionPool.h"
+#include "soci-sqlite3.h"
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <filesystem>
+
+namespace {
+
+  const std::string POOL_DB = "pool_test.db";
+
+  // thrown by onConnect, distinct from the soci_error a checkout timeout throws
+  struct ConnectError {};
+
+  DBPoolOptions poolOptions(size_t size) {
+    DBPoolOptions options;
+    options.size = size;
+    options.checkoutTimeout = std::chrono::milliseconds(50);
+    return options;
+  }
+
+  int selectOne(DBSession& sql) {
+    int one = 0;
+    sql << "select 1", soci::into(one);
+    return one;
+  }
+
+  struct SelectQuery : StatementCache::Entry {
+    int value = 0;
+    int result = 0;
+    soci::statement st;
+
+    explicit SelectQuery(soci::session& sql) :
+      st((sql.prepare << "select :v", soci::into(result), soci::use(value))) {}
+  };
+
+  class DBConnectionPoolTest : public ::testing::Test {
+  protected:
+    void SetUp() override { std::filesystem::remove(POOL_DB); }
+    void TearDown() override { std::filesystem::remove(POOL_DB); }
+  };
+
+  TEST_F(DBConnectionPoolTest, TestCheckoutTimeout) {
+    DBConnectionPool pool(soci::sqlite3, POOL_DB, poolOptions(1));
+    {
+      DBSession held = pool.acquire();
+      EXPECT_THROW(pool.acquire(), soci::soci_error);
+    }
+    // the returned connection is handed out again
+    DBSession sql = pool.acquire();
+    EXPECT_EQ(selectOne(sql), 1);
+  }
+
+  TEST_F(DBConnectionPoolTest, TestCheckoutWaitsForRelease) {
+    DBPoolOptions options = poolOptions(1);
+    options.checkoutTimeout = std::chrono::seconds(5);
+    DBConnectionPool pool(soci::sqlite3, POOL_DB, options);
+    std::unique_ptr<DBSession> held(new DBSession(pool.acquire()));
+    std::thread releaser([&held]() {
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+      held.reset();
+    });
+    DBSession sql = pool.acquire();
+    releaser.join();
+    EXPECT_EQ(selectOne(sql), 1);
+  }
+
+  TEST_F(DBConnectionPoolTest, TestHealthCheckReconnects) {
+    int connects = 0;
+    DBPoolOptions options = poolOptions(1);
+    // every idle connection is checked on checkout
+    options.healthCheckIdle = std::chrono::seconds(0);
+    options.onConnect = [&connects](soci::session&) { connects++; };
+    DBConnectionPool pool(soci::sqlite3, POOL_DB, options);
+    {
+      DBSession sql = pool.acquire();
+      // the connection dies while it sits in the pool
+      sql.get().close();
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    DBSession sql = pool.acquire();
+    EXPECT_EQ(connects, 2);
+    EXPECT_EQ(selectOne(sql), 1);
+  }
+
+  TEST_F(DBConnectionPoolTest, TestFailedConnectFreesSlot) {
+    bool fail = true;
+    DBPoolOptions options = poolOptions(1);
+    options.healthCheckIdle = std::chrono::seconds(0);
+    options.onConnect = [&fail](soci::session&) {
+      if (fail)
+        throw ConnectError{};
+    };
+    DBConnectionPool pool(soci::sqlite3, POOL_DB, options);
+    // a leaked slot would turn the later attempts into checkout timeouts
+    for (int i = 0; i < 3; i++)
+      EXPECT_THROW(pool.acquire(), ConnectError);
+
+    fail = false;
+    {
+      DBSession sql = pool.acquire();
+      sql.get().close();
+    }
+    // a failed reconnect on checkout gives the slot back as well
+    fail = true;
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    EXPECT_THROW(pool.acquire(), ConnectError);
+
+    fail = false;
+    DBSession sql = pool.acquire();
+    EXPECT_EQ(selectOne(sql), 1);
+  }
+
+  TEST_F(DBConnectionPoolTest, TestStatementsOutliveCheckout) {
+    DBConnectionPool pool(soci::sqlite3, POOL_DB, poolOptions(1));
+    SelectQuery* prepared = nullptr;
+    {
+      DBSession sql = pool.acquire();
+      SelectQuery& q = sql.statements().get<SelectQuery>("select", sql.get());
+      q.value = 1;
+      q.st.execute(true);
+      EXPECT_EQ(q.result, 1);
+      prepared = &q;
+    }
+    // the next checkout of the same connection reuses the prepared statement
+    DBSession sql = pool.acquire();
+    SelectQuery& q = sql.statements().get<SelectQuery>("select", sql.get());
+    EXPECT_EQ(&q, prepared);
+    q.value = 2;
+    q.st.execute(true);
+    EXPECT_EQ(q.result, 2);
+  }
+}
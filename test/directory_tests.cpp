@@ -0,0 +1,103 @@
+/*
+This file is part of Wrongthink.
+
+Wrongthink - Modern, open & performant chat protocol. Based on gRPC.
+Copyright (C) 2020 Ophiuchus2
+
+This program is free software: you can redistribute it and/or modify it under the
+terms of the GNU Affero General Public License as published by the Free Software Foundation,
+either version 3 of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License along with this program.
+If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "gtest/gtest.h"
+#include "Directory.h"
+#include <vector>
+#include <string>
+
+namespace {
+
+  TEST(DirectoryTest, TestConditionalListing) {
+    Directory directory;
+    int loads = 0;
+    std::vector<WrongthinkCommunity> rows;
+    auto load = [&](std::vector<WrongthinkCommunity>& out) {
+      loads++;
+      out = rows;
+    };
+    auto community = [](int id, const std::string& name) {
+      WrongthinkCommunity c;
+      c.set_communityid(id);
+      c.set_name(name);
+      return c;
+    };
+    rows.push_back(community(1, "one"));
+
+    std::vector<WrongthinkCommunity> out;
+    std::string version;
+    EXPECT_EQ(directory.communities("", load, out, version), Directory::Result::FULL);
+    ASSERT_EQ(out.size(), 1);
+
+    // nothing changed, served without another load
+    out.clear();
+    std::string unchanged;
+    EXPECT_EQ(directory.communities(version, load, out, unchanged), Directory::Result::UNCHANGED);
+    EXPECT_TRUE(out.empty());
+    EXPECT_EQ(unchanged, version);
+    EXPECT_EQ(loads, 1);
+
+    // a create only sends the new entry to clients holding the old version
+    rows.push_back(community(2, "two"));
+    directory.invalidateCommunities();
+    std::string next;
+    EXPECT_EQ(directory.communities(version, load, out, next), Directory::Result::DELTA);
+    ASSERT_EQ(out.size(), 1);
+    EXPECT_EQ(out[0].communityid(), 2);
+    EXPECT_NE(next, version);
+
+    // removals & unknown versions get the whole listing
+    rows.erase(rows.begin());
+    directory.invalidateCommunities();
+    out.clear();
+    EXPECT_EQ(directory.communities(next, load, out, version), Directory::Result::FULL);
+    ASSERT_EQ(out.size(), 1);
+    out.clear();
+    EXPECT_EQ(directory.communities("0.1", load, out, version), Directory::Result::FULL);
+    EXPECT_EQ(loads, 3);
+  }
+
+  TEST(DirectoryTest, TestUnknownCommunityNotCached) {
+    Directory directory;
+    int loads = 0;
+    std::vector<WrongthinkChannel> rows;
+    auto load = [&](std::vector<WrongthinkChannel>& out) {
+      loads++;
+      out = rows;
+    };
+
+    // a community without channels isn't remembered, each read asks again
+    std::vector<WrongthinkChannel> out;
+    std::string version;
+    EXPECT_EQ(directory.channels(99, "", load, out, version), Directory::Result::FULL);
+    EXPECT_TRUE(out.empty());
+    EXPECT_EQ(directory.channels(99, version, load, out, version), Directory::Result::FULL);
+    EXPECT_EQ(loads, 2);
+
+    // once it has channels the listing is kept
+    WrongthinkChannel channel;
+    channel.set_channelid(1);
+    channel.set_name("one");
+    rows.push_back(channel);
+    std::string known = version;
+    EXPECT_EQ(directory.channels(99, known, load, out, version), Directory::Result::FULL);
+    ASSERT_EQ(out.size(), 1);
+    out.clear();
+    EXPECT_EQ(directory.channels(99, version, load, out, version), Directory::Result::UNCHANGED);
+    EXPECT_EQ(loads, 3);
+  }
+}
@@ -0,0 +1,84 @@
+/*
+This file is part of Wrongthink.
+
+Wrongthink - Modern, open & performant chat protocol. Based on gRPC.
+Copyright (C) 2020 Ophiuchus2
+
+This program is free software: you can redistribute it and/or modify it under the
+terms of the GNU Affero General Public License as published by the Free Software Foundation,
+either version 3 of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License along with this program.
+If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "gtest/gtest.h"
+#include "Executor.h"
+#include "BoundedQueue.h"
+#include <mutex>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <stdexcept>
+
+namespace {
+
+  TEST(ExecutorTest, TestPipeline) {
+    Executor executor("test", 2);
+    auto queue = std::make_shared<BoundedQueue<int>>(2);
+    executor.submit([queue]() {
+      for (int i = 0; i < 100; i++) {
+        if (!queue->push(i))
+          return;
+      }
+      queue->close();
+    });
+    int expected = 0, item;
+    while (queue->pop(item))
+      EXPECT_EQ(item, expected++);
+    EXPECT_EQ(expected, 100);
+
+    // a failed producer surfaces in the consumer once the queue drains
+    auto failing = std::make_shared<BoundedQueue<int>>(2);
+    executor.submit([failing]() {
+      failing->push(1);
+      failing->fail(std::make_exception_ptr(std::runtime_error("fetch failed")));
+    });
+    ASSERT_TRUE(failing->pop(item));
+    EXPECT_THROW(failing->pop(item), std::runtime_error);
+
+    // a consumer that stops early releases a blocked producer
+    // (the executor would never join otherwise)
+    auto abandoned = std::make_shared<BoundedQueue<int>>(1);
+    executor.submit([abandoned]() {
+      while (abandoned->push(0)) {}
+    });
+    abandoned->pop(item);
+    abandoned->close();
+  }
+
+  TEST(ExecutorTest, TestTrySubmitRejectsWhenFull) {
+    Executor executor("test", 1, 1);
+    std::mutex gate;
+    std::unique_lock<std::mutex> hold(gate);
+    auto started = std::make_shared<std::atomic<bool>>(false);
+    // occupy the worker, then fill the single queue slot
+    ASSERT_TRUE(executor.trySubmit([&gate, started]() {
+      *started = true;
+      std::lock_guard<std::mutex> lock(gate);
+    }));
+    while (!*started)
+      std::this_thread::yield();
+    ASSERT_TRUE(executor.trySubmit([]() {}));
+    EXPECT_FALSE(executor.trySubmit([]() {}));
+
+    Executor::Stats stats = executor.stats();
+    EXPECT_EQ(stats.queued, 1);
+    EXPECT_EQ(stats.active, 1);
+    EXPECT_EQ(stats.rejected, 1);
+    hold.unlock();
+  }
+}
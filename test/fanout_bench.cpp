@@ -0,0 +1,95 @@
+/*
+This file is part of Wrongthink.
+
+Wrongthink - Modern, open & performant chat protocol. Based on gRPC.
+Copyright (C) 2020 Ophiuchus2
+
+This program is free software: you can redistribute it and/or modify it under the
+terms of the GNU Affero General Public License as published by the Free Software Foundation,
+either version 3 of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License along with this program.
+If not, see <https://www.gnu.org/licenses/>.
+*/
+/*
+ * Compares the CPU cost of fanning one message out to N listeners when every
+ * listener serializes it (typed ServerWriter::Write) vs serializing it once
+ * into a shared grpc::ByteBuffer that every listener copies by reference
+ * (SynchronizedChannel::appendMessage + raw listen streams).
+ *
+ * usage: fanout_bench [listeners] [messages] [text bytes]
+ */
+#include <grpcpp/grpcpp.h>
+#include "wrongthink.grpc.pb.h"
+#include <ctime>
+#include <string>
+#include <cstdlib>
+#include <iostream>
+
+namespace {
+
+double cpuSeconds() {
+  return static_cast<double>(std::clock()) / CLOCKS_PER_SEC;
+}
+
+WrongthinkMessage makeMessage(int i, size_t textBytes) {
+  WrongthinkMessage msg;
+  msg.set_uname("bench-user");
+  msg.set_channelname("bench-channel");
+  msg.set_channelid(1);
+  msg.set_userid(42);
+  msg.set_messageid(i);
+  msg.set_date(1600000000 + i);
+  msg.set_text(std::string(textBytes, 'a' + (i % 26)));
+  return msg;
+}
+
+}
+
+int main(int argc, char** argv) {
+  int listeners = argc > 1 ? std::atoi(argv[1]) : 5000;
+  int messages = argc > 2 ? std::atoi(argv[2]) : 200;
+  size_t textBytes = argc > 3 ? std::atoi(argv[3]) : 200;
+  bool ownBuffer;
+  size_t sink = 0;
+
+  // per listener serialization, what a typed Write() does for every stream
+  double start = cpuSeconds();
+  for (int m = 0; m < messages; m++) {
+    WrongthinkMessage msg = makeMessage(m, textBytes);
+    for (int l = 0; l < listeners; l++) {
+      grpc::ByteBuffer buffer;
+      grpc::SerializationTraits<WrongthinkMessage>::Serialize(msg, &buffer, &ownBuffer);
+      sink += buffer.Length();
+    }
+  }
+  double perListener = cpuSeconds() - start;
+
+  // serialize once, every listener takes a reference to the same slices
+  start = cpuSeconds();
+  for (int m = 0; m < messages; m++) {
+    WrongthinkMessage msg = makeMessage(m, textBytes);
+    grpc::ByteBuffer payload;
+    grpc::SerializationTraits<WrongthinkMessage>::Serialize(msg, &payload, &ownBuffer);
+    for (int l = 0; l < listeners; l++) {
+      grpc::ByteBuffer buffer(payload);
+      sink += buffer.Length();
+    }
+  }
+  double once = cpuSeconds() - start;
+
+  double deliveries = static_cast<double>(listeners) * messages;
+  std::cout << "listeners: " << listeners << ", messages: " << messages
+            << ", text bytes: " << textBytes << std::endl;
+  std::cout << "serialize per listener: " << perListener << "s cpu, "
+            << perListener / deliveries * 1e9 << " ns/delivery" << std::endl;
+  std::cout << "serialize once:         " << once << "s cpu, "
+            << once / deliveries * 1e9 << " ns/delivery" << std::endl;
+  if (once > 0)
+    std::cout << "speedup: " << perListener / once << "x" << std::endl;
+  return sink == 0;
+}
@@ -0,0 +1,155 @@
+/*
+This file is part of Wrongthink.
+
+Wrongthink - Modern, open & performant chat protocol. Based on gRPC.
+Copyright (C) 2020 Ophiuchus2
+
+This program is free software: you can redistribute it and/or modify it under the
+terms of the GNU Affero General Public License as published by the Free Software Foundation,
+either version 3 of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License along with this program.
+If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "gtest/gtest.h"
+#include "DB/MessageIndex.h"
+#include <vector>
+#include <string>
+#include <filesystem>
+
+namespace {
+
+  const std::string INDEX_DIR = "message_index_test";
+
+  MessageRow makeRow(int channel, int id, int date, const std::string& text) {
+    MessageRow row{ 1, channel, 0, false, text, date };
+    row.id = id;
+    return row;
+  }
+
+  std::vector<int> ids(const std::vector<SearchHit>& hits) {
+    std::vector<int> out;
+    for (const SearchHit& hit : hits)
+      out.push_back(hit.id);
+    return out;
+  }
+
+  class MessageIndexTest : public ::testing::Test {
+  protected:
+    void SetUp() override { std::filesystem::remove_all(INDEX_DIR); }
+    void TearDown() override { std::filesystem::remove_all(INDEX_DIR); }
+  };
+
+  TEST_F(MessageIndexTest, TestSearch) {
+    MessageIndex index(INDEX_DIR);
+    index.add({
+      makeRow(1, 1, 100, "Hello world"),
+      makeRow(1, 2, 101, "hello again, World!"),
+      makeRow(2, 3, 102, "hello from another channel"),
+      makeRow(2, 0, 103, "hello from a failed insert")
+    });
+
+    std::vector<SearchHit> hits;
+    SearchQuery query;
+    query.text = "HELLO";
+    index.search(query, hits);
+    // newest first, the row without an id was never indexed
+    EXPECT_EQ(ids(hits), (std::vector<int>{ 3, 2, 1 }));
+
+    // every term has to match
+    hits.clear();
+    query.text = "world hello";
+    index.search(query, hits);
+    EXPECT_EQ(ids(hits), (std::vector<int>{ 2, 1 }));
+
+    // scoped to a channel
+    hits.clear();
+    query.text = "hello";
+    query.channels = { 2 };
+    index.search(query, hits);
+    EXPECT_EQ(ids(hits), (std::vector<int>{ 3 }));
+
+    // paging continues after the last hit seen
+    hits.clear();
+    query.channels.clear();
+    query.limit = 2;
+    index.search(query, hits);
+    ASSERT_EQ(hits.size(), 2);
+    query.after = hits.back();
+    hits.clear();
+    index.search(query, hits);
+    EXPECT_EQ(ids(hits), (std::vector<int>{ 1 }));
+  }
+
+  TEST_F(MessageIndexTest, TestSegments) {
+    // flush after every message & merge once there are more than two segments
+    MessageIndexOptions options{ 1, 2 };
+    {
+      MessageIndex index(INDEX_DIR, options);
+      for (int id = 1; id <= 5; id++) {
+        index.add({ makeRow(1, id, 1000 + id, "segment " + std::to_string(id)) });
+        index.flush();
+      }
+      EXPECT_EQ(index.persistedThrough(), 1005);
+      // a live posting, written out when the index closes
+      index.add({ makeRow(1, 6, 1006, "segment six") });
+    }
+    size_t files = 0;
+    for (const auto& entry : std::filesystem::directory_iterator(INDEX_DIR))
+      files += entry.path().extension() == ".seg";
+    EXPECT_LE(files, 3);
+
+    MessageIndex index(INDEX_DIR, options);
+    std::vector<SearchHit> hits;
+    SearchQuery query;
+    query.text = "segment";
+    index.search(query, hits);
+    EXPECT_EQ(ids(hits), (std::vector<int>{ 6, 5, 4, 3, 2, 1 }));
+    EXPECT_EQ(index.persistedThrough(), 1006);
+  }
+
+  TEST_F(MessageIndexTest, TestIntersectsAcrossSegments) {
+    MessageIndex index(INDEX_DIR);
+    // postings of both terms spread over two segments & the live map, one
+    // message indexed twice
+    index.add({
+      makeRow(1, 1, 100, "alpha beta"),
+      makeRow(1, 2, 101, "alpha"),
+      makeRow(1, 3, 102, "beta gamma alpha")
+    });
+    index.flush();
+    index.add({
+      makeRow(2, 4, 103, "beta"),
+      makeRow(2, 5, 104, "alpha beta"),
+      makeRow(1, 3, 102, "beta gamma alpha")
+    });
+    index.flush();
+    index.add({
+      makeRow(1, 6, 105, "beta alpha"),
+      makeRow(1, 7, 106, "gamma")
+    });
+
+    std::vector<SearchHit> hits;
+    SearchQuery query;
+    query.text = "alpha beta";
+    query.limit = 3;
+    index.search(query, hits);
+    EXPECT_EQ(ids(hits), (std::vector<int>{ 6, 5, 3 }));
+
+    query.after = hits.back();
+    hits.clear();
+    index.search(query, hits);
+    EXPECT_EQ(ids(hits), (std::vector<int>{ 1 }));
+
+    hits.clear();
+    query = SearchQuery{};
+    query.text = "beta alpha";
+    query.channels = { 1 };
+    index.search(query, hits);
+    EXPECT_EQ(ids(hits), (std::vector<int>{ 6, 3, 1 }));
+  }
+}
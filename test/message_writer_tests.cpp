@@ -0,0 +1,183 @@
+/*
+This file is part of Wrongthink.
+
+Wrongthink - Modern, open & performant chat protocol. Based on gRPC.
+Copyright (C) 2020 Ophiuchus2
+
+This program is free software: you can redistribute it and/or modify it under the
+terms of the GNU Affero General Public License as published by the Free Software Foundation,
+either version 3 of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License along with this program.
+If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "gtest/gtest.h"
+#include "DB/MessageWriter.h"
+#include "DB/DBSQLite.h"
+#include <mutex>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <filesystem>
+#include <stdexcept>
+#include <atomic>
+
+namespace {
+
+  const std::string WRITER_DB = "message_writer_test.db";
+
+  /* sqlite doesn't enforce the message foreign keys, so rows that can't be
+     inserted are simulated: any insert holding a "poison" row fails, & every
+     insert fails while down is set */
+  class PoisonDB : public SQLiteDB {
+  public:
+    using SQLiteDB::SQLiteDB;
+
+    void insertMessages(soci::session &sql, std::vector<MessageRow>& rows) override {
+      if (down)
+        throw std::runtime_error("database down");
+      for (const MessageRow& r : rows)
+        if (r.text == "poison")
+          throw std::runtime_error("poisoned row");
+      SQLiteDB::insertMessages(sql, rows);
+    }
+
+    std::atomic<bool> down{false};
+  };
+
+  WrongthinkMessage makeMessage(int channel, const std::string& text) {
+    WrongthinkMessage msg;
+    msg.set_channelid(channel);
+    msg.set_userid(1);
+    msg.set_text(text);
+    msg.set_date(1000);
+    return msg;
+  }
+
+  class MessageWriterTest : public ::testing::Test {
+  protected:
+    void SetUp() override {
+      removeFiles();
+      db = std::make_shared<PoisonDB>(WRITER_DB);
+      db->clear();
+      db->validate();
+    }
+
+    void TearDown() override {
+      db.reset();
+      removeFiles();
+    }
+
+    void removeFiles() {
+      for (const char* suffix : { "", "-wal", "-shm" })
+        std::filesystem::remove(WRITER_DB + suffix);
+    }
+
+    int storedRows(const std::string& text = "") {
+      DBSession sql = db->getSociSession();
+      int count = 0;
+      if (text.empty())
+        sql << "select count(*) from message", soci::into(count);
+      else
+        sql << "select count(*) from message where mtext = :text", soci::use(text), soci::into(count);
+      return count;
+    }
+
+    std::shared_ptr<PoisonDB> db;
+    std::shared_ptr<spdlog::logger> logger = std::make_shared<spdlog::logger>("message_writer_test");
+  };
+
+  TEST_F(MessageWriterTest, TestBadRowKeepsItsBatch) {
+    std::mutex mutex;
+    std::vector<MessageRow> committed;
+    MessageWriter writer(db, logger, MessageWriterOptions{}, [&](const std::vector<MessageRow>& rows) {
+      std::lock_guard<std::mutex> lock(mutex);
+      committed.insert(committed.end(), rows.begin(), rows.end());
+    });
+
+    // enqueued together, so they are committed as one batch
+    std::vector<WrongthinkMessage> msgs;
+    for (const std::string& text : { "one", "two", "poison", "three", "four" })
+      msgs.push_back(makeMessage(1, text));
+    writer.enqueue(std::move(msgs));
+    writer.flush();
+
+    // the batch insert fails, the row by row retry keeps the good rows
+    EXPECT_EQ(storedRows(), 4);
+    EXPECT_EQ(storedRows("poison"), 0);
+    std::lock_guard<std::mutex> lock(mutex);
+    ASSERT_EQ(committed.size(), 5);
+    for (const MessageRow& r : committed) {
+      if (r.text == "poison")
+        EXPECT_EQ(r.id, 0);
+      else
+        EXPECT_NE(r.id, 0);
+    }
+  }
+
+  TEST_F(MessageWriterTest, TestFlushPersistsEverything) {
+    MessageWriterOptions options;
+    options.maxBatch = 16;
+    MessageWriter writer(db, logger, options);
+    for (int i = 0; i < 100; i++)
+      writer.enqueue(makeMessage(1 + i % 2, "msg" + std::to_string(i)));
+    writer.enqueue(makeMessage(3, "last"));
+
+    writer.flushChannel(3);
+    EXPECT_EQ(storedRows("last"), 1);
+    writer.flush();
+    EXPECT_EQ(storedRows(), 101);
+  }
+
+  TEST_F(MessageWriterTest, TestStopPersistsQueued) {
+    MessageWriterOptions options;
+    // a partial batch would wait far longer than the test runs
+    options.maxDelay = std::chrono::hours(1);
+    {
+      MessageWriter writer(db, logger, options);
+      for (int i = 0; i < 10; i++)
+        writer.enqueue(makeMessage(1, "msg" + std::to_string(i)));
+      // destroying the writer stops it, stop() commits what is queued
+    }
+    EXPECT_EQ(storedRows(), 10);
+  }
+
+  TEST_F(MessageWriterTest, TestBackpressureWhileDown) {
+    db->down = true;
+    MessageWriterOptions options;
+    options.maxBatch = 1;
+    options.maxQueued = 2;
+    options.enqueueTimeout = std::chrono::milliseconds(200);
+    options.maxRetries = 1000;
+    options.retryDelay = std::chrono::milliseconds(5);
+    MessageWriter writer(db, logger, options);
+
+    // the writer keeps retrying the first row, two more fit in the queue
+    for (const std::string& text : { "one", "two", "three" })
+      EXPECT_TRUE(writer.enqueue(makeMessage(1, text)));
+    EXPECT_FALSE(writer.enqueue(makeMessage(1, "four")));
+
+    // nothing was dropped while the database was down
+    db->down = false;
+    writer.flush();
+    EXPECT_EQ(storedRows(), 3);
+    MessageWriter::Stats stats = writer.stats();
+    EXPECT_EQ(stats.committed, 3);
+    EXPECT_EQ(stats.failed, 0);
+    EXPECT_EQ(stats.rejected, 1);
+  }
+
+  TEST_F(MessageWriterTest, TestEnqueueAfterStop) {
+    MessageWriter writer(db, logger);
+    writer.stop();
+    EXPECT_FALSE(writer.enqueue(makeMessage(1, "late")));
+    // nothing is pending for the channel, so this returns right away
+    writer.flushChannel(1);
+    writer.flush();
+    EXPECT_EQ(storedRows(), 0);
+  }
+}
@@ -22,6 +22,9 @@ If not, see <https://www.gnu.org/licenses/>.
 #include <vector>
 #include <iostream>
 #include <thread>
+#include <atomic>
+#include <filesystem>
+#include <climits>
 #include "spdlog/spdlog.h"
 #include "spdlog/sinks/stdout_color_sinks.h"
 #include "spdlog/sinks/basic_file_sink.h"
@@ -115,6 +118,8 @@ namespace {
       coinfigureLog();
       db = GetParam();
       service.reset(new WrongthinkServiceImpl(db, logger_));
+      search.reset(new WrongthinkSearchServiceImpl(*service));
+      batches.reset(new WrongthinkListenServiceImpl(*service));
       //db = std::make_shared<DBPostgres>( "wrongthink", "test", "testdb" );
       db->clear();
       db->validate();
@@ -133,6 +138,8 @@ namespace {
         //std::make_shared<WrongthinkTokenAuth::WrongthinkAuthMetadataProcessor>(true));
       builder.AddListeningPort(server_address_, grpc::InsecureServerCredentials());
       builder.RegisterService(service.get());
+      builder.RegisterService(search.get());
+      builder.RegisterService(batches.get());
       builder.experimental().SetInterceptorCreators(std::move(creators));
       this->server_ = builder.BuildAndStart();
       logger_->info("test server listening on {}", server_address_);
@@ -183,7 +190,7 @@ namespace {
       ureq.set_uname("user1");
       ureq.set_password("upass");
       ureq.set_admin(true);
-      Status st = service->CreateUser(nullptr, (req) ? req : &ureq, &uresp);
+      Status st = service->CreateUserImpl((req) ? req : &ureq, &uresp);
       if (st.ok())
         users.push_back(uresp);
       return st;
@@ -198,7 +205,7 @@ namespace {
       mc.set_adminid(users[0].userid());
       mc.set_public_(true);
 
-      Status st = service->CreateWrongthinkCommunity(nullptr, (req) ? req : &mc,
+      Status st = service->CreateWrongthinkCommunityImpl((req) ? req : &mc,
         &communityResp);
       if (st.ok())
         communities.push_back(communityResp);
@@ -215,7 +222,7 @@ namespace {
       mch.set_anonymous(true);
       mch.set_adminid(users[0].userid());
 
-      Status st = service->CreateWrongthinkChannel(nullptr,
+      Status st = service->CreateWrongthinkChannelImpl(
                         (req) ? req : &mch, &resp);
       if (st.ok())
         channels.push_back(resp);
@@ -223,7 +230,7 @@ namespace {
     }
 
     Status setupAdmin() {
-      Status st = service->GenerateUser(nullptr, nullptr, &admin_);
+      Status st = service->GenerateUserImpl(nullptr, &admin_);
       return st;
     }
 
@@ -235,6 +242,8 @@ namespace {
     WrongthinkUser mUResp;
     std::shared_ptr<spdlog::logger> logger_;
     std::shared_ptr<WrongthinkServiceImpl> service = std::make_shared<WrongthinkServiceImpl>(db, logger_);
+    std::unique_ptr<WrongthinkSearchServiceImpl> search;
+    std::unique_ptr<WrongthinkListenServiceImpl> batches;
     // server members
     std::string server_address_;
     std::unique_ptr<Server> server_;
@@ -383,10 +392,33 @@ namespace {
 
   }
 
+  TEST_P(RpcSuiteTest, TestMigrations) {
+    // SetUp already migrated a fresh database, a second run must be a no-op
+    db->validate();
+
+    DBSession sql = db->getSociSession();
+    int version = 0, count = 0;
+    sql << "select max(version) from schema_version", into(version);
+    sql << "select count(*) from schema_version", into(count);
+    EXPECT_EQ(version, 3);
+    EXPECT_EQ(count, 3);
+  }
+
+  TEST_P(RpcSuiteTest, TestAuthCache) {
+    // the miss is cached, creating the user must invalidate it
+    EXPECT_FALSE(db->isUserValid("cached", "token"));
+    int admin = false;
+    db->createUser("cached", "token", admin);
+    EXPECT_TRUE(db->isUserValid("cached", "token"));
+    EXPECT_FALSE(db->isUserValid("cached", "wrong"));
+    EXPECT_FALSE(db->isUserAdmin("cached"));
+    EXPECT_TRUE(db->isUserAdmin(admin_.uname()));
+  }
+
   TEST_P(RpcSuiteTest, TestGenerateUser) {
     auto db = GetParam();
     WrongthinkUser resp;
-    Status st = service->GenerateUser(nullptr, nullptr, &resp);
+    Status st = service->GenerateUserImpl(nullptr, &resp);
     std::cout << "TestGenerateUser: uname: " << resp.uname()
               << " token: " << resp.token() << std::endl;
     ASSERT_TRUE(st.ok());
@@ -402,6 +434,13 @@ namespace {
     // negative case
     st = setupUser(resp, nullptr);
     ASSERT_TRUE(!st.ok());
+
+    // ':' is reserved for server markers like gaps
+    CreateUserRequest gap;
+    gap.set_uname(GAP_MARKER_UNAME);
+    gap.set_password("pass");
+    st = setupUser(resp, &gap);
+    EXPECT_EQ(st.error_code(), StatusCode::INVALID_ARGUMENT);
   }
 
   TEST_P(RpcSuiteTest, TestCreateCommunity) {
@@ -614,12 +653,17 @@ namespace {
     msg2.set_userid(uresp.userid());
     msg2.set_text("msg2");
 
-    st = service->SendWrongthinkMessageWeb(nullptr, &msg1, nullptr);
+    st = service->SendWrongthinkMessageWebImpl(&msg1, nullptr);
     ASSERT_TRUE(st.ok());
 
-    st = service->SendWrongthinkMessageWeb(nullptr, &msg2, nullptr);
+    st = service->SendWrongthinkMessageWebImpl(&msg2, nullptr);
     ASSERT_TRUE(st.ok());
 
+    // forged gap markers never reach listeners
+    WrongthinkMessage forged = makeGapMarker(chresp.channelid(), 10, 0);
+    st = service->SendWrongthinkMessageWebImpl(&forged, nullptr);
+    EXPECT_EQ(st.error_code(), StatusCode::INVALID_ARGUMENT);
+
     // get message test
     ServerWriterWrapper< WrongthinkMessage> getMessageWrapper;
     GetWrongthinkMessagesRequest getMsgReq;
@@ -649,6 +693,275 @@ namespace {
     EXPECT_EQ(rMsg2.text(), "msg2");
   }
 
+  TEST_P(RpcSuiteTest, TestMessagePaging) {
+    const int COUNT = 10;
+    WrongthinkUser uresp;
+    Status st = setupUser(uresp, nullptr);
+    ASSERT_TRUE(st.ok());
+
+    WrongthinkCommunity cresp;
+    st = setupCommunity(cresp, nullptr);
+    ASSERT_TRUE(st.ok());
+
+    WrongthinkChannel chresp;
+    st = setupChannel(chresp, nullptr);
+    ASSERT_TRUE(st.ok());
+
+    ServerReaderWrapper< WrongthinkMessage> sendWrapper;
+    for (int i = 0; i < COUNT; i++) {
+      WrongthinkMessage msg;
+      msg.set_channelid(chresp.channelid());
+      msg.set_userid(uresp.userid());
+      msg.set_text("msg" + std::to_string(i));
+      sendWrapper.getObjList().push_back(msg);
+    }
+    st = service->SendWrongthinkMessageImpl(&sendWrapper, nullptr);
+    ASSERT_TRUE(st.ok());
+
+    // queued messages are served without an id, paging needs them committed
+    auto page = [&](int limit, int afterid) {
+      ServerWriterWrapper< WrongthinkMessage> wrapper;
+      GetWrongthinkMessagesRequest req;
+      req.set_channelid(chresp.channelid());
+      req.set_limit(limit);
+      req.set_afterid(afterid);
+      EXPECT_TRUE(service->GetWrongthinkMessagesImpl(&req, &wrapper).ok());
+      return wrapper.getObjList();
+    };
+
+    // newest page, oldest first
+    std::vector<WrongthinkMessage> newest = page(3, 0);
+    ASSERT_EQ(newest.size(), 3);
+    EXPECT_EQ(newest[2].text(), "msg9");
+    service->flushMessages();
+    newest = page(3, 0);
+    ASSERT_EQ(newest.size(), 3);
+    EXPECT_NE(newest[0].messageid(), 0);
+    EXPECT_EQ(newest[0].text(), "msg7");
+    EXPECT_EQ(newest[2].text(), "msg9");
+
+    // page backwards from the oldest message seen
+    std::vector<WrongthinkMessage> before = page(-3, newest[0].messageid());
+    ASSERT_EQ(before.size(), 3);
+    EXPECT_EQ(before[0].text(), "msg4");
+    EXPECT_EQ(before[2].text(), "msg6");
+
+    // and forwards again
+    std::vector<WrongthinkMessage> after = page(2, before[2].messageid());
+    ASSERT_EQ(after.size(), 2);
+    EXPECT_EQ(after[0].text(), "msg7");
+    EXPECT_EQ(after[1].text(), "msg8");
+
+    // default page holds the whole history here
+    EXPECT_EQ(page(0, 0).size(), COUNT);
+
+    // out of range limits clamp to the largest page
+    EXPECT_EQ(page(INT_MIN, after[1].messageid()).size(), COUNT - 2);
+    EXPECT_EQ(page(INT_MAX, 0).size(), COUNT);
+  }
+
+  TEST_P(RpcSuiteTest, TestSearch) {
+    WrongthinkUser uresp;
+    ASSERT_TRUE(setupUser(uresp, nullptr).ok());
+    WrongthinkCommunity cresp;
+    ASSERT_TRUE(setupCommunity(cresp, nullptr).ok());
+    WrongthinkChannel chresp;
+    ASSERT_TRUE(setupChannel(chresp, nullptr).ok());
+
+    SearchMessagesRequest req;
+    req.set_text("needle");
+    ServerWriterWrapper< WrongthinkMessage> disabled;
+    EXPECT_EQ(service->SearchMessagesImpl(&req, &disabled).error_code(), StatusCode::UNIMPLEMENTED);
+
+    std::filesystem::remove_all("search_index_test");
+    service->setSearchIndex(std::make_shared<MessageIndex>("search_index_test"));
+
+    ServerReaderWrapper< WrongthinkMessage> sendWrapper;
+    for (const std::string& text : { "a needle here", "only hay", "another Needle" }) {
+      WrongthinkMessage msg;
+      msg.set_channelid(chresp.channelid());
+      msg.set_userid(uresp.userid());
+      msg.set_text(text);
+      sendWrapper.getObjList().push_back(msg);
+    }
+    ASSERT_TRUE(service->SendWrongthinkMessageImpl(&sendWrapper, nullptr).ok());
+    // the writer feeds the index as it commits
+    service->flushMessages();
+
+    req.set_communityid(cresp.communityid());
+    ServerWriterWrapper< WrongthinkMessage> results;
+    ASSERT_TRUE(service->SearchMessagesImpl(&req, &results).ok());
+    ASSERT_EQ(results.getObjList().size(), 2);
+    EXPECT_EQ(results.getObjList()[0].text(), "another Needle");
+    EXPECT_EQ(results.getObjList()[1].text(), "a needle here");
+    EXPECT_EQ(results.getObjList()[0].uname(), uresp.uname());
+
+    // the same search through the rpc
+    auto searchStub = wrongthinksearch::NewStub(server_->InProcessChannel({}));
+    grpc::ClientContext ctx;
+    std::unique_ptr<grpc::ClientReader< WrongthinkMessage>> reader(searchStub->SearchMessages(&ctx, req));
+    std::vector<WrongthinkMessage> received;
+    WrongthinkMessage msg;
+    while (reader->Read(&msg))
+      received.push_back(msg);
+    ASSERT_TRUE(reader->Finish().ok());
+    ASSERT_EQ(received.size(), 2);
+    EXPECT_EQ(received[0].text(), "another Needle");
+    EXPECT_EQ(received[1].text(), "a needle here");
+
+    // a community without channels has nothing to search
+    req.set_communityid(cresp.communityid() + 1);
+    ServerWriterWrapper< WrongthinkMessage> none;
+    ASSERT_TRUE(service->SearchMessagesImpl(&req, &none).ok());
+    EXPECT_TRUE(none.getObjList().empty());
+
+    service->setSearchIndex(nullptr);
+    std::filesystem::remove_all("search_index_test");
+  }
+
+  TEST_P(RpcSuiteTest, TestListenBatches) {
+    WrongthinkUser uresp;
+    ASSERT_TRUE(setupUser(uresp, nullptr).ok());
+    WrongthinkCommunity cresp;
+    ASSERT_TRUE(setupCommunity(cresp, nullptr).ok());
+    WrongthinkChannel chresp;
+    ASSERT_TRUE(setupChannel(chresp, nullptr).ok());
+
+    auto batchStub = wrongthinklisten::NewStub(server_->InProcessChannel({}));
+    grpc::ClientContext ctx;
+    ListenWrongthinkMessagesRequest req;
+    req.set_channelid(chresp.channelid());
+    std::unique_ptr<grpc::ClientReader< WrongthinkMessageBatch>> reader(
+      batchStub->ListenWrongthinkMessageBatches(&ctx, req));
+
+    const size_t COUNT = 3;
+    std::vector<WrongthinkMessage> received;
+    std::atomic<size_t> receivedCount{0};
+    std::thread listener([&]() {
+      WrongthinkMessageBatch batch;
+      while (receivedCount.load() < COUNT && reader->Read(&batch)) {
+        EXPECT_GT(batch.messages_size(), 0);
+        received.insert(received.end(), batch.messages().begin(), batch.messages().end());
+        receivedCount.store(received.size());
+      }
+    });
+
+    // the stream only carries messages published after it attached, keep
+    // publishing until the listener saw enough of them
+    for (int i = 0; i < 100 && receivedCount.load() < COUNT; i++) {
+      WrongthinkMessage msg;
+      msg.set_channelid(chresp.channelid());
+      msg.set_userid(uresp.userid());
+      msg.set_uname(uresp.uname());
+      msg.set_text("msg" + std::to_string(i));
+      Status st = service->SendWrongthinkMessageWebImpl(&msg, nullptr);
+      EXPECT_TRUE(st.ok());
+      if (!st.ok())
+        break;
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    ctx.TryCancel();
+    listener.join();
+    reader->Finish();
+
+    ASSERT_GE(received.size(), COUNT);
+    for (const WrongthinkMessage& msg : received) {
+      EXPECT_EQ(msg.channelid(), chresp.channelid());
+      EXPECT_EQ(msg.uname(), uresp.uname());
+      EXPECT_EQ(msg.text().rfind("msg", 0), 0);
+    }
+  }
+
+  TEST_P(RpcSuiteTest, TestIndexBacklog) {
+    WrongthinkUser uresp;
+    ASSERT_TRUE(setupUser(uresp, nullptr).ok());
+    WrongthinkCommunity cresp;
+    ASSERT_TRUE(setupCommunity(cresp, nullptr).ok());
+    WrongthinkChannel chresp;
+    ASSERT_TRUE(setupChannel(chresp, nullptr).ok());
+
+    // more than a page of history, sent within a second or two so whole
+    // pages share a date. only the last message matches
+    ServerReaderWrapper< WrongthinkMessage> sendWrapper;
+    for (int i = 0; i <= MAX_MESSAGE_PAGE; i++) {
+      WrongthinkMessage msg;
+      msg.set_channelid(chresp.channelid());
+      msg.set_userid(uresp.userid());
+      msg.set_text(i == MAX_MESSAGE_PAGE ? "straggler" : "hay");
+      sendWrapper.getObjList().push_back(msg);
+    }
+    ASSERT_TRUE(service->SendWrongthinkMessageImpl(&sendWrapper, nullptr).ok());
+    service->flushMessages();
+
+    std::filesystem::remove_all("search_index_test");
+    service->setSearchIndex(std::make_shared<MessageIndex>("search_index_test"));
+    service->indexBacklog();
+
+    SearchMessagesRequest req;
+    req.set_text("straggler");
+    req.set_channelid(chresp.channelid());
+    ServerWriterWrapper< WrongthinkMessage> results;
+    ASSERT_TRUE(service->SearchMessagesImpl(&req, &results).ok());
+    ASSERT_EQ(results.getObjList().size(), 1);
+    EXPECT_EQ(results.getObjList()[0].text(), "straggler");
+
+    service->setSearchIndex(nullptr);
+    std::filesystem::remove_all("search_index_test");
+  }
+
+  TEST_P(RpcSuiteTest, TestRetention) {
+    int admin = true;
+    int uid = db->createUser("keeper", "token", admin);
+    int community = db->createCommunity("short memory", uid, true);
+    int channel = db->createChannel("fading", community, uid, true);
+
+    DBSession sql = db->getSociSession();
+    int old = std::time(nullptr) - 3 * 86400;
+    sql << "insert into message (user_id, channel, mtext, mdate) values(:u, :c, 'old', :d)",
+        use(uid), use(channel), use(old);
+    sql << "insert into message (user_id, channel, mtext) values(:u, :c, 'new')",
+        use(uid), use(channel);
+
+    auto count = [&]() {
+      std::vector<WrongthinkMessage> messages;
+      db->getChannelMessages(sql, channel, MessagePage{}, messages);
+      return messages.size();
+    };
+    // no retention keeps everything
+    EXPECT_EQ(count(), 2);
+
+    std::dynamic_pointer_cast<DBPostgres>(db)->setCommunityRetention(community, 1);
+    EXPECT_EQ(count(), 1);
+  }
+
+  TEST(ReplicaTest, TestReadRouting) {
+    // a replica file holding a community the primary doesn't have
+    {
+      SQLiteDB replica("sqlite_replica.db");
+      replica.clear();
+      replica.validate();
+      int admin = true;
+      int uid = replica.createUser("replica", "token", admin);
+      replica.createCommunity("replica community", uid, true);
+    }
+    SQLiteDB primary("sqlite.db");
+    primary.clear();
+    primary.validate();
+    primary.setReplicas({ "sqlite_replica.db" });
+
+    auto count = [&primary]() {
+      DBSession sql = primary.getReadSession("communities");
+      int n = 0;
+      sql << "select count(*) from communities", into(n);
+      return n;
+    };
+    EXPECT_EQ(count(), 1);
+    // read your writes, the primary answers until the window passes
+    primary.noteWrite("communities");
+    EXPECT_EQ(count(), 0);
+    primary.clear();
+  }
+
   auto tValues = ::testing::Values(
                 std::make_shared<SQLiteDB>("sqlite.db"), 
                 std::make_shared<DBPostgres>( "wrongthink", "test", "testdb" )
@@ -0,0 +1,185 @@
+/*
+This file is part of Wrongthink.
+
+Wrongthink - Modern, open & performant chat protocol. Based on gRPC.
+Copyright (C) 2020 Ophiuchus2
+
+This program is free software: you can redistribute it and/or modify it under the
+terms of the GNU Affero General Public License as published by the Free Software Foundation,
+either version 3 of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License along with this program.
+If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "gtest/gtest.h"
+#include "DB/SegmentLog.h"
+#include <vector>
+#include <string>
+#include <filesystem>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+
+  const std::string LOG_DIR = "segment_log_test";
+
+  std::vector<MessageRow> makeRows(int channel, int count, int firstDate = 1000) {
+    std::vector<MessageRow> rows;
+    for (int i = 0; i < count; i++)
+      rows.push_back(MessageRow{ 1, channel, 0, false, "msg" + std::to_string(i), firstDate + i });
+    return rows;
+  }
+
+  std::vector<std::string> texts(const std::vector<MessageRow>& rows) {
+    std::vector<std::string> out;
+    for (const MessageRow& row : rows)
+      out.push_back(row.text);
+    return out;
+  }
+
+  class SegmentLogTest : public ::testing::Test {
+  protected:
+    void SetUp() override { std::filesystem::remove_all(LOG_DIR); }
+    void TearDown() override { std::filesystem::remove_all(LOG_DIR); }
+    // small segments & a sparse index so the tests cross both
+    SegmentLogOptions options{ 256, 4 };
+  };
+
+  TEST_F(SegmentLogTest, TestPages) {
+    SegmentLog log(LOG_DIR, options);
+    std::vector<MessageRow> rows = makeRows(1, 20);
+    log.append(rows);
+    EXPECT_EQ(rows.front().id, 1);
+    EXPECT_EQ(rows.back().id, 20);
+
+    MessagePage page;
+    page.limit = 3;
+    std::vector<MessageRow> out;
+    log.readPage(1, page, out);
+    EXPECT_EQ(texts(out), (std::vector<std::string>{ "msg17", "msg18", "msg19" }));
+
+    out.clear();
+    page.anchor = MessagePage::Anchor::BEFORE_ID;
+    page.key = 18;
+    log.readPage(1, page, out);
+    EXPECT_EQ(texts(out), (std::vector<std::string>{ "msg14", "msg15", "msg16" }));
+
+    out.clear();
+    page.anchor = MessagePage::Anchor::AFTER_ID;
+    page.key = 2;
+    log.readPage(1, page, out);
+    EXPECT_EQ(texts(out), (std::vector<std::string>{ "msg2", "msg3", "msg4" }));
+
+    out.clear();
+    page.anchor = MessagePage::Anchor::AFTER_DATE;
+    page.key = 1009;
+    log.readPage(1, page, out);
+    EXPECT_EQ(texts(out), (std::vector<std::string>{ "msg10", "msg11", "msg12" }));
+
+    // unknown channels read empty
+    out.clear();
+    log.readPage(2, page, out);
+    EXPECT_TRUE(out.empty());
+  }
+
+  TEST_F(SegmentLogTest, TestReopenContinuesIds) {
+    {
+      SegmentLog log(LOG_DIR, options);
+      std::vector<MessageRow> rows = makeRows(1, 10);
+      log.append(rows);
+    }
+    SegmentLog log(LOG_DIR, options);
+    std::vector<MessageRow> rows = makeRows(1, 1);
+    log.append(rows);
+    EXPECT_EQ(rows[0].id, 11);
+
+    MessagePage page;
+    page.anchor = MessagePage::Anchor::AFTER_ID;
+    page.limit = 100;
+    std::vector<MessageRow> out;
+    log.readPage(1, page, out);
+    ASSERT_EQ(out.size(), 11);
+    for (int i = 0; i < 11; i++)
+      EXPECT_EQ(out[i].id, i + 1);
+  }
+
+  TEST_F(SegmentLogTest, TestTornTailIsDropped) {
+    std::string segment;
+    {
+      SegmentLog log(LOG_DIR, options);
+      std::vector<MessageRow> rows = makeRows(1, 2);
+      log.append(rows);
+    }
+    for (const auto& entry : std::filesystem::directory_iterator(LOG_DIR + "/1"))
+      if (entry.path().extension() == ".log")
+        segment = std::max(segment, entry.path().string());
+    ASSERT_FALSE(segment.empty());
+
+    // flip a byte in the last record's text, as if the crash hit mid write
+    MessagePage page;
+    page.anchor = MessagePage::Anchor::AFTER_ID;
+    {
+      SegmentLog log(LOG_DIR, options);
+      std::vector<MessageRow> out;
+      log.readPage(1, page, out);
+      ASSERT_EQ(out.size(), 2);
+    }
+    int fd = open(segment.c_str(), O_RDWR);
+    ASSERT_GE(fd, 0);
+    // 8 byte header, 21 bytes of fixed fields & the text, which ends the record
+    const off_t RECORD = 8 + 21 + 4;
+    ASSERT_EQ(pwrite(fd, "x", 1, 2 * RECORD - 1), 1);
+    close(fd);
+
+    SegmentLog log(LOG_DIR, options);
+    std::vector<MessageRow> out;
+    log.readPage(1, page, out);
+    ASSERT_EQ(out.size(), 1);
+    EXPECT_EQ(out[0].text, "msg0");
+
+    // the torn record's id is handed out again
+    std::vector<MessageRow> rows = makeRows(1, 1);
+    log.append(rows);
+    EXPECT_EQ(rows[0].id, 2);
+  }
+
+  TEST_F(SegmentLogTest, TestPageLimitIgnoresPriorRows) {
+    SegmentLog log(LOG_DIR, options);
+    std::vector<MessageRow> rows = makeRows(1, 10);
+    log.append(rows);
+
+    MessagePage page;
+    page.limit = 2;
+    std::vector<MessageRow> out = makeRows(2, 3);
+    log.readPage(1, page, out);
+    EXPECT_EQ(texts(out), (std::vector<std::string>{ "msg0", "msg1", "msg2", "msg8", "msg9" }));
+  }
+
+  TEST_F(SegmentLogTest, TestIdleChannelsAreClosed) {
+    options.maxOpenChannels = 1;
+    SegmentLog log(LOG_DIR, options);
+    // every append opens the other channel & closes the idle one
+    for (int i = 0; i < 3; i++) {
+      for (int channel = 1; channel <= 2; channel++) {
+        std::vector<MessageRow> rows = makeRows(channel, 5);
+        log.append(rows);
+        EXPECT_EQ(rows.back().id, 5 * (i + 1));
+      }
+    }
+
+    MessagePage page;
+    page.anchor = MessagePage::Anchor::AFTER_ID;
+    page.limit = 100;
+    for (int channel = 1; channel <= 2; channel++) {
+      std::vector<MessageRow> out;
+      log.readPage(channel, page, out);
+      ASSERT_EQ(out.size(), 15);
+      for (int i = 0; i < 15; i++)
+        EXPECT_EQ(out[i].id, i + 1);
+    }
+  }
+}
@@ -22,7 +22,16 @@ If not, see <https://www.gnu.org/licenses/>.
 #include <map>
 #include <ctime>
 #include <csignal>
+#include <cstdlib>
 #include <string_view>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <fstream>
+#include <algorithm>
+#ifdef __linux__
+#include <pthread.h>
+#endif
 
 #include "spdlog/spdlog.h"
 #include "spdlog/sinks/stdout_color_sinks.h"
@@ -34,7 +43,11 @@ If not, see <https://www.gnu.org/licenses/>.
 #include "WrongthinkConfig.h"
 #include "DB/DBInterface.h"
 #include "DB/DBPostgres.h"
+#include "DB/DBSQLite.h"
+#include "DB/SegmentLog.h"
+#include "DB/MessageIndex.h"
 #include "WrongthinkServiceImpl.h"
+#include "ServerConfig.h"
 
 #include "Authentication/WrongthinkTokenAuthenticator.h"
 
@@ -49,10 +62,36 @@ inline std::string_view to_string_view(const grpc::string_ref& s) {
   return {s.data(), s.length()};
 }
 
+// set from the signal handler, RunServer shuts the server down gracefully so
+// the message writer can commit whatever is still queued
+static std::atomic<int> shutdownSignal{0};
+
 void sigHandler(int num) {
-  logger->info("received signal: {}", num);
-  logger->info("terminating");
-  exit(num);
+  // a second signal doesn't wait for the graceful shutdown
+  if (shutdownSignal.exchange(num))
+    std::_Exit(1);
+}
+
+// how often the executor queue depth & wait times are logged
+constexpr std::chrono::seconds EXECUTOR_STATS_INTERVAL{60};
+
+void logExecutorStats(const char* name, const Executor::Stats& stats) {
+  uint64_t started = stats.completed + stats.active;
+  auto avgWait = started ? stats.totalWait.count() / started : 0;
+  logger->info("{} executor: queued {} active {} completed {} rejected {} wait avg {}us max {}us",
+    name, stats.queued, stats.active, stats.completed, stats.rejected,
+    avgWait, stats.maxWait.count());
+}
+
+void logWriterStats(const MessageWriter::Stats& stats) {
+  logger->info("message writer: queued {} committed {} failed {} rejected {}",
+    stats.queued, stats.committed, stats.failed, stats.rejected);
+}
+
+void logCompressionStats(const char* name, const CompressionStats::Snapshot& stats) {
+  logger->info("{} compression: {}/{} messages compressed, {} bytes ~{} on the wire, ratio {:.2f}, {:.1f}ms cpu/MB",
+    name, stats.compressed, stats.messages, stats.bytes, stats.estimatedWireBytes(),
+    stats.ratio(), stats.cpuMsPerMB());
 }
 
 void coinfigureLog() {
@@ -69,38 +108,179 @@ void coinfigureLog() {
   logger->info("logger started");
 }
 
-void RunServer() {
+/* one grpc server on the shared address. its threads are started from a
+   thread pinned to the instance's cpus & inherit that mask */
+std::unique_ptr<Server> buildServer(const ServerConfig& config, int instance,
+  WrongthinkServiceImpl& service, WrongthinkSearchServiceImpl& search,
+  WrongthinkListenServiceImpl& batches) {
   std::vector<
       std::unique_ptr<grpc::experimental::ServerInterceptorFactoryInterface>>
       creators;
   creators.push_back(
       std::unique_ptr<grpc::experimental::ServerInterceptorFactoryInterface>(
           new WrongthinkInterceptors::LoggingInterceptorFactory(db, logger)));
-  std::string server_address("0.0.0.0:50051");
-  WrongthinkServiceImpl service( db, logger );
 
-  grpc::EnableDefaultHealthCheckService(false);
-  grpc::reflection::InitProtoReflectionServerBuilderPlugin();
   ServerBuilder builder;
   auto server_creds = grpc::InsecureServerCredentials();
   // add server credential processor
   server_creds->SetAuthMetadataProcessor(
     std::make_shared<WrongthinkTokenAuth::WrongthinkAuthMetadataProcessor>(true));
   // Listen on the given address without any authentication mechanism.
-  builder.AddListeningPort(server_address, server_creds);
+  builder.AddListeningPort(config.address, server_creds);
   // Register "service" as the instance through which we'll communicate with
-  // clients. In this case it corresponds to an *synchronous* service.
+  // clients. Streams are served synchronously, unary & listen rpcs use
+  // callback handlers. Every instance shares the one service.
   builder.RegisterService(&service);
+  builder.RegisterService(&search);
+  builder.RegisterService(&batches);
+
+  // every instance binds the same port
+  builder.AddChannelArgument(GRPC_ARG_ALLOW_REUSEPORT, 1);
+  if (config.maxConcurrentStreams)
+    builder.AddChannelArgument(GRPC_ARG_MAX_CONCURRENT_STREAMS, config.maxConcurrentStreams);
+  if (config.keepaliveTimeMs)
+    builder.AddChannelArgument(GRPC_ARG_KEEPALIVE_TIME_MS, config.keepaliveTimeMs);
+  if (config.keepaliveTimeoutMs)
+    builder.AddChannelArgument(GRPC_ARG_KEEPALIVE_TIMEOUT_MS, config.keepaliveTimeoutMs);
+  if (config.keepaliveMinPingIntervalMs)
+    builder.AddChannelArgument(GRPC_ARG_HTTP2_MIN_RECV_PING_INTERVAL_WITHOUT_DATA_MS,
+      config.keepaliveMinPingIntervalMs);
+  if (config.keepalivePermitWithoutCalls)
+    builder.AddChannelArgument(GRPC_ARG_KEEPALIVE_PERMIT_WITHOUT_CALLS, 1);
+
+  if (config.completionQueues)
+    builder.SetSyncServerOption(ServerBuilder::SyncServerOption::NUM_CQS, config.completionQueues);
+  if (config.minPollers)
+    builder.SetSyncServerOption(ServerBuilder::SyncServerOption::MIN_POLLERS, config.minPollers);
+  if (config.maxPollers)
+    builder.SetSyncServerOption(ServerBuilder::SyncServerOption::MAX_POLLERS, config.maxPollers);
+
+  if (config.maxThreads || config.resourceQuotaBytes) {
+    grpc::ResourceQuota quota("wrongthink-" + std::to_string(instance));
+    if (config.maxThreads)
+      quota.SetMaxThreads(config.maxThreads);
+    if (config.resourceQuotaBytes)
+      quota.Resize(config.resourceQuotaBytes);
+    builder.SetResourceQuota(quota);
+  }
 
   logger->info("register interceptors");
   builder.experimental().SetInterceptorCreators(std::move(creators));
-  // Finally assemble the server.
+
+  std::vector<int> cpus = config.instanceCpus(instance);
+#ifdef __linux__
+  // pollers spawned later are started by pollers, so they stay on these cpus
+  cpu_set_t previous;
+  bool pinned = !cpus.empty() &&
+    pthread_getaffinity_np(pthread_self(), sizeof(previous), &previous) == 0 &&
+    pinThread(pthread_self(), cpus);
+#endif
   std::unique_ptr<Server> server(builder.BuildAndStart());
-  logger->info("Server listening on {}", server_address);
-  
-  // Wait for the server to shutdown. Note that some other thread must be
-  // responsible for shutting down the server for this call to ever return.
-  server->Wait();
+#ifdef __linux__
+  if (pinned)
+    pthread_setaffinity_np(pthread_self(), sizeof(previous), &previous);
+#endif
+  if (server)
+    logger->info("server {} listening on {}, {} cpus", instance, config.address, cpus.size());
+  return server;
+}
+
+/* service settings from the config, throws on bad compression levels &
+   slow consumer policies */
+WrongthinkServiceOptions serviceOptions(const ServerConfig& config) {
+  WrongthinkServiceOptions options;
+  if (config.historyThreads)
+    options.historyThreads = config.historyThreads;
+  if (config.unaryThreads)
+    options.unaryThreads = config.unaryThreads;
+  if (!config.historyCompression.empty())
+    options.historyCompression.level = CompressionPolicy::parseLevel(config.historyCompression);
+  if (!config.directoryCompression.empty())
+    options.directoryCompression.level = CompressionPolicy::parseLevel(config.directoryCompression);
+  if (config.compressionMinBytes) {
+    options.historyCompression.minBytes = config.compressionMinBytes;
+    options.directoryCompression.minBytes = config.compressionMinBytes;
+  }
+  if (config.listenerMaxMessages)
+    options.listenerBudget.maxMessages = config.listenerMaxMessages;
+  if (config.listenerMaxBytes)
+    options.listenerBudget.maxBytes = config.listenerMaxBytes;
+  if (!config.listenerPolicy.empty())
+    options.listenerBudget.policy = parseSlowConsumerPolicy(config.listenerPolicy);
+  return options;
+}
+
+void RunServer(const ServerConfig& config, const WrongthinkServiceOptions& options) {
+  WrongthinkServiceImpl service( db, logger, options );
+  WrongthinkSearchServiceImpl search( service );
+  WrongthinkListenServiceImpl batches( service );
+  service.setChannelMemoryBudget(config.channelMemoryBudget);
+  if (!config.executorCpus.empty() && !service.pinExecutors(config.executorCpus))
+    logger->warn("could not pin the database executors");
+
+  // the backlog is indexed while the server runs, search covers older
+  // history as it catches up
+  std::thread backlogThread;
+  if (!config.searchIndex.empty()) {
+    logger->info("search index: {}", config.searchIndex);
+    service.setSearchIndex(std::make_shared<MessageIndex>(config.searchIndex));
+    backlogThread = std::thread([&service]() {
+      try {
+        service.indexBacklog();
+        logger->info("search index caught up");
+      } catch (const std::exception& e) {
+        logger->error("indexing the backlog failed: {}", e.what());
+      }
+    });
+  }
+
+  grpc::EnableDefaultHealthCheckService(false);
+  grpc::reflection::InitProtoReflectionServerBuilderPlugin();
+
+  // independent servers on one port, each with its own completion queues &
+  // pollers, so connections are accepted & polled in parallel
+  std::vector<std::unique_ptr<Server>> servers;
+  for (int i = 0; i < std::max(config.serverInstances, 1); i++) {
+    std::unique_ptr<Server> server = buildServer(config, i, service, search, batches);
+    if (!server) {
+      logger->error("server {} failed to start on {}", i, config.address);
+      shutdownSignal = SIGTERM;
+      break;
+    }
+    servers.push_back(std::move(server));
+  }
+
+  std::thread shutdownThread([&servers, &service, &config]() {
+    auto lastStats = std::chrono::steady_clock::now();
+    while (!shutdownSignal) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+      if (std::chrono::steady_clock::now() - lastStats >= EXECUTOR_STATS_INTERVAL) {
+        lastStats = std::chrono::steady_clock::now();
+        logExecutorStats("unary", service.unaryStats());
+        logExecutorStats("history", service.historyStats());
+        logWriterStats(service.writerStats());
+        logCompressionStats("history", service.historyCompressionStats());
+        logCompressionStats("directory", service.directoryCompressionStats());
+      }
+    }
+    logger->info("received signal: {}", shutdownSignal.load());
+    logger->info("terminating");
+    // listen streams only end when their client leaves, calls still running
+    // at the deadline are cancelled
+    auto deadline = std::chrono::system_clock::now() +
+      std::chrono::milliseconds(config.shutdownGraceMs);
+    for (auto& server : servers)
+      server->Shutdown(deadline);
+  });
+
+  for (auto& server : servers)
+    server->Wait();
+  shutdownThread.join();
+  service.stopIndexBacklog();
+  if (backlogThread.joinable())
+    backlogThread.join();
+  logger->info("committing queued messages");
+  service.drainMessages();
 }
 
 int main(int argc, char** argv) {
@@ -108,15 +288,44 @@ int main(int argc, char** argv) {
   logger->info("wrongthink version: {}.{} ", Wrongthink_VERSION_MAJOR, Wrongthink_VERSION_MINOR);
 
   signal(SIGINT, sigHandler);
+  signal(SIGTERM, sigHandler);
+  ServerConfig config;
+  WrongthinkServiceOptions options;
   try {
+    // settings come from WRONGTHINK_CONFIG (or ./wrongthink.conf when present),
+    // WRONGTHINK_* variables override them
+    const char* configFile = std::getenv("WRONGTHINK_CONFIG");
+    if (configFile) {
+      config.load(configFile);
+    } else if (std::ifstream("wrongthink.conf")) {
+      configFile = "wrongthink.conf";
+      config.load(configFile);
+    }
+    config.applyEnvironment();
+    options = serviceOptions(config);
+    if (configFile)
+      logger->info("configuration: {}", configFile);
+
+    DBPartitionOptions partitions;
+    partitions.retentionDays = config.retentionDays;
+    DBPoolOptions pool;
+    pool.size = config.dbPoolSize;
 
-    if( argc == 2 && strcmp(argv[1], "sqlite") == 0 ) {
-      logger->info("Using sqlite backend");
-      logger->info("Not currently implemented");
-      return 1;
+    if( argc >= 2 && strcmp(argv[1], "sqlite") == 0 ) {
+      // wrongthink sqlite [file], for single node deployments without postgres
+      std::string file = argc >= 3 ? argv[2] : "wrongthink.db";
+      logger->info("Using sqlite backend: {}", file);
+      auto sqlite = std::make_shared<SQLiteDB>(file, pool);
+      sqlite->setPartitioning(partitions);
+      db = sqlite;
     } else {
       logger->info("Using postgres backend");
-      db = std::make_shared<DBPostgres>("wrongthink", "test", "wrongthink");
+      auto postgres = std::make_shared<DBPostgres>(config.dbConnection, pool);
+      partitions.enabled = config.messagePartitions;
+      if (partitions.enabled)
+        logger->info("partitioning messages by month, retention {} days", partitions.retentionDays);
+      postgres->setPartitioning(partitions);
+      db = postgres;
     }
 
     if (argc == 2 && strcmp(argv[1], "clear") == 0) {
@@ -126,13 +335,25 @@ int main(int argc, char** argv) {
     logger->info("validating sql tables.");
 
     db->validate();
+
+    if (!config.dbReplicas.empty()) {
+      logger->info("routing reads to {} replicas", config.dbReplicas.size());
+      DBReplicaOptions replicaOptions;
+      replicaOptions.pool.size = config.dbReplicaPoolSize;
+      db->setReplicas(config.dbReplicas, replicaOptions);
+    }
+
+    if (!config.messageLog.empty()) {
+      logger->info("storing messages in segment log: {}", config.messageLog);
+      db->setMessageStore(std::make_shared<SegmentLog>(config.messageLog));
+    }
   }
   catch (const std::exception& e) {
     // unexpecdted, terminate
     std::cout << e.what() << std::endl;
     return 0;
   }
-  RunServer();
+  RunServer(config, options);
 
   return 0;
 }